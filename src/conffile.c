@@ -0,0 +1,72 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+/* Copyright (c) 2020 Lucas De Marchi <lucas.de.marchi@gmail.com> */
+
+#include "conffile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <c-ini.h>
+#include <c-stdaux.h>
+
+#include "log.h"
+
+/*
+ * Load ini file at @path into @domainp. The caller owns the reference returned. If the file
+ * doesn't exist, return 0 and leave @domainp untouched.
+ */
+int conffile_load(const char *path, CIniDomain **domainp)
+{
+    _c_cleanup_(c_closep) int fd = -1;
+    _c_cleanup_(c_ini_reader_freep) CIniReader *reader = NULL;
+    _c_cleanup_(c_ini_domain_unrefp) CIniDomain *domain = NULL;
+    int r;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            log_error("Could not open %s (%m)\n", path);
+            return -errno;
+        }
+        return 0;
+    }
+
+    r = c_ini_reader_new(&reader);
+    if (r < 0)
+        return r;
+
+    /* clang-format off */
+    c_ini_reader_set_mode(reader,
+                          C_INI_MODE_EXTENDED_WHITESPACE |
+                          C_INI_MODE_MERGE_GROUPS |
+                          C_INI_MODE_OVERRIDE_ENTRIES);
+    /* clang-format on */
+
+    for (;;) {
+        uint8_t buf[1024];
+        ssize_t len;
+
+        len = read(fd, buf, sizeof(buf));
+        if (len < 0)
+            return -errno;
+        else if (len == 0)
+            break;
+
+        r = c_ini_reader_feed(reader, buf, len);
+        if (r < 0)
+            return r;
+    }
+
+    r = c_ini_reader_seal(reader, &domain);
+    if (r < 0)
+        return r;
+
+    /* keep a ref around: this ensures all entries with their values are still valid */
+    *domainp = c_ini_domain_ref(domain);
+
+    return 0;
+}
@@ -0,0 +1,8 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+/* Copyright (c) 2020 Lucas De Marchi <lucas.de.marchi@gmail.com> */
+
+#pragma once
+
+typedef struct CIniDomain CIniDomain;
+
+int conffile_load(const char *path, CIniDomain **domainp);
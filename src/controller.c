@@ -9,131 +9,443 @@
 #include <linux/input.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <c-ini.h>
 #include <c-stdaux.h>
 
+#include "conffile.h"
 #include "event_loop.h"
+#include "histogram.h"
 #include "log.h"
-#include "remote.h"
+#include "macro.h"
+#include "mixer.h"
+#include "output.h"
+#include "record.h"
+#include "shaping.h"
 #include "util.h"
 
 #define REMOTE_UPDATE_INTERVAL 10
+#define MIN_SEND_INTERVAL_USEC (2 * USEC_PER_MSEC)
+#define KEEPALIVE_INTERVAL_USEC (100 * USEC_PER_MSEC)
+#define CHANGE_REDUNDANCY 3
+
+#define MAX_DEVICES 4
+#define CHANNEL_NONE ((int8_t)-1)
+
+/* Older kernel headers don't abstract the time field */
+#ifndef input_event_sec
+#define input_event_sec time.tv_sec
+#define input_event_usec time.tv_usec
+#endif
+
+/* Fallback for devices that reappear without inotify noticing */
+#define DEVICE_RETRY_INTERVAL_USEC USEC_PER_SEC
+
+/* When replaying as fast as possible, let other sources run after this many events */
+#define REPLAY_BATCH 1024
+
+/* Q16 fixed point for axis scaling */
+#define SCALE_SHIFT 16
+#define SCALE_ROUND (1 << (SCALE_SHIFT - 1))
+
+#define PWM_MIN 1000
+#define PWM_CENTER 1500
+#define PWM_MAX 2000
+#define PWM_HALF_RANGE (PWM_MAX - PWM_CENTER)
+
+#define DEFAULT_CALIBRATION_FILE PKGLOCALSTATEDIR "/calibration"
+
+/*
+ * Transform from raw axis value to [PWM_MIN, PWM_MAX]. Each side of the center is scaled by its
+ * own factor so [min, center - deadzone] maps to [PWM_MIN, PWM_CENTER] and
+ * [center + deadzone, max] maps to [PWM_CENTER, PWM_MAX].
+ */
+struct AxisScale {
+    int min;
+    int center;
+    int max;
+    int deadzone;
+    bool reverse;
+
+    /* Precomputed by axis_scale_update() */
+    int32_t mul_lo;
+    int32_t mul_hi;
+};
 
-enum InfoAbs {
-    INFO_ABS_MIN,
-    INFO_ABS_MAX,
-    _INFO_ABS_COUNT,
+/* Extents observed while calibrating */
+struct AxisCalibration {
+    int min;
+    int center;
+    int max;
 };
 
-enum Axis {
-    AXIS_ROLL,
-    AXIS_PITCH,
-    AXIS_THROTTLE,
-    AXIS_YAW,
-    AXIS_AUX_LEFT,
-    _AXIS_COUNT,
+/* Lookup tables from evdev (type, code) to channel, CHANNEL_NONE if not mapped */
+struct ChannelMap {
+    int8_t abs[ABS_CNT];
+    int8_t key[KEY_CNT];
 };
 
-enum SC2Btn {
-    SC2BTN_SETTINGS,
-    SC2BTN_HOME,
-    SC2BTN_TAKEOFF,
-    SC2BTN_B,
-    SC2BTN_A,
-    SC2BTN_LEFT,
-    SC2BTN_RIGHT,
-    SC2BTN_RIGHT_WHEEL_LEFT,
-    SC2BTN_RIGHT_WHEEL_RIGHT,
-    SC2BTN_STICK_LEFT_PRESS,
-    SC2BTN_STICK_RIGHT_PRESS,
-    _SC2BTN_COUNT,
+struct EvdevCode {
+    const char *name;
+    uint16_t type;
+    uint16_t code;
 };
 
-struct Controller {
+#define EVDEV_CODE(_type, _code) { #_code, _type, _code }
+
+/* clang-format off */
+static const struct EvdevCode evdev_codes[] = {
+    EVDEV_CODE(EV_ABS, ABS_X),
+    EVDEV_CODE(EV_ABS, ABS_Y),
+    EVDEV_CODE(EV_ABS, ABS_Z),
+    EVDEV_CODE(EV_ABS, ABS_RX),
+    EVDEV_CODE(EV_ABS, ABS_RY),
+    EVDEV_CODE(EV_ABS, ABS_RZ),
+    EVDEV_CODE(EV_ABS, ABS_THROTTLE),
+    EVDEV_CODE(EV_ABS, ABS_RUDDER),
+    EVDEV_CODE(EV_ABS, ABS_WHEEL),
+    EVDEV_CODE(EV_ABS, ABS_GAS),
+    EVDEV_CODE(EV_ABS, ABS_BRAKE),
+    EVDEV_CODE(EV_ABS, ABS_HAT0X),
+    EVDEV_CODE(EV_ABS, ABS_HAT0Y),
+    EVDEV_CODE(EV_ABS, ABS_HAT1X),
+    EVDEV_CODE(EV_ABS, ABS_HAT1Y),
+    EVDEV_CODE(EV_ABS, ABS_MISC),
+
+    EVDEV_CODE(EV_KEY, BTN_TRIGGER),
+    EVDEV_CODE(EV_KEY, BTN_THUMB),
+    EVDEV_CODE(EV_KEY, BTN_THUMB2),
+    EVDEV_CODE(EV_KEY, BTN_TOP),
+    EVDEV_CODE(EV_KEY, BTN_TOP2),
+    EVDEV_CODE(EV_KEY, BTN_PINKIE),
+    EVDEV_CODE(EV_KEY, BTN_BASE),
+    EVDEV_CODE(EV_KEY, BTN_BASE2),
+    EVDEV_CODE(EV_KEY, BTN_BASE3),
+    EVDEV_CODE(EV_KEY, BTN_BASE4),
+    EVDEV_CODE(EV_KEY, BTN_BASE5),
+    EVDEV_CODE(EV_KEY, BTN_BASE6),
+    EVDEV_CODE(EV_KEY, BTN_DEAD),
+
+    EVDEV_CODE(EV_KEY, BTN_SOUTH),
+    EVDEV_CODE(EV_KEY, BTN_EAST),
+    EVDEV_CODE(EV_KEY, BTN_C),
+    EVDEV_CODE(EV_KEY, BTN_NORTH),
+    EVDEV_CODE(EV_KEY, BTN_WEST),
+    EVDEV_CODE(EV_KEY, BTN_Z),
+    EVDEV_CODE(EV_KEY, BTN_TL),
+    EVDEV_CODE(EV_KEY, BTN_TR),
+    EVDEV_CODE(EV_KEY, BTN_TL2),
+    EVDEV_CODE(EV_KEY, BTN_TR2),
+    EVDEV_CODE(EV_KEY, BTN_SELECT),
+    EVDEV_CODE(EV_KEY, BTN_START),
+    EVDEV_CODE(EV_KEY, BTN_MODE),
+    EVDEV_CODE(EV_KEY, BTN_THUMBL),
+    EVDEV_CODE(EV_KEY, BTN_THUMBR),
+};
+
+/* SkyController 2 map, used when there's no [Channels] section in the config */
+static const struct EvdevCode sc2_channels[] = {
+    EVDEV_CODE(EV_ABS, ABS_Z),          /* roll */
+    EVDEV_CODE(EV_ABS, ABS_RX),         /* pitch */
+    EVDEV_CODE(EV_ABS, ABS_Y),          /* throttle */
+    EVDEV_CODE(EV_ABS, ABS_X),          /* yaw */
+    EVDEV_CODE(EV_ABS, ABS_RY),         /* left rocker */
+    EVDEV_CODE(EV_KEY, BTN_TRIGGER),    /* settings */
+    EVDEV_CODE(EV_KEY, BTN_THUMB),      /* home */
+    EVDEV_CODE(EV_KEY, BTN_THUMB2),     /* takeoff/land */
+    EVDEV_CODE(EV_KEY, BTN_TOP),        /* B */
+    EVDEV_CODE(EV_KEY, BTN_TOP2),       /* A */
+    EVDEV_CODE(EV_KEY, BTN_BASE),       /* left trigger */
+    EVDEV_CODE(EV_KEY, BTN_PINKIE),     /* right trigger */
+    EVDEV_CODE(EV_KEY, BTN_BASE5),      /* right wheel left */
+    EVDEV_CODE(EV_KEY, BTN_BASE6),      /* right wheel right */
+    EVDEV_CODE(EV_KEY, BTN_BASE3),      /* left stick press */
+    EVDEV_CODE(EV_KEY, BTN_BASE4),      /* right stick press */
+};
+/* clang-format on */
+
+/* Device state as the kernel would report it, emulated when replaying a recording */
+struct EmulatedDevice {
+    struct input_absinfo absinfo[ABS_CNT];
+    unsigned long keys[BITMASK_NLONGS(KEY_CNT)];
+};
+
+struct InputDevice {
+    /* NULL for the default device, given as InputDevice */
+    char *name;
+    char *path;
+    /* -1 when detached or replaying */
     int fd;
-    bool grab_device;
+    struct EventSource *source;
+    bool attached;
+    struct EmulatedDevice *emulated;
+    /* inotify watch on the directory containing path */
+    int wd;
+    bool grab;
+    /*
+     * While a required device is missing nothing is sent, the channels of an optional one are
+     * held at failsafe instead
+     */
+    bool required;
+    int failsafe;
+    /* axis info is filled on first attach and kept across reconnects */
+    bool initialized;
+
+    struct ChannelMap map;
+    /* Channels fed by this device */
+    uint8_t channels[MAX_CHANNELS];
+    unsigned int n_channels;
+
+    /* Events are being dropped until next SYN_REPORT, when state is resynchronized */
+    bool syn_dropped;
+    /* read buffer, may be filled by the kernel after the read is submitted */
+    struct input_event events[64];
+
+    /* Event timestamps use CLOCK_MONOTONIC, otherwise the time they are read is used */
+    bool monotonic;
+    /* Time of the last complete frame and whether it was already sent */
+    usec_t frame_usec;
+    bool frame_unsent;
 
-    /* Axis + buttons: 16 channels */
-    int val[_AXIS_COUNT + _SC2BTN_COUNT];
+    struct {
+        unsigned long dropped;
+        unsigned long resyncs;
+        unsigned long attaches;
+        /* from the input event to the packet with it being sent */
+        struct Histogram latency;
+    } stats;
+};
+
+struct Controller {
+    struct InputDevice devices[MAX_DEVICES];
+    unsigned int n_devices;
+    unsigned int n_detached;
+    /* Nothing is sent while any of these is missing, rather than sending stale values */
+    unsigned int n_required_detached;
+
+    int inotify_fd;
+    struct EventSource *inotify_source;
+    usec_t last_attach_retry_usec;
+
+    /* Reference kept to initialize devices that show up later */
+    CIniDomain *config;
 
     struct {
-        int range[_AXIS_COUNT][_INFO_ABS_COUNT];
-    } info;
+        struct ReplayReader *reader;
+        struct EventSource *timeout;
+        bool fast;
+        usec_t start_usec;
+        /* next record, already read but not yet due */
+        bool pending;
+        struct RecordEvent ev;
+        struct RecordAbsinfo absinfo;
+        usec_t ts;
+    } replay;
+
+    unsigned int n_channels;
+
+    /* Channel values as of the last complete frame, and time of its newest sample */
+    int val[MAX_CHANNELS];
+    usec_t val_usec;
+    /* Values being updated by the events until the frame is closed by SYN_REPORT */
+    int frame[MAX_CHANNELS];
+
+    /* Event type feeding each channel */
+    uint16_t type[MAX_CHANNELS];
+
+    struct AxisScale axis[MAX_CHANNELS];
+
+    char *calibration_file;
+    bool calibrating;
+    struct AxisCalibration calibration[MAX_CHANNELS];
+
+    /* Last known state of each button, to detect presses lost on SYN_DROPPED */
+    bool btn_down[MAX_CHANNELS];
+
+    /*
+     * When send_on_sync is set, each complete frame is sent right away, respecting
+     * min_send_interval_usec between packets, and remote_update_timeout is only a keepalive
+     */
+    bool send_on_sync;
+    bool send_pending;
+    usec_t min_send_interval_usec;
+    unsigned long update_interval_msec;
+    usec_t last_send_usec;
+
+    /*
+     * When send_on_change is set, values are only sent when they change, change_redundancy
+     * times, and otherwise once every keepalive_interval_usec
+     */
+    bool send_on_change;
+    unsigned long change_redundancy;
+    usec_t keepalive_interval_usec;
+    int sent[MAX_CHANNELS];
+    unsigned int n_sent;
+    unsigned long repeats_left;
+
+    struct {
+        unsigned long sent;
+        /* nothing changed and no keepalive due */
+        unsigned long suppressed;
+    } send_stats;
 
     struct EventSource *remote_update_timeout;
 };
 
 static struct Controller controller;
 
-static uint16_t controller_abs_scale(struct Controller *c, enum Axis axis, int val)
+static uint16_t controller_abs_scale(struct Controller *c, int ch, int val)
 {
-    int rmin = c->info.range[axis][INFO_ABS_MIN];
-    int rmax = c->info.range[axis][INFO_ABS_MAX];
+    const struct AxisScale *a = &c->axis[ch];
+    int d, out;
 
     /* constrain values to range - linux input doesn't do this for us */
-    val = constrain(val, rmin, rmax);
-
-    /* transpose to [1000, 2000], or close to it */
-    val -= rmin;
-    val = val * (1000 / (rmax - rmin)) + 1000;
-
-    return (uint16_t)val;
-}
-
-/* Currently we have a static map for SkyController 2 */
-static int get_axis_from_evdev(unsigned long code)
-{
-    switch (code) {
-    case ABS_Z:
-        return AXIS_ROLL;
-    case ABS_RX:
-        return AXIS_PITCH;
-    case ABS_Y:
-        return AXIS_THROTTLE;
-    case ABS_X:
-        return AXIS_YAW;
-    case ABS_RY:
-        return AXIS_AUX_LEFT;
-    }
-
-    return -1;
-}
-
-static int get_btn_from_evdev(unsigned long code)
-{
-    switch (code) {
-    case BTN_TRIGGER:
-        return SC2BTN_SETTINGS;
-    case BTN_THUMB:
-        return SC2BTN_HOME;
-    case BTN_THUMB2:
-        return SC2BTN_TAKEOFF;
-    case BTN_TOP:
-        return SC2BTN_B;
-    case BTN_TOP2:
-        return SC2BTN_A;
-    case BTN_PINKIE:
-        return SC2BTN_RIGHT;
-    case BTN_BASE:
-        return SC2BTN_LEFT;
-    case BTN_BASE2:
-        /* ??? in theory we have, but I couldn't find */
-        return -1;
-    case BTN_BASE3:
-        return SC2BTN_STICK_LEFT_PRESS;
-    case BTN_BASE4:
-        return SC2BTN_STICK_RIGHT_PRESS;
-    case BTN_BASE5:
-        return SC2BTN_RIGHT_WHEEL_LEFT;
-    case BTN_BASE6:
-        return SC2BTN_RIGHT_WHEEL_RIGHT;
-    };
-
-    return -1;
+    val = constrain(val, a->min, a->max);
+    d = val - a->center;
+
+    if (d > a->deadzone)
+        out = ((int64_t)(d - a->deadzone) * a->mul_hi + SCALE_ROUND) >> SCALE_SHIFT;
+    else if (d < -a->deadzone)
+        out = -(((int64_t)(-d - a->deadzone) * a->mul_lo + SCALE_ROUND) >> SCALE_SHIFT);
+    else
+        out = 0;
+
+    return PWM_CENTER + (a->reverse ? -out : out);
+}
+
+/* Fix up calibration values and precompute the scale factors used by controller_abs_scale() */
+static int axis_scale_update(struct AxisScale *a)
+{
+    int span_lo, span_hi;
+
+    /* a center strictly between the two ends */
+    if (a->max - a->min < 2)
+        return -EINVAL;
+
+    if (a->center <= a->min || a->center >= a->max)
+        a->center = a->min + (a->max - a->min) / 2;
+
+    a->deadzone = constrain(a->deadzone, 0, min(a->center - a->min, a->max - a->center) - 1);
+
+    span_lo = a->center - a->deadzone - a->min;
+    span_hi = a->max - a->center - a->deadzone;
+    if (span_lo <= 0 || span_hi <= 0)
+        return -EINVAL;
+
+    /* rounded, so the extremes map exactly to PWM_MIN and PWM_MAX */
+    a->mul_lo = (((int64_t)PWM_HALF_RANGE << SCALE_SHIFT) + span_lo / 2) / span_lo;
+    a->mul_hi = (((int64_t)PWM_HALF_RANGE << SCALE_SHIFT) + span_hi / 2) / span_hi;
+
+    return 0;
+}
+
+static inline const char *device_name(struct InputDevice *dev)
+{
+    return dev->name ?: dev->path;
+}
+
+static inline unsigned int device_index(struct Controller *c, struct InputDevice *dev)
+{
+    return dev - c->devices;
+}
+
+static int device_get_absinfo(struct InputDevice *dev, unsigned int code,
+                              struct input_absinfo *abs)
+{
+    if (dev->emulated) {
+        *abs = dev->emulated->absinfo[code];
+        return 0;
+    }
+
+    return ioctl(dev->fd, EVIOCGABS(code), abs);
+}
+
+static int device_get_keys(struct InputDevice *dev, unsigned long *keys, size_t size)
+{
+    if (dev->emulated) {
+        memcpy(keys, dev->emulated->keys, min(size, sizeof(dev->emulated->keys)));
+        return 0;
+    }
+
+    return ioctl(dev->fd, EVIOCGKEY(size), keys);
+}
+
+static inline int channel_from_abs(struct InputDevice *dev, unsigned int code)
+{
+    return code < ABS_CNT ? dev->map.abs[code] : CHANNEL_NONE;
+}
+
+static inline int channel_from_key(struct InputDevice *dev, unsigned int code)
+{
+    return code < KEY_CNT ? dev->map.key[code] : CHANNEL_NONE;
+}
+
+static int channel_map_set(struct Controller *c, struct InputDevice *dev, unsigned int ch,
+                           uint16_t type, uint16_t code)
+{
+    /* each channel is fed by a single device and event */
+    if (c->type[ch])
+        return -EEXIST;
+
+    switch (type) {
+    case EV_ABS:
+        if (code >= ABS_CNT)
+            return -EINVAL;
+        dev->map.abs[code] = ch;
+        break;
+    case EV_KEY:
+        if (code >= KEY_CNT)
+            return -EINVAL;
+        dev->map.key[code] = ch;
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    c->type[ch] = type;
+    dev->channels[dev->n_channels++] = ch;
+    c->n_channels = max(c->n_channels, ch + 1);
+
+    return 0;
+}
+
+/*
+ * Parse evdev codes either by name, e.g. ABS_X, BTN_TRIGGER, or by type and number,
+ * e.g. ABS:0, KEY:288
+ */
+static int parse_evdev_code(const char *s, uint16_t *type, uint16_t *code)
+{
+    unsigned long ul;
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(evdev_codes); i++) {
+        if (strcaseeq(s, evdev_codes[i].name)) {
+            *type = evdev_codes[i].type;
+            *code = evdev_codes[i].code;
+            return 0;
+        }
+    }
+
+    if (strncaseeq(s, "ABS:", 4)) {
+        if (safe_atoul(s + 4, &ul) < 0 || ul >= ABS_CNT)
+            return -EINVAL;
+        *type = EV_ABS;
+    } else if (strncaseeq(s, "KEY:", 4)) {
+        if (safe_atoul(s + 4, &ul) < 0 || ul >= KEY_CNT)
+            return -EINVAL;
+        *type = EV_KEY;
+    } else {
+        return -EINVAL;
+    }
+
+    *code = ul;
+
+    return 0;
 }
 
 static int evdev_grab_device(int fd)
@@ -141,214 +453,1337 @@ static int evdev_grab_device(int fd)
     return ioctl(fd, EVIOCGRAB, 1UL);
 }
 
-static int evdev_fill_info(int fd, struct Controller *c)
+static int evdev_set_clock(int fd)
+{
+    int clk = CLOCK_MONOTONIC;
+
+    return ioctl(fd, EVIOCSCLOCKID, &clk);
+}
+
+/*
+ * Override axis calibration of channels fed by @dev with [RC<n>] groups from @domain, as present
+ * both in the calibration state file and the configuration
+ */
+static void axis_load_config(struct Controller *c, struct InputDevice *dev, CIniDomain *domain,
+                             const char *domain_name)
+{
+    unsigned int i;
+
+    if (!domain)
+        return;
+
+    for (i = 0; i < dev->n_channels; i++) {
+        unsigned int ch = dev->channels[i];
+        struct AxisScale *a = &c->axis[ch];
+        char label[8];
+        CIniGroup *group;
+        CIniEntry *entry;
+
+        if (c->type[ch] != EV_ABS)
+            continue;
+
+        snprintf(label, sizeof(label), "RC%u", ch + 1);
+        group = c_ini_domain_find(domain, label, -1);
+        if (!group)
+            continue;
+
+        for (entry = c_ini_group_iterate(group); entry; entry = c_ini_entry_next(entry)) {
+            const char *key, *value;
+            int r = 0, b;
+
+            key = c_ini_entry_get_key(entry, NULL);
+            value = c_ini_entry_get_value(entry, NULL);
+
+            if (strcaseeq(key, "Min")) {
+                r = safe_atoi(value, &a->min);
+            } else if (strcaseeq(key, "Center")) {
+                r = safe_atoi(value, &a->center);
+            } else if (strcaseeq(key, "Max")) {
+                r = safe_atoi(value, &a->max);
+            } else if (strcaseeq(key, "Deadzone")) {
+                r = safe_atoi(value, &a->deadzone);
+            } else if (strcaseeq(key, "Reverse")) {
+                b = parse_boolean(value);
+                if (b >= 0)
+                    a->reverse = b;
+                r = b;
+            }
+
+            if (r < 0)
+                log_warning("Invalid value %s: %s.%s=%s\n", domain_name, label, key, value);
+        }
+    }
+}
+
+/* Check all axis mapped for @dev are supported by the device behind @fd */
+static int evdev_check_axis(int fd, struct InputDevice *dev, unsigned long *mask)
 {
-    /* query events and codes supported */
-    unsigned long mask[BITMASK_NLONGS(KEY_MAX)];
     unsigned long code;
-    unsigned int naxis = 0;
 
-    /* We need at least EV_ABS events in @fd */
-    memset(mask, 0, sizeof(mask));
+    memset(mask, 0, BITMASK_NLONGS(KEY_CNT) * sizeof(*mask));
     ioctl(fd, EVIOCGBIT(0, EV_MAX), mask);
     if (!test_bit(EV_ABS, mask)) {
-        log_error("EV_ABS event is not supported\n");
-        return -EINVAL;
+        memset(mask, 0, BITMASK_NLONGS(KEY_CNT) * sizeof(*mask));
+    } else {
+        memset(mask, 0, BITMASK_NLONGS(KEY_CNT) * sizeof(*mask));
+        ioctl(fd, EVIOCGBIT(EV_ABS, ABS_MAX), mask);
     }
 
-    memset(mask, 0, sizeof(mask));
-    ioctl(fd, EVIOCGBIT(EV_ABS, KEY_MAX), mask);
-    for (code = 0; code < EV_MAX && naxis < _AXIS_COUNT; code++) {
-        struct input_absinfo abs;
-        int axis;
+    for (code = 0; code < ABS_CNT; code++) {
+        int axis = channel_from_abs(dev, code);
 
-        if (!test_bit(code, mask))
-            continue;
+        if (axis >= 0 && !test_bit(code, mask)) {
+            log_error("%s: axis %lu mapped to channel %d not supported by this input\n",
+                      device_name(dev), code, axis + 1);
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+static int evdev_fill_info(struct Controller *c, struct InputDevice *dev)
+{
+    /* query events and codes supported */
+    unsigned long mask[BITMASK_NLONGS(KEY_CNT)];
+    int initial[MAX_CHANNELS] = { };
+    CIniDomain *calibration = NULL;
+    unsigned long code;
+    unsigned int i;
+    int r;
+
+    /* a recording only has the axis that were mapped */
+    if (!dev->emulated) {
+        r = evdev_check_axis(dev->fd, dev, mask);
+        if (r < 0)
+            return r;
+    }
+
+    /* Buttons are assumed to be low at start */
+    for (i = 0; i < dev->n_channels; i++)
+        c->frame[dev->channels[i]] = PWM_MIN;
+
+    for (code = 0; code < ABS_CNT; code++) {
+        struct input_absinfo abs;
+        int axis = channel_from_abs(dev, code);
 
-        axis = get_axis_from_evdev(code);
         if (axis < 0)
             continue;
 
         memset(&abs, 0, sizeof(abs));
-        ioctl(fd, EVIOCGABS(code), &abs);
+        device_get_absinfo(dev, code, &abs);
+
+        if (record_is_enabled()) {
+            struct RecordAbsinfo info = {
+                .minimum = abs.minimum,
+                .maximum = abs.maximum,
+                .fuzz = abs.fuzz,
+                .flat = abs.flat,
+            };
+            record_absinfo(device_index(c, dev), code, abs.value, &info, now_usec());
+        }
 
-        /* fill struct */
-        c->info.range[axis][INFO_ABS_MIN] = abs.minimum;
-        c->info.range[axis][INFO_ABS_MAX] = abs.maximum;
-        c->val[axis] = controller_abs_scale(c, axis, abs.value);
+        /* defaults from the kernel, possibly overridden below */
+        c->axis[axis].min = abs.minimum;
+        c->axis[axis].max = abs.maximum;
+        c->axis[axis].center = abs.minimum + (abs.maximum - abs.minimum) / 2;
+        c->axis[axis].deadzone = abs.flat;
+        initial[axis] = abs.value;
 
-        log_debug("axis: %d min: %d max: %d\n", axis, abs.minimum, abs.maximum);
+        c->calibration[axis].min = abs.value;
+        c->calibration[axis].center = abs.value;
+        c->calibration[axis].max = abs.value;
 
-        naxis++;
+        log_debug("axis: %d min: %d max: %d flat: %d fuzz: %d\n", axis, abs.minimum,
+                  abs.maximum, abs.flat, abs.fuzz);
     }
 
-    if (naxis < _AXIS_COUNT) {
-        log_error("Not all required axis supported by this input\n");
-        return -EINVAL;
+    /* calibration is ignored while capturing a new one */
+    if (!c->calibrating) {
+        r = conffile_load(c->calibration_file, &calibration);
+        if (r < 0)
+            log_warning("Could not load calibration from %s\n", c->calibration_file);
+        axis_load_config(c, dev, calibration, c->calibration_file);
+        if (calibration)
+            c_ini_domain_unref(calibration);
     }
 
-    /* Buttons are assumed to be low at start */
-    for (naxis = _AXIS_COUNT; naxis < _AXIS_COUNT + _SC2BTN_COUNT; naxis++)
-        c->val[naxis] = 1000;
+    /* explicit configuration wins over calibration */
+    axis_load_config(c, dev, c->config, "config");
+
+    for (i = 0; i < dev->n_channels; i++) {
+        unsigned int ch = dev->channels[i];
+        struct AxisScale *a = &c->axis[ch];
+
+        if (c->type[ch] != EV_ABS)
+            continue;
+
+        if (axis_scale_update(a) < 0) {
+            log_error("Channel %u has invalid range [%d, %d]\n", ch + 1, a->min, a->max);
+            return -EINVAL;
+        }
+
+        c->frame[ch] = controller_abs_scale(c, ch, initial[ch]);
+
+        log_debug("channel %u: min: %d center: %d max: %d deadzone: %d%s\n", ch + 1, a->min,
+                  a->center, a->max, a->deadzone, a->reverse ? " reversed" : "");
+    }
 
-    log_debug("controller ok\n");
+    log_debug("%s: controller ok\n", device_name(dev));
 
     return 0;
 }
 
-static void evdev_handle_abs(struct Controller *c, struct input_event *e)
+/* Frame from @dev is complete: publish its channels */
+static void device_commit_frame(struct Controller *c, struct InputDevice *dev)
+{
+    unsigned int i;
+
+    for (i = 0; i < dev->n_channels; i++)
+        c->val[dev->channels[i]] = c->frame[dev->channels[i]];
+}
+
+static void device_discard_frame(struct Controller *c, struct InputDevice *dev)
 {
-    int axis = get_axis_from_evdev(e->code);
+    unsigned int i;
+
+    for (i = 0; i < dev->n_channels; i++)
+        c->frame[dev->channels[i]] = c->val[dev->channels[i]];
+}
+
+/* Optional device missing: its channels go to failsafe, the others are still sent */
+static void device_hold_failsafe(struct Controller *c, struct InputDevice *dev)
+{
+    unsigned int i;
+
+    for (i = 0; i < dev->n_channels; i++)
+        c->val[dev->channels[i]] = c->frame[dev->channels[i]] = dev->failsafe;
+}
+
+static void evdev_handle_abs(struct Controller *c, struct InputDevice *dev,
+                             struct input_event *e)
+{
+    int axis = channel_from_abs(dev, e->code);
 
     if (axis < 0) {
         log_debug("ignoring axis %u\n", e->code);
         return;
     }
 
-    c->val[axis] = controller_abs_scale(c, axis, e->value);
+    if (c->calibrating) {
+        c->calibration[axis].min = min(c->calibration[axis].min, e->value);
+        c->calibration[axis].max = max(c->calibration[axis].max, e->value);
+    }
+
+    c->frame[axis] = controller_abs_scale(c, axis, e->value);
 
-    log_debug("received event axis=%d val=%u\n", axis, c->val[axis]);
+    log_debug("received event axis=%d val=%u\n", axis, c->frame[axis]);
 }
 
-static void evdev_handle_key(struct Controller *c, struct input_event *e)
+static void evdev_handle_key(struct Controller *c, struct InputDevice *dev,
+                             struct input_event *e)
 {
-    int btn = get_btn_from_evdev(e->code);
+    int btn = channel_from_key(dev, e->code);
 
     if (btn < 0) {
         log_debug("ignoring btn %u\n", e->code);
         return;
     }
 
+    c->btn_down[btn] = e->value;
+
     /* Ignore button release */
     if (!e->value)
         return;
 
     /* Toggle button according with the last value */
-    c->val[_AXIS_COUNT + btn] = c->val[_AXIS_COUNT + btn] == 1000 ? 2000 : 1000;
+    c->frame[btn] = c->frame[btn] == 1000 ? 2000 : 1000;
 
     log_debug("received event btn=%d val=%u\n", btn, e->value);
 }
 
-static void evdev_handler(int fd, void *data, int ev_mask)
+/* With send_on_change, whether @out is different from what was last sent or is due anyway */
+static bool controller_send_due(struct Controller *c, const int out[], unsigned int n, usec_t now)
 {
-    struct Controller *c = data;
-    struct input_event events[64], *e;
-    int r;
+    usec_t elapsed = now - c->last_send_usec;
+
+    if (!c->send_on_change)
+        return true;
+
+    if (n != c->n_sent || memcmp(out, c->sent, n * sizeof(*out)) != 0) {
+        memcpy(c->sent, out, n * sizeof(*out));
+        c->n_sent = n;
+        c->repeats_left = c->change_redundancy - 1;
+        return true;
+    }
+
+    /*
+     * Copies of a change go on the following update intervals, not back to back, so a burst of
+     * loss doesn't take all of them. Half an interval leaves room for timer jitter.
+     */
+    if (c->repeats_left && elapsed >= c->update_interval_msec * USEC_PER_MSEC / 2) {
+        c->repeats_left--;
+        return true;
+    }
+
+    return elapsed >= c->keepalive_interval_usec;
+}
+
+static void controller_send(struct Controller *c, usec_t now)
+{
+    int shaped[MAX_CHANNELS], out[MAX_CHANNELS];
+    unsigned int i, n;
+    bool due;
 
-    if (!(ev_mask & EPOLLIN))
+    /* don't give a vehicle values from an axis being calibrated or stale values */
+    if (c->calibrating || c->n_required_detached || c->n_detached == c->n_devices)
         return;
 
-    r = read(fd, events, sizeof(events));
-    if (r < 0) {
-        log_error("read: %m\n");
+    shaping_apply(c->val, shaped, c->n_channels, now);
+    n = mixer_apply(shaped, out, c->n_channels);
+
+    /* only network outputs are suppressed, the others get every update */
+    due = controller_send_due(c, out, n, now);
+    output_send(out, n, c->val_usec, due);
+    if (due) {
+        c->last_send_usec = now;
+        c->send_stats.sent++;
+    } else {
+        c->send_stats.suppressed++;
+    }
+
+    c->send_pending = false;
+
+    /* keepalives don't count: only the first time each frame is sent */
+    for (i = 0; i < c->n_devices; i++) {
+        struct InputDevice *dev = &c->devices[i];
+
+        if (!dev->frame_unsent)
+            continue;
+
+        /* a frame that didn't change anything was already sent with the previous one */
+        if (due)
+            histogram_add(&dev->stats.latency, now - dev->frame_usec);
+        dev->frame_unsent = false;
+    }
+}
+
+static inline usec_t evdev_event_usec(struct InputDevice *dev, struct input_event *e)
+{
+    if (!dev->monotonic)
+        return now_usec();
+
+    return (usec_t)e->input_event_sec * USEC_PER_SEC + (usec_t)e->input_event_usec;
+}
+
+static void evdev_handle_syn(struct Controller *c, struct InputDevice *dev,
+                             struct input_event *e)
+{
+    usec_t now, elapsed;
+
+    if (e->code != SYN_REPORT)
+        return;
+
+    /* frame is complete: it's now safe to send it */
+    device_commit_frame(c, dev);
+    dev->frame_usec = evdev_event_usec(dev, e);
+    dev->frame_unsent = true;
+    c->val_usec = max(c->val_usec, dev->frame_usec);
+
+    if (!c->send_on_sync)
+        return;
+
+    now = now_usec();
+    elapsed = now - c->last_send_usec;
+
+    if (elapsed < c->min_send_interval_usec) {
+        /* too soon: let the timeout send it as soon as the interval has passed */
+        if (!c->send_pending) {
+            c->send_pending = true;
+            event_loop_rearm_timeout(c->remote_update_timeout,
+                                     c->min_send_interval_usec - elapsed);
+        }
         return;
     }
 
-    if ((size_t)r < sizeof(*events)) {
-        log_warning("expected at least %zu bytes\n", sizeof(*events));
+    controller_send(c, now);
+
+    /* postpone keepalive */
+    event_loop_rearm_timeout(c->remote_update_timeout, c->update_interval_msec * USEC_PER_MSEC);
+}
+
+/*
+ * Query the current state of all axis and buttons of @dev, after events were dropped by the
+ * kernel or the device was reconnected, so the next frame doesn't carry stale values. When
+ * @toggle_lost_presses is set, a button found pressed that wasn't before toggles its channel.
+ */
+static void evdev_resync(struct Controller *c, struct InputDevice *dev, bool toggle_lost_presses)
+{
+    unsigned long keys[BITMASK_NLONGS(KEY_CNT)];
+    unsigned long code;
+
+    for (code = 0; code < ABS_CNT; code++) {
+        struct input_absinfo abs;
+        int axis = channel_from_abs(dev, code);
+
+        if (axis < 0)
+            continue;
+
+        if (device_get_absinfo(dev, code, &abs) < 0) {
+            log_warning("could not resync axis %d: %m\n", axis);
+            continue;
+        }
+
+        c->frame[axis] = controller_abs_scale(c, axis, abs.value);
+
+        /* on replay this state is restored before the event triggering the resync */
+        record_event(device_index(c, dev), RECORD_RESYNC_ABS, code, abs.value, now_usec());
+    }
+
+    memset(keys, 0, sizeof(keys));
+    if (device_get_keys(dev, keys, sizeof(keys)) < 0) {
+        log_warning("could not resync buttons: %m\n");
         return;
     }
 
-    for (e = events; e < events + r / sizeof(*events); e++) {
-        switch (e->type) {
-        case EV_ABS:
-            evdev_handle_abs(c, e);
-            break;
-        case EV_KEY:
-            evdev_handle_key(c, e);
+    for (code = 0; code < KEY_CNT; code++) {
+        int btn = channel_from_key(dev, code);
+        bool down;
+
+        if (btn < 0)
+            continue;
+
+        down = test_bit(code, keys);
+
+        /* We only lose a toggle if the press wasn't seen: a lost press + release is lost forever */
+        if (toggle_lost_presses && down && !c->btn_down[btn])
+            c->frame[btn] = c->frame[btn] == 1000 ? 2000 : 1000;
+
+        c->btn_down[btn] = down;
+
+        record_event(device_index(c, dev), RECORD_RESYNC_KEY, code, down, now_usec());
+    }
+
+    dev->stats.resyncs++;
+
+    log_debug("%s: resync done: dropped=%lu resyncs=%lu\n", device_name(dev), dev->stats.dropped,
+              dev->stats.resyncs);
+}
+
+static void evdev_handle_event(struct Controller *c, struct InputDevice *dev,
+                               struct input_event *e)
+{
+    if (dev->syn_dropped) {
+        /* discard everything up to and including the next SYN_REPORT */
+        if (e->type == EV_SYN && e->code == SYN_REPORT) {
+            dev->syn_dropped = false;
+            evdev_resync(c, dev, true);
+            evdev_handle_syn(c, dev, e);
+        }
+        return;
+    }
+
+    switch (e->type) {
+    case EV_ABS:
+        evdev_handle_abs(c, dev, e);
+        break;
+    case EV_KEY:
+        evdev_handle_key(c, dev, e);
+        break;
+    case EV_SYN:
+        if (e->code == SYN_DROPPED) {
+            dev->syn_dropped = true;
+            dev->stats.dropped++;
+            /* in-progress frame is garbage, start over from the last complete one */
+            device_discard_frame(c, dev);
             break;
         }
+        evdev_handle_syn(c, dev, e);
+        break;
     }
 }
 
-static void remote_update_handler(int fd, void *data, int ev_mask)
+static void evdev_handle_events(struct Controller *c, struct InputDevice *dev,
+                                struct input_event *events, size_t n)
+{
+    struct input_event *e;
+
+    if (!record_is_enabled()) {
+        for (e = events; e < events + n; e++)
+            evdev_handle_event(c, dev, e);
+        return;
+    }
+
+    /* recorded after being handled, so resync state is recorded before what triggered it */
+    for (e = events; e < events + n; e++) {
+        evdev_handle_event(c, dev, e);
+        record_event(device_index(c, dev), e->type, e->code, e->value, evdev_event_usec(dev, e));
+    }
+}
+
+static void device_detach(struct Controller *c, struct InputDevice *dev)
+{
+    if (!dev->attached)
+        return;
+
+    if (dev->required)
+        log_warning("%s: device removed, stop sending until it's back\n", device_name(dev));
+    else
+        log_warning("%s: device removed, holding its channels at %d until it's back\n",
+                    device_name(dev), dev->failsafe);
+
+    if (dev->source) {
+        event_loop_remove_source(dev->source);
+        dev->source = NULL;
+    }
+
+    if (dev->fd >= 0) {
+        close(dev->fd);
+        dev->fd = -1;
+    }
+
+    dev->attached = false;
+    dev->syn_dropped = false;
+
+    c->n_detached++;
+    if (dev->required) {
+        c->n_required_detached++;
+        device_discard_frame(c, dev);
+    } else {
+        device_hold_failsafe(c, dev);
+    }
+
+    record_event(device_index(c, dev), RECORD_DETACH, 0, 0, now_usec());
+}
+
+static void evdev_handler(void *data, void *buf, ssize_t len)
+{
+    struct InputDevice *dev = data;
+    struct Controller *c = &controller;
+    struct input_event *events = buf;
+
+    if (len < 0) {
+        if (len == -ENODEV)
+            device_detach(c, dev);
+        else
+            log_error("read: %s\n", strerror(-len));
+        return;
+    }
+
+    if ((size_t)len < sizeof(*events)) {
+        log_warning("expected at least %zu bytes\n", sizeof(*events));
+        return;
+    }
+
+    evdev_handle_events(c, dev, events, len / sizeof(*events));
+}
+
+static int device_attach(struct Controller *c, struct InputDevice *dev)
+{
+    int r;
+
+    if (dev->attached)
+        return 0;
+
+    if (dev->emulated) {
+        /* timestamps are synthesized on replay, unless it's not following the original timing */
+        dev->monotonic = !c->replay.fast;
+    } else {
+        dev->fd = open(dev->path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+        if (dev->fd < 0)
+            return -errno;
+
+        r = dev->grab && evdev_grab_device(dev->fd);
+        if (r != 0)
+            log_warning("Could not grab device %s: no exclusive access\n", dev->path);
+
+        /* compare event timestamps with our own clock */
+        dev->monotonic = evdev_set_clock(dev->fd) == 0;
+        if (!dev->monotonic)
+            log_warning("%s: no CLOCK_MONOTONIC timestamps, latency is measured from read\n",
+                        dev->path);
+    }
+
+    if (!dev->initialized) {
+        unsigned int i;
+
+        r = evdev_fill_info(c, dev);
+        if (r < 0)
+            goto fail;
+
+        for (i = 0; i < dev->n_channels; i++)
+            c->btn_down[dev->channels[i]] = false;
+
+        dev->initialized = true;
+    } else {
+        /* reconnected: keep calibration, but make sure it's still the same kind of device */
+        unsigned long mask[BITMASK_NLONGS(KEY_CNT)];
+
+        if (!dev->emulated) {
+            r = evdev_check_axis(dev->fd, dev, mask);
+            if (r < 0)
+                goto fail;
+        }
+
+        evdev_resync(c, dev, false);
+    }
+
+    device_commit_frame(c, dev);
+    dev->frame_usec = now_usec();
+    c->val_usec = max(c->val_usec, dev->frame_usec);
+
+    if (dev->fd >= 0) {
+        /* drained on each wakeup, so nothing is left behind to overflow the kernel buffer */
+        dev->source = event_loop_add_read_source(dev->fd, dev->events, sizeof(dev->events), dev,
+                                                 evdev_handler);
+        if (!dev->source) {
+            r = -ENOMEM;
+            goto fail;
+        }
+    }
+
+    dev->attached = true;
+    dev->stats.attaches++;
+    c->n_detached--;
+    if (dev->required)
+        c->n_required_detached--;
+
+    record_event(device_index(c, dev), RECORD_ATTACH, 0, 0, now_usec());
+
+    if (dev->stats.attaches > 1)
+        log_info("%s: device reattached\n", device_name(dev));
+
+    return 0;
+
+fail:
+    if (dev->fd >= 0) {
+        close(dev->fd);
+        dev->fd = -1;
+    }
+    return r;
+}
+
+static void controller_attach_devices(struct Controller *c)
+{
+    unsigned int i;
+
+    /* devices come and go as recorded */
+    if (c->replay.reader)
+        return;
+
+    for (i = 0; i < c->n_devices && c->n_detached; i++)
+        device_attach(c, &c->devices[i]);
+
+    c->last_attach_retry_usec = now_usec();
+}
+
+static void inotify_handler(int fd, void *data, int ev_mask)
 {
     struct Controller *c = data;
-    uint64_t count = 0;
+    _Alignas(struct inotify_event) char buf[4096];
+    const struct inotify_event *ev;
+    ssize_t len;
+    char *p;
     int r;
 
-    r = read(fd, &count, sizeof(count));
-    if (r < 1 || count == 0)
+    for (;;) {
+        len = read(fd, buf, sizeof(buf));
+        if (len <= 0)
+            return;
+
+        for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+            unsigned int i;
+
+            ev = (const struct inotify_event *)p;
+            if (!ev->len)
+                continue;
+
+            for (i = 0; i < c->n_devices; i++) {
+                struct InputDevice *dev = &c->devices[i];
+                const char *basename = strrchr(dev->path, '/');
+
+                basename = basename ? basename + 1 : dev->path;
+                if (dev->attached || dev->wd != ev->wd || !streq(basename, ev->name))
+                    continue;
+
+                /* may fail while udev is still setting it up, wait for IN_ATTRIB */
+                r = device_attach(c, dev);
+                if (r < 0)
+                    log_debug("%s: not ready yet (%s)\n", device_name(dev), strerror(-r));
+            }
+        }
+    }
+}
+
+static int device_watch(struct Controller *c, struct InputDevice *dev)
+{
+    _cleanup_free_ char *dir = strdup(dev->path);
+    char *p;
+
+    if (!dir)
+        return -ENOMEM;
+
+    p = strrchr(dir, '/');
+    if (!p)
+        strcpy(dir, ".");
+    else if (p == dir)
+        p[1] = '\0';
+    else
+        *p = '\0';
+
+    dev->wd = inotify_add_watch(c->inotify_fd, dir, IN_CREATE | IN_ATTRIB | IN_MOVED_TO);
+    if (dev->wd < 0) {
+        log_warning("%s: can't watch %s, relying on polling to reattach (%m)\n",
+                    device_name(dev), dir);
+        return -errno;
+    }
+
+    return 0;
+}
+
+static void remote_update_handler(int fd, void *data, int ev_mask)
+{
+    struct Controller *c = data;
+    usec_t now = now_usec();
+
+    if (c->n_detached && now - c->last_attach_retry_usec >= DEVICE_RETRY_INTERVAL_USEC)
+        controller_attach_devices(c);
+
+    controller_send(c, now);
+}
+
+static void replay_dispatch(struct Controller *c, struct RecordEvent *ev,
+                            struct RecordAbsinfo *absinfo, usec_t ts)
+{
+    struct InputDevice *dev;
+    struct EmulatedDevice *emu;
+    struct input_event e;
+
+    if (ev->device >= c->n_devices) {
+        log_warning("replay: ignoring record for unknown device %u\n", ev->device);
         return;
+    }
 
-    remote_send_pkt(c->val, _AXIS_COUNT + _SC2BTN_COUNT);
+    dev = &c->devices[ev->device];
+    emu = dev->emulated;
+
+    switch (ev->type) {
+    case RECORD_ABSINFO:
+        if (ev->code >= ABS_CNT)
+            break;
+        emu->absinfo[ev->code] = (struct input_absinfo) {
+            .value = ev->value,
+            .minimum = absinfo->minimum,
+            .maximum = absinfo->maximum,
+            .fuzz = absinfo->fuzz,
+            .flat = absinfo->flat,
+        };
+        break;
+    case RECORD_RESYNC_ABS:
+        if (ev->code < ABS_CNT)
+            emu->absinfo[ev->code].value = ev->value;
+        break;
+    case RECORD_RESYNC_KEY:
+        if (ev->code >= KEY_CNT)
+            break;
+        if (ev->value)
+            emu->keys[ev->code / BITS_PER_LONG] |= 1UL << (ev->code % BITS_PER_LONG);
+        else
+            emu->keys[ev->code / BITS_PER_LONG] &= ~(1UL << (ev->code % BITS_PER_LONG));
+        break;
+    case RECORD_ATTACH:
+        device_attach(c, dev);
+        break;
+    case RECORD_DETACH:
+        device_detach(c, dev);
+        break;
+    default:
+        if (!dev->attached)
+            break;
+
+        ts += c->replay.start_usec;
+        e = (struct input_event) {
+            .type = ev->type,
+            .code = ev->code,
+            .value = ev->value,
+        };
+        e.input_event_sec = ts / USEC_PER_SEC;
+        e.input_event_usec = ts % USEC_PER_SEC;
+
+        /* keep axis info up to date in case a resync happens later */
+        if (e.type == EV_ABS && e.code < ABS_CNT)
+            emu->absinfo[e.code].value = e.value;
+
+        evdev_handle_events(c, dev, &e, 1);
+        break;
+    }
 }
 
-static void parse_config(CIniDomain *config)
+static void replay_handler(int fd, void *data, int ev_mask)
+{
+    struct Controller *c = data;
+    unsigned int n = 0;
+    usec_t now;
+    int r;
+
+    now = now_usec();
+
+    for (;;) {
+        if (!c->replay.pending) {
+            r = replay_next(c->replay.reader, &c->replay.ev, &c->replay.absinfo,
+                            &c->replay.ts);
+            if (r <= 0) {
+                if (r < 0)
+                    log_error("replay: %s\n", strerror(-r));
+                else
+                    log_info("replay: end of recording\n");
+                event_loop_stop();
+                return;
+            }
+            c->replay.pending = true;
+        }
+
+        if (c->replay.fast) {
+            if (n++ >= REPLAY_BATCH) {
+                event_loop_rearm_timeout(c->replay.timeout, 1);
+                return;
+            }
+        } else if (c->replay.start_usec + c->replay.ts > now) {
+            event_loop_rearm_timeout(c->replay.timeout,
+                                     c->replay.start_usec + c->replay.ts - now);
+            return;
+        }
+
+        c->replay.pending = false;
+        replay_dispatch(c, &c->replay.ev, &c->replay.absinfo, c->replay.ts);
+    }
+}
+
+static int replay_init(struct Controller *c, const struct ControllerOptions *opts)
+{
+    unsigned int i;
+    int r;
+
+    r = replay_open(opts->replay_file, &c->replay.reader);
+    if (r < 0)
+        return r;
+
+    for (i = 0; i < c->n_devices; i++) {
+        c->devices[i].emulated = calloc(1, sizeof(*c->devices[i].emulated));
+        if (!c->devices[i].emulated)
+            return -ENOMEM;
+    }
+
+    c->replay.fast = opts->flags & CONTROLLER_FLAG_REPLAY_FAST;
+    c->replay.start_usec = now_usec();
+    c->replay.timeout = event_loop_add_timeout(1000, c, replay_handler);
+    if (!c->replay.timeout)
+        return -ENOMEM;
+
+    /* start right away, the interval is just a fallback */
+    event_loop_rearm_timeout(c->replay.timeout, 1);
+
+    log_info("Replaying %s%s\n", opts->replay_file, c->replay.fast ? " as fast as possible" : "");
+
+    return 0;
+}
+
+static struct InputDevice *device_new(struct Controller *c, const char *name, const char *path)
+{
+    struct InputDevice *dev;
+
+    if (c->n_devices >= MAX_DEVICES) {
+        log_error("Too many input devices, maximum is %d\n", MAX_DEVICES);
+        return NULL;
+    }
+
+    dev = &c->devices[c->n_devices];
+    memset(&dev->map, CHANNEL_NONE, sizeof(dev->map));
+    dev->fd = -1;
+    dev->wd = -1;
+    dev->required = true;
+    dev->failsafe = PWM_CENTER;
+    dev->path = path ? strdup(path) : NULL;
+    dev->name = name ? strdup(name) : NULL;
+    if ((path && !dev->path) || (name && !dev->name)) {
+        free(dev->path);
+        free(dev->name);
+        dev->path = dev->name = NULL;
+        return NULL;
+    }
+
+    c->n_devices++;
+    c->n_detached++;
+    c->n_required_detached++;
+
+    return dev;
+}
+
+/* Map RC<n> keys in @group to events from @dev */
+static void parse_config_channels(struct Controller *c, struct InputDevice *dev, CIniGroup *group,
+                                  const char *label)
 {
-    CIniGroup *group;
     CIniEntry *entry;
-    const char *value;
-    int b;
 
-    group = c_ini_domain_find(config, "General", -1);
-    if (!group)
-        return;
+    for (entry = c_ini_group_iterate(group); entry; entry = c_ini_entry_next(entry)) {
+        const char *key, *value;
+        unsigned long ch;
+        uint16_t type, code;
+        int r;
+
+        key = c_ini_entry_get_key(entry, NULL);
+        value = c_ini_entry_get_value(entry, NULL);
+
+        /* RC1 ... RC16 */
+        if (!strncaseeq(key, "RC", 2))
+            continue;
+
+        if (safe_atoul(key + 2, &ch) < 0 || ch < 1 || ch > MAX_CHANNELS) {
+            log_warning("Invalid channel %s.%s\n", label, key);
+            continue;
+        }
+
+        r = parse_evdev_code(value, &type, &code);
+        if (r >= 0)
+            r = channel_map_set(c, dev, ch - 1, type, code);
+        if (r == -EEXIST) {
+            log_warning("Channel %s.%s is already mapped\n", label, key);
+            continue;
+        } else if (r < 0) {
+            log_warning("Invalid value %s.%s=%s\n", label, key, value);
+            continue;
+        }
+
+        log_debug("conf: %s.%s = %s\n", label, key, value);
+    }
+}
+
+/*
+ * Additional devices are configured in groups like:
+ *
+ * [Input gamepad]
+ * Device = /dev/input/by-id/usb-gamepad-event-joystick
+ * GrabDevice = yes
+ * Required = no
+ * Failsafe = 1000
+ * RC6 = BTN_SOUTH
+ */
+static int parse_config_input_group(struct Controller *c, CIniGroup *group, const char *label)
+{
+    struct InputDevice *dev;
+    CIniEntry *entry;
+    const char *path = NULL;
+    int b, r;
+
+    entry = c_ini_group_find(group, "Device", -1);
+    if (entry)
+        path = c_ini_entry_get_value(entry, NULL);
+    if (!path) {
+        log_error("Missing %s.Device\n", label);
+        return -EINVAL;
+    }
+
+    dev = device_new(c, label + strlen("Input "), path);
+    if (!dev)
+        return c->n_devices >= MAX_DEVICES ? -ENOSPC : -ENOMEM;
 
     entry = c_ini_group_find(group, "GrabDevice", -1);
-    if (!entry)
-        return;
+    if (entry) {
+        b = parse_boolean(c_ini_entry_get_value(entry, NULL));
+        if (b < 0)
+            log_warning("Invalid value %s.GrabDevice\n", label);
+        else
+            dev->grab = b;
+    }
 
-    value = c_ini_entry_get_value(entry, NULL);
-    b = parse_boolean(value);
-    if (b < 0) {
-        log_warning("Invalid value General.GrabDevice=%s\n", value);
-        return;
+    /* unlike InputDevice, auxiliary devices don't stop the vehicle from being controlled */
+    b = 0;
+    entry = c_ini_group_find(group, "Required", -1);
+    if (entry) {
+        b = parse_boolean(c_ini_entry_get_value(entry, NULL));
+        if (b < 0) {
+            log_warning("Invalid value %s.Required\n", label);
+            b = 0;
+        }
+    }
+    if (!b) {
+        dev->required = false;
+        c->n_required_detached--;
     }
 
-    controller.grab_device = b;
+    entry = c_ini_group_find(group, "Failsafe", -1);
+    if (entry) {
+        r = safe_atoi(c_ini_entry_get_value(entry, NULL), &b);
+        if (r < 0 || b < PWM_MIN || b > PWM_MAX)
+            log_warning("Invalid value %s.Failsafe\n", label);
+        else
+            dev->failsafe = b;
+    }
+
+    parse_config_channels(c, dev, group, label);
+
+    return 0;
 }
 
-int controller_init(const char *device, CIniDomain *config)
+static int parse_config(struct Controller *c, const char *device, CIniDomain *config)
 {
-    int fd, r;
+    const char *calibration_file = DEFAULT_CALIBRATION_FILE;
+    struct InputDevice *dev = NULL;
+    CIniGroup *group;
+    CIniEntry *entry;
+    size_t i;
+    int r;
+
+    c->update_interval_msec = REMOTE_UPDATE_INTERVAL;
+    c->min_send_interval_usec = MIN_SEND_INTERVAL_USEC;
+    c->keepalive_interval_usec = KEEPALIVE_INTERVAL_USEC;
+    c->change_redundancy = CHANGE_REDUNDANCY;
+
+    if (device) {
+        dev = device_new(c, NULL, device);
+        if (!dev)
+            return -ENOMEM;
+    }
 
-    controller.fd = -1;
+    group = config ? c_ini_domain_find(config, "General", -1) : NULL;
+    for (entry = group ? c_ini_group_iterate(group) : NULL; entry;
+         entry = c_ini_entry_next(entry)) {
+        const char *key, *value;
+        unsigned long ul;
+        size_t keylen;
+        int b;
+
+        key = c_ini_entry_get_key(entry, &keylen);
+        value = c_ini_entry_get_value(entry, NULL);
+
+        if (strncaseeq(key, "GrabDevice", keylen)) {
+            b = parse_boolean(value);
+            if (b < 0)
+                goto invalid;
+            if (dev)
+                dev->grab = b;
+        } else if (strncaseeq(key, "SendOnSync", keylen)) {
+            b = parse_boolean(value);
+            if (b < 0)
+                goto invalid;
+            c->send_on_sync = b;
+        } else if (strncaseeq(key, "MinSendIntervalUSec", keylen)) {
+            if (safe_atoul(value, &ul) < 0)
+                goto invalid;
+            c->min_send_interval_usec = ul;
+        } else if (strncaseeq(key, "UpdateIntervalMSec", keylen)) {
+            if (safe_atoul(value, &ul) < 0 || ul == 0)
+                goto invalid;
+            c->update_interval_msec = ul;
+        } else if (strncaseeq(key, "SendOnChange", keylen)) {
+            b = parse_boolean(value);
+            if (b < 0)
+                goto invalid;
+            c->send_on_change = b;
+        } else if (strncaseeq(key, "KeepaliveIntervalMSec", keylen)) {
+            if (safe_atoul(value, &ul) < 0 || ul == 0)
+                goto invalid;
+            c->keepalive_interval_usec = ul * USEC_PER_MSEC;
+        } else if (strncaseeq(key, "ChangeRedundancy", keylen)) {
+            if (safe_atoul(value, &ul) < 0 || ul == 0)
+                goto invalid;
+            c->change_redundancy = ul;
+        } else if (strncaseeq(key, "CalibrationFile", keylen)) {
+            calibration_file = value;
+        }
+
+        continue;
 
-    parse_config(config);
+invalid:
+        log_warning("Invalid value General.%.*s=%s\n", (int)keylen, key, value);
+    }
 
-    fd = open(device, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
-    if (fd < 0) {
-        log_error("can't open %s: %m", device);
+    /* config is released by the caller, but calibration is saved on shutdown */
+    c->calibration_file = strdup(calibration_file);
+    if (!c->calibration_file)
+        return -ENOMEM;
+
+    /* [Channels] is for the default device, with the SkyController 2 map if there's none */
+    group = config ? c_ini_domain_find(config, "Channels", -1) : NULL;
+    if (dev && group) {
+        parse_config_channels(c, dev, group, "Channels");
+    } else if (dev) {
+        for (i = 0; i < ARRAY_SIZE(sc2_channels); i++)
+            channel_map_set(c, dev, i, sc2_channels[i].type, sc2_channels[i].code);
+    } else if (group) {
+        log_warning("Ignoring [Channels]: no InputDevice\n");
+    }
+
+    for (group = config ? c_ini_domain_iterate(config) : NULL; group;
+         group = c_ini_group_next(group)) {
+        const char *label = c_ini_group_get_label(group, NULL);
+
+        if (!label || !strneq(label, "Input ", strlen("Input ")))
+            continue;
+
+        r = parse_config_input_group(c, group, label);
+        if (r < 0)
+            return r;
+    }
+
+    return 0;
+}
+
+static int calibration_save(struct Controller *c)
+{
+    _cleanup_free_ char *tmp = NULL;
+    _cleanup_free_ char *dir = NULL;
+    unsigned int ch;
+    char *p;
+    FILE *fp;
+
+    dir = strdup(c->calibration_file);
+    if (!dir)
+        return -ENOMEM;
+
+    p = strrchr(dir, '/');
+    if (p && p != dir) {
+        *p = '\0';
+        if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+            log_warning("Could not create %s: %m\n", dir);
+    }
+
+    if (asprintf(&tmp, "%s.tmp", c->calibration_file) < 0) {
+        tmp = NULL;
+        return -ENOMEM;
+    }
+
+    fp = fopen(tmp, "we");
+    if (!fp) {
+        log_error("Could not save calibration to %s: %m\n", tmp);
+        return -errno;
+    }
+
+    fputs("# Generated by dema-rc --calibrate\n", fp);
+
+    for (ch = 0; ch < c->n_channels; ch++) {
+        struct AxisCalibration *cal = &c->calibration[ch];
+
+        if (c->type[ch] != EV_ABS)
+            continue;
+
+        fprintf(fp, "\n[RC%u]\nMin = %d\nCenter = %d\nMax = %d\n", ch + 1, cal->min,
+                cal->center, cal->max);
+        log_info("RC%u: min: %d center: %d max: %d\n", ch + 1, cal->min, cal->center, cal->max);
+    }
+
+    if (fflush(fp) != 0 || ferror(fp) || fsync(fileno(fp)) < 0) {
+        log_error("Could not write calibration to %s: %m\n", tmp);
+        fclose(fp);
+        unlink(tmp);
+        return -EIO;
+    }
+
+    fclose(fp);
+
+    if (rename(tmp, c->calibration_file) < 0) {
+        log_error("Could not save calibration to %s: %m\n", c->calibration_file);
+        unlink(tmp);
         return -errno;
     }
 
-    r = controller.grab_device && evdev_grab_device(fd);
-    if (r != 0)
-        log_warning("Could not grab device %s: no exclusive access\n", device);
+    log_info("Calibration saved to %s\n", c->calibration_file);
+
+    return 0;
+}
+
+int controller_init(const char *device, CIniDomain *config, const struct ControllerOptions *opts)
+{
+    struct Controller *c = &controller;
+    unsigned int i;
+    int r;
+
+    c->inotify_fd = -1;
+    c->calibrating = opts->flags & CONTROLLER_FLAG_CALIBRATE;
+
+    /* the recording stands in for the default device */
+    if (!device && opts->replay_file)
+        device = opts->replay_file;
+
+    r = parse_config(c, device, config);
+    if (r < 0)
+        goto fail;
+
+    /* until they show up */
+    for (i = 0; i < c->n_devices; i++)
+        if (!c->devices[i].required)
+            device_hold_failsafe(c, &c->devices[i]);
+
+    if (c->n_devices == 0) {
+        log_error("no input device\n");
+        r = -EINVAL;
+        goto fail;
+    }
+
+    if (c->n_channels == 0) {
+        log_error("no channels mapped\n");
+        r = -EINVAL;
+        goto fail;
+    }
 
-    /* TODO: use EVIOCGID and check device id to support other controllers */
-    r = evdev_fill_info(fd, &controller);
+    r = shaping_init(config, c->n_channels);
     if (r < 0)
-        goto fail_fill;
+        goto fail;
 
-    controller.fd = fd;
-    if (event_loop_add_source(fd, &controller, EPOLLIN, evdev_handler) < 0)
-        goto fail_loop;
+    r = mixer_init(config, c->n_channels);
+    if (r < 0)
+        goto fail;
 
-    controller.remote_update_timeout
-        = event_loop_add_timeout(REMOTE_UPDATE_INTERVAL, &controller, remote_update_handler);
-    if (!controller.remote_update_timeout)
-        goto fail_timeout;
+    if (config)
+        c->config = c_ini_domain_ref(config);
+
+    if (opts->record_file) {
+        r = record_open(opts->record_file);
+        if (r < 0)
+            goto fail;
+    }
+
+    if (opts->replay_file) {
+        r = replay_init(c, opts);
+        if (r < 0)
+            goto fail;
+
+        goto done;
+    }
+
+    c->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (c->inotify_fd < 0) {
+        log_warning("Could not watch for input devices, relying on polling (%m)\n");
+    } else {
+        c->inotify_source = event_loop_add_source(c->inotify_fd, c, EPOLLIN, inotify_handler);
+        if (!c->inotify_source) {
+            close(c->inotify_fd);
+            c->inotify_fd = -1;
+            r = -ENOMEM;
+            goto fail;
+        }
+    }
+
+    for (i = 0; i < c->n_devices; i++) {
+        struct InputDevice *dev = &c->devices[i];
+
+        if (c->inotify_fd >= 0)
+            device_watch(c, dev);
+
+        /* TODO: use EVIOCGID and check device id to support other controllers */
+        r = device_attach(c, dev);
+        if (r == -ENOENT) {
+            log_warning("%s: %s not found, waiting for it\n", device_name(dev), dev->path);
+        } else if (r < 0) {
+            log_error("can't open %s: %s\n", dev->path, strerror(-r));
+            goto fail;
+        }
+    }
+
+done:
+    c->last_attach_retry_usec = now_usec();
+
+    c->remote_update_timeout
+        = event_loop_add_timeout(c->update_interval_msec, c, remote_update_handler);
+    if (!c->remote_update_timeout) {
+        r = -ENOMEM;
+        goto fail;
+    }
+
+    if (c->calibrating)
+        log_info("Calibrating: move all sticks to their extents, then stop dema-rc to save\n");
 
     return 0;
 
-fail_timeout:
-    event_loop_remove_source(fd);
-fail_loop:
-    controller.fd = -1;
-fail_fill:
-    close(fd);
+fail:
+    controller_shutdown();
     return r;
 }
 
+usec_t controller_get_update_interval(void)
+{
+    return controller.update_interval_msec * USEC_PER_MSEC;
+}
+
 void controller_shutdown(void)
 {
-    if (controller.fd < 0)
-        return;
+    struct Controller *c = &controller;
+    unsigned int i;
+
+    /* only after a successful initialization */
+    if (c->remote_update_timeout) {
+        if (c->calibrating && c->n_devices > c->n_detached)
+            calibration_save(c);
+
+        event_loop_remove_timeout(c->remote_update_timeout);
+        c->remote_update_timeout = NULL;
+    }
+
+    if (c->inotify_fd >= 0) {
+        event_loop_remove_source(c->inotify_source);
+        c->inotify_source = NULL;
+        close(c->inotify_fd);
+        c->inotify_fd = -1;
+    }
+
+    if (c->replay.timeout) {
+        event_loop_remove_timeout(c->replay.timeout);
+        c->replay.timeout = NULL;
+    }
+
+    if (c->replay.reader) {
+        replay_close(c->replay.reader);
+        c->replay.reader = NULL;
+    }
+
+    record_close();
+
+    if (c->send_on_change && c->send_stats.sent + c->send_stats.suppressed)
+        log_info("%lu packets sent, %lu skipped without changes (%lu%%)\n", c->send_stats.sent,
+                 c->send_stats.suppressed,
+                 c->send_stats.suppressed * 100 / (c->send_stats.sent + c->send_stats.suppressed));
 
-    event_loop_remove_source(controller.fd);
-    event_loop_remove_timeout(controller.remote_update_timeout);
+    for (i = 0; i < c->n_devices; i++) {
+        struct InputDevice *dev = &c->devices[i];
+
+        if (dev->stats.dropped)
+            log_info("%s: input events dropped %lu times, resynchronized %lu times\n",
+                     device_name(dev), dev->stats.dropped, dev->stats.resyncs);
+
+        if (dev->stats.latency.count) {
+            char name[128];
+
+            snprintf(name, sizeof(name), "%s input-to-send latency", device_name(dev));
+            histogram_log(&dev->stats.latency, name);
+        }
+
+        if (dev->source) {
+            event_loop_remove_source(dev->source);
+            dev->source = NULL;
+        }
+
+        if (dev->fd >= 0) {
+            close(dev->fd);
+            dev->fd = -1;
+        }
+
+        free(dev->emulated);
+        free(dev->name);
+        free(dev->path);
+        dev->emulated = NULL;
+        dev->name = dev->path = NULL;
+    }
+
+    c->n_devices = 0;
+
+    mixer_shutdown();
+    shaping_shutdown();
+
+    if (c->config) {
+        c_ini_domain_unref(c->config);
+        c->config = NULL;
+    }
 
-    close(controller.fd);
+    free(c->calibration_file);
+    c->calibration_file = NULL;
 }
@@ -3,7 +3,29 @@
 
 #pragma once
 
+#include "util.h"
+
 typedef struct CIniDomain CIniDomain;
 
-int controller_init(const char *device, CIniDomain *config);
+#define MAX_CHANNELS 16
+
+enum ControllerFlags {
+    /* Capture axis extents and save them as calibration on shutdown */
+    CONTROLLER_FLAG_CALIBRATE = 1 << 0,
+    /* Replay without waiting between events */
+    CONTROLLER_FLAG_REPLAY_FAST = 1 << 1,
+};
+
+struct ControllerOptions {
+    unsigned int flags;
+    /* Log input events to this file */
+    const char *record_file;
+    /* Read input events from this file rather than from devices */
+    const char *replay_file;
+};
+
+int controller_init(const char *device, CIniDomain *config, const struct ControllerOptions *opts);
 void controller_shutdown(void);
+
+/* Interval between packets when nothing else triggers a send */
+usec_t controller_get_update_interval(void);
@@ -0,0 +1,124 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+/* Copyright (c) 2020 Lucas De Marchi <lucas.de.marchi@gmail.com> */
+
+#include "csv.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "controller.h"
+#include "log.h"
+#include "output.h"
+#include "util.h"
+
+#define CSV_PREFIX "csv:"
+
+/* timestamp and channels, each with its separator */
+#define CSV_LINE_MAX (sizeof("18446744073709551615") + MAX_CHANNELS * sizeof(",-2147483648") + 1)
+
+static struct {
+    FILE *fp;
+    char *path;
+    char line[CSV_LINE_MAX];
+    int len;
+    int count;
+    bool header_written;
+    unsigned long lines;
+} csv_ctx;
+
+static bool csv_match(const char *spec)
+{
+    return strneq(spec, CSV_PREFIX, strlen(CSV_PREFIX));
+}
+
+static int csv_init(char *spec, const struct OutputDefaults *defaults)
+{
+    const char *path = spec + strlen(CSV_PREFIX);
+    int r;
+
+    if (csv_ctx.fp) {
+        log_error("only one csv output is supported\n");
+        return -EEXIST;
+    }
+
+    csv_ctx.path = strdup(path);
+    if (!csv_ctx.path)
+        return -ENOMEM;
+
+    csv_ctx.fp = streq(path, "-") ? stdout : fopen(path, "we");
+    if (!csv_ctx.fp) {
+        r = -errno;
+        log_error("could not open %s: %m\n", path);
+        free(csv_ctx.path);
+        csv_ctx.path = NULL;
+        return r;
+    }
+
+    log_info("Writing channels to %s\n", path);
+
+    return 0;
+}
+
+static void csv_encode(const int val[], int count, usec_t timestamp_usec)
+{
+    int i;
+
+    count = min(count, MAX_CHANNELS);
+    csv_ctx.count = count;
+    csv_ctx.len = snprintf(csv_ctx.line, sizeof(csv_ctx.line), "%" PRIu64, timestamp_usec);
+
+    for (i = 0; i < count; i++)
+        csv_ctx.len += snprintf(csv_ctx.line + csv_ctx.len, sizeof(csv_ctx.line) - csv_ctx.len,
+                                ",%d", val[i]);
+
+    csv_ctx.line[csv_ctx.len++] = '\n';
+}
+
+static void csv_send(usec_t now)
+{
+    int i;
+
+    /* header as soon as the number of channels is known */
+    if (!csv_ctx.header_written) {
+        csv_ctx.header_written = true;
+        fputs("timestamp_usec", csv_ctx.fp);
+        for (i = 0; i < csv_ctx.count; i++)
+            fprintf(csv_ctx.fp, ",RC%d", i + 1);
+        fputc('\n', csv_ctx.fp);
+    }
+
+    if (fwrite(csv_ctx.line, csv_ctx.len, 1, csv_ctx.fp) == 1)
+        csv_ctx.lines++;
+}
+
+static void csv_stats(void)
+{
+    if (csv_ctx.fp)
+        log_info("%s: %lu lines written\n", csv_ctx.path, csv_ctx.lines);
+}
+
+static void csv_shutdown(void)
+{
+    if (csv_ctx.fp && csv_ctx.fp != stdout)
+        fclose(csv_ctx.fp);
+    else if (csv_ctx.fp)
+        fflush(csv_ctx.fp);
+
+    free(csv_ctx.path);
+    csv_ctx.path = NULL;
+    csv_ctx.fp = NULL;
+    csv_ctx.header_written = false;
+    csv_ctx.lines = 0;
+}
+
+const struct OutputBackend csv_output_backend = {
+    .name = "csv",
+    .match = csv_match,
+    .init = csv_init,
+    .encode = csv_encode,
+    .send = csv_send,
+    .stats = csv_stats,
+    .shutdown = csv_shutdown,
+};
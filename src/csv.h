@@ -0,0 +1,7 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+/* Copyright (c) 2020 Lucas De Marchi <lucas.de.marchi@gmail.com> */
+
+#pragma once
+
+/* Channel values as text, one line per packet: csv:PATH, with - for stdout */
+extern const struct OutputBackend csv_output_backend;
@@ -0,0 +1,131 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+/* Copyright (c) 2020 Lucas De Marchi <lucas.de.marchi@gmail.com> */
+
+/*
+ * Channel values published by dema-rc in shared memory, for consumers on the same host: map
+ * /dev/shm/NAME, given as shm:NAME in the destinations, read-only and use the functions below.
+ * There's a single producer and any number of readers, that never block it: a reader that
+ * doesn't keep up loses frames, never delays the next one.
+ *
+ * The latest frame is always available in a slot of its own. All frames also go to a ring, for
+ * readers that need every one of them, e.g. loggers. Each slot is protected by a sequence
+ * counter, odd while being written: readers retry when it changed while they were copying.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define DEMA_RC_SHM_MAGIC 0x53435244 /* "DRCS" */
+#define DEMA_RC_SHM_VERSION 1
+#define DEMA_RC_SHM_MAX_CHANNELS 16
+#define DEMA_RC_SHM_RING_SIZE 256
+/* a slot is written in well under a microsecond, unless the producer died in the middle */
+#define DEMA_RC_SHM_READ_RETRIES 1000
+
+struct DemaRcShmFrame {
+    /* frame number, starting from 0 and continuing when dema-rc restarts */
+    uint64_t seq;
+    /* CLOCK_MONOTONIC time of the newest input sample in the frame */
+    uint64_t timestamp_usec;
+    uint32_t count;
+    /* PWM values in us */
+    int32_t channels[DEMA_RC_SHM_MAX_CHANNELS];
+};
+
+struct DemaRcShmSlot {
+    uint32_t lock;
+    struct DemaRcShmFrame frame;
+} __attribute__((aligned(64)));
+
+struct DemaRcShm {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ring_size;
+    uint32_t max_channels;
+    /* pid of the producer, 0 once it exited */
+    uint32_t pid;
+    /* frames published so far: frame n is in ring[n % ring_size] */
+    uint64_t head;
+
+    struct DemaRcShmSlot latest;
+    struct DemaRcShmSlot ring[DEMA_RC_SHM_RING_SIZE];
+};
+
+static inline bool dema_rc_shm_valid(const struct DemaRcShm *shm)
+{
+    return __atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) == DEMA_RC_SHM_MAGIC
+        && shm->version == DEMA_RC_SHM_VERSION && shm->ring_size == DEMA_RC_SHM_RING_SIZE;
+}
+
+/* Copy @slot, retrying while it's being written or changes while copying */
+static inline bool dema_rc_shm_slot_read(const struct DemaRcShmSlot *slot,
+                                         struct DemaRcShmFrame *frame)
+{
+    unsigned int i;
+
+    for (i = 0; i < DEMA_RC_SHM_READ_RETRIES; i++) {
+        uint32_t lock = __atomic_load_n(&slot->lock, __ATOMIC_ACQUIRE);
+
+        if (lock & 1)
+            continue;
+
+        memcpy(frame, &slot->frame, sizeof(*frame));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&slot->lock, __ATOMIC_RELAXED) == lock)
+            return true;
+    }
+
+    return false;
+}
+
+/* Latest frame. False if nothing was published yet */
+static inline bool dema_rc_shm_read_latest(const struct DemaRcShm *shm,
+                                           struct DemaRcShmFrame *frame)
+{
+    if (!__atomic_load_n(&shm->head, __ATOMIC_ACQUIRE))
+        return false;
+
+    return dema_rc_shm_slot_read(&shm->latest, frame);
+}
+
+/*
+ * Frame number *@next from the ring. Returns 1 and advances *@next when there's one, 0 when it's
+ * not published yet and -1 when it was already overwritten: *@next is then moved to the oldest
+ * frame still available. Start with *@next = head to only get new frames.
+ */
+static inline int dema_rc_shm_read_next(const struct DemaRcShm *shm, uint64_t *next,
+                                        struct DemaRcShmFrame *frame)
+{
+    uint64_t head = __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE);
+    const struct DemaRcShmSlot *slot;
+
+    /* producer restarted behind us with a new file */
+    if (*next > head)
+        *next = head;
+
+    if (*next == head)
+        return 0;
+
+    if (head - *next > DEMA_RC_SHM_RING_SIZE) {
+        *next = head - DEMA_RC_SHM_RING_SIZE;
+        return -1;
+    }
+
+    slot = &shm->ring[*next % DEMA_RC_SHM_RING_SIZE];
+    if (!dema_rc_shm_slot_read(slot, frame))
+        return 0;
+
+    /* overwritten between reading head and the slot */
+    if (frame->seq != *next) {
+        *next = __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE) - DEMA_RC_SHM_RING_SIZE + 1;
+        return -1;
+    }
+
+    (*next)++;
+
+    return 1;
+}
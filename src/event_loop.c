@@ -5,6 +5,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/timerfd.h>
@@ -12,15 +13,40 @@
 
 #include "array.h"
 #include "log.h"
+#include "uring.h"
 #include "util.h"
 
 /* clang-format off */
 
 #define DEFAULT_SOURCE_CAPACITY 16
+#define URING_ENTRIES 256
+/* slots are allocated in chunks that never move: pointers to sources stay valid */
+#define SOURCE_CHUNK_SIZE 64
+#define SOURCE_NONE UINT32_MAX
+/* the busy poll window is kept this many times the average lateness of early wakeups */
+#define BUSY_POLL_LATENESS_FACTOR 4
+#define BUSY_POLL_MIN_USEC 20
 
 enum EventType {
     EVENT_GENERIC,
     EVENT_TIMEOUT,
+    EVENT_READ,
+    EVENT_SEND,
+};
+
+/*
+ * io_uring operations carry the id of the source they are for, with the kind of operation in the
+ * low bits. 0 is for those whose completion is of no interest
+ */
+enum UringOp {
+    URING_OP_IGNORE,
+    URING_OP_POLL,
+    URING_OP_TIMEOUT,
+    /* poll linked before each read, so reads never complete with -EAGAIN */
+    URING_OP_READ_POLL,
+    URING_OP_READ,
+    URING_OP_SEND,
+    _URING_OP_MASK = 0x7,
 };
 
 struct EventSource {
@@ -28,186 +54,871 @@ struct EventSource {
     EventCallback cb;
     int fd;
     enum EventType type;
+    int ev_mask;
+
+    /*
+     * What epoll events and io_uring completions carry instead of a pointer: generation in the
+     * upper 32 bits, slot index shifted by 3, leaving room for the io_uring operation
+     */
+    uint64_t id;
+
+    /* io_uring: operations not completed yet */
+    unsigned int inflight;
 };
 
 struct TimeoutSource {
     struct EventSource event;
-    struct itimerspec ts;
+    /* 0 for one-shot */
+    usec_t period_usec;
+    /* absolute CLOCK_MONOTONIC expiration */
+    usec_t expire_usec;
+    /* position in ev_ctx.timers, -1 when not armed */
+    int heap_index;
+};
+
+struct ReadSource {
+    struct EventSource event;
+    void *buf;
+    size_t len;
+    EventReadCallback cb;
+};
+
+struct SendSource {
+    struct EventSource event;
+    EventSendCallback cb;
+};
+
+struct SourceSlot {
+    union {
+        struct EventSource event;
+        struct TimeoutSource timeout;
+        struct ReadSource read;
+        struct SendSource send;
+    };
+    /* bumped when freed: ids still pending in the kernel stop matching */
+    uint32_t generation;
+    uint32_t next_free;
 };
 
 static struct {
+    enum EventLoopBackend backend;
     int fd;
+    struct Uring uring;
     bool should_exit;
 
-    struct array sources;
+    /* chunks of SOURCE_CHUNK_SIZE slots, free ones linked from free_slot */
+    struct array chunks;
+    uint32_t free_slot;
+
+    /*
+     * Armed timeouts in a binary min-heap by expiration. A single timer wakes the loop for the
+     * earliest: a timerfd with epoll, a timeout operation with io_uring
+     */
+    struct array timers;
+    struct EventSource *timer_source;
+    usec_t timer_armed_usec;
+    struct __kernel_timespec timer_expire;
+    bool dispatching_timers;
+
+    /*
+     * Busy polling: the timer is armed busy_poll_usec before the earliest timeout, and the loop
+     * polls without blocking from then until it's due. The window adapts to how late those
+     * wakeups are, up to busy_poll_max_usec
+     */
+    usec_t busy_poll_max_usec;
+    usec_t busy_poll_usec;
+    usec_t wakeup_late_usec;
 } ev_ctx = {
     .fd = -1,
+    .free_slot = SOURCE_NONE,
 };
 
 /* clang-format off */
 
-int event_loop_init(void)
+static const char *const backend_names[] = {
+    [EVENT_LOOP_EPOLL] = "epoll",
+    [EVENT_LOOP_IO_URING] = "io_uring",
+};
+
+enum EventLoopBackend event_loop_backend_from_str(const char *s)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(backend_names); i++)
+        if (streq(s, backend_names[i]))
+            return i;
+
+    return _EVENT_LOOP_BACKEND_UNKNOWN;
+}
+
+static bool use_uring(void)
+{
+    return ev_ctx.backend == EVENT_LOOP_IO_URING;
+}
+
+static struct SourceSlot *slot_at(uint32_t index)
 {
+    struct SourceSlot *chunk = ev_ctx.chunks.array[index / SOURCE_CHUNK_SIZE];
+
+    return &chunk[index % SOURCE_CHUNK_SIZE];
+}
+
+static int source_chunk_add(void)
+{
+    uint32_t base = ev_ctx.chunks.count * SOURCE_CHUNK_SIZE;
+    struct SourceSlot *chunk;
+    int i, r;
+
+    /* the index must fit in 29 bits of the id */
+    if (base + SOURCE_CHUNK_SIZE > 1U << 29)
+        return -ENOSPC;
+
+    chunk = calloc(SOURCE_CHUNK_SIZE, sizeof(*chunk));
+    if (!chunk)
+        return -ENOMEM;
+
+    r = array_append(&ev_ctx.chunks, chunk);
+    if (r < 0) {
+        free(chunk);
+        return r;
+    }
+
+    for (i = SOURCE_CHUNK_SIZE - 1; i >= 0; i--) {
+        chunk[i].next_free = ev_ctx.free_slot;
+        ev_ctx.free_slot = base + i;
+    }
+
+    return 0;
+}
+
+static struct EventSource *source_alloc(enum EventType type)
+{
+    struct SourceSlot *slot;
+    uint32_t index;
+    int r;
+
+    if (ev_ctx.free_slot == SOURCE_NONE) {
+        r = source_chunk_add();
+        if (r < 0) {
+            log_error("Could not add source (%s)\n", strerror(-r));
+            return NULL;
+        }
+    }
+
+    index = ev_ctx.free_slot;
+    slot = slot_at(index);
+    ev_ctx.free_slot = slot->next_free;
+
+    memset(slot, 0, offsetof(struct SourceSlot, generation));
+    slot->event.fd = -1;
+    slot->event.type = type;
+    slot->event.id = (uint64_t)slot->generation << 32 | index << 3;
+
+    return &slot->event;
+}
+
+/*
+ * Back to the free list right away: whatever the kernel still has for it, epoll events in the
+ * batch being dispatched or io_uring completions, has an id that doesn't match anymore
+ */
+static void source_free(struct EventSource *source)
+{
+    uint32_t index = (uint32_t)source->id >> 3;
+    struct SourceSlot *slot = slot_at(index);
+
+    slot->generation++;
+    slot->next_free = ev_ctx.free_slot;
+    ev_ctx.free_slot = index;
+}
+
+/* Source for an id handed back by the kernel, NULL if it was removed since */
+static struct EventSource *source_get(uint64_t id)
+{
+    uint32_t index = (uint32_t)id >> 3;
+    struct SourceSlot *slot;
+
+    if (index >= ev_ctx.chunks.count * SOURCE_CHUNK_SIZE)
+        return NULL;
+
+    slot = slot_at(index);
+    if (slot->generation != id >> 32)
+        return NULL;
+
+    return &slot->event;
+}
+
+static uint64_t uring_tag(struct EventSource *source, enum UringOp op)
+{
+    return source->id | op;
+}
+
+static struct io_uring_sqe *uring_prep(struct EventSource *source, enum UringOp op, int opcode)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&ev_ctx.uring);
+
+    if (!sqe) {
+        log_error("io_uring: submission queue full\n");
+        return NULL;
+    }
+
+    sqe->opcode = opcode;
+    sqe->fd = -1;
+    sqe->user_data = op == URING_OP_IGNORE ? 0 : uring_tag(source, op);
+    if (op != URING_OP_IGNORE)
+        source->inflight++;
+
+    return sqe;
+}
+
+static void sources_free(void)
+{
+    size_t i;
+
+    for (i = 0; i < ev_ctx.chunks.count; i++)
+        free(ev_ctx.chunks.array[i]);
+
+    array_free_array(&ev_ctx.chunks);
+    array_free_array(&ev_ctx.timers);
+    ev_ctx.free_slot = SOURCE_NONE;
+    ev_ctx.timer_source = NULL;
+    ev_ctx.timer_armed_usec = 0;
+}
+
+static int epoll_timer_init(void)
+{
+    struct epoll_event ev = {
+        .events = EPOLLIN,
+        .data.u64 = ev_ctx.timer_source->id,
+    };
+    int fd;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        log_error("unable to create timerfd: %m\n");
+        return -errno;
+    }
+
+    if (epoll_ctl(ev_ctx.fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        log_error("Could not add fd: %d (%m)\n", fd);
+        close(fd);
+        return -errno;
+    }
+
+    ev_ctx.timer_source->fd = fd;
+
+    return 0;
+}
+
+int event_loop_init(enum EventLoopBackend backend)
+{
+    int r;
+
     assert(ev_ctx.fd < 0);
 
+    array_init(&ev_ctx.chunks, DEFAULT_SOURCE_CAPACITY);
+    array_init(&ev_ctx.timers, DEFAULT_SOURCE_CAPACITY);
+
+    ev_ctx.timer_source = source_alloc(EVENT_TIMEOUT);
+    if (!ev_ctx.timer_source) {
+        r = -ENOMEM;
+        goto fail;
+    }
+
+    if (backend == EVENT_LOOP_IO_URING) {
+        r = uring_init(&ev_ctx.uring, URING_ENTRIES);
+        if (r >= 0) {
+            ev_ctx.fd = ev_ctx.uring.fd;
+            goto done;
+        }
+
+        log_warning("io_uring not available (%s), using epoll\n", strerror(-r));
+        backend = EVENT_LOOP_EPOLL;
+    }
+
     ev_ctx.fd = epoll_create1(EPOLL_CLOEXEC);
     if (ev_ctx.fd == -1) {
         log_error("%m\n");
-        return -errno;
+        r = -errno;
+        goto fail;
+    }
+
+    r = epoll_timer_init();
+    if (r < 0) {
+        close(ev_ctx.fd);
+        ev_ctx.fd = -1;
+        goto fail;
     }
 
-    array_init(&ev_ctx.sources, DEFAULT_SOURCE_CAPACITY);
+done:
+    ev_ctx.backend = backend;
+
+    log_debug("event loop: %s\n", backend_names[backend]);
 
     return 0;
+
+fail:
+    sources_free();
+    return r;
 }
 
 void event_loop_shutdown(void)
 {
-    if (ev_ctx.fd >= 0) {
+    if (use_uring()) {
+        /* anything still in flight is cancelled with the ring */
+        uring_exit(&ev_ctx.uring);
+        ev_ctx.fd = -1;
+    } else if (ev_ctx.fd >= 0) {
         close(ev_ctx.fd);
         ev_ctx.fd = -1;
     }
 
-    array_free_array(&ev_ctx.sources);
+    if (ev_ctx.timer_source && ev_ctx.timer_source->fd >= 0)
+        close(ev_ctx.timer_source->fd);
+
+    /* sources not removed by their owners go with the slots */
+    sources_free();
 }
 
-static int _event_loop_add_source(struct EventSource *source, int fd, void *data,
-                                  int ev_mask, EventCallback cb)
+static int uring_arm_poll(struct EventSource *source)
 {
-    struct epoll_event ev = { };
-    int r;
+    struct io_uring_sqe *sqe = uring_prep(source, URING_OP_POLL, IORING_OP_POLL_ADD);
 
-    r = array_append(&ev_ctx.sources, source);
-    if (r < 0) {
-        log_error("Could not add source (%s)\n", strerror(-r));
-        return r;
+    if (!sqe)
+        return -EBUSY;
+
+    sqe->fd = source->fd;
+    sqe->poll32_events = source->ev_mask;
+    sqe->len = IORING_POLL_ADD_MULTI;
+
+    return 0;
+}
+
+static int uring_arm_read(struct ReadSource *rs)
+{
+    struct EventSource *source = &rs->event;
+    struct io_uring_sqe *sqe;
+
+    /* the pair must not be split by a submission in between */
+    if (uring_sq_space(&ev_ctx.uring) < 2)
+        uring_submit_and_wait(&ev_ctx.uring, 0);
+    if (uring_sq_space(&ev_ctx.uring) < 2) {
+        log_error("io_uring: submission queue full\n");
+        return -EBUSY;
+    }
+
+    sqe = uring_prep(source, URING_OP_READ_POLL, IORING_OP_POLL_ADD);
+    sqe->fd = source->fd;
+    sqe->poll32_events = POLLIN;
+    sqe->flags = IOSQE_IO_LINK;
+
+    sqe = uring_prep(source, URING_OP_READ, IORING_OP_READ);
+    sqe->fd = source->fd;
+    sqe->addr = (uintptr_t)rs->buf;
+    sqe->len = rs->len;
+    sqe->off = -1;
+
+    return 0;
+}
+
+/* Single timeout operation for the earliest timer, updated in place while pending */
+static int uring_arm_timer(usec_t expire_usec)
+{
+    struct EventSource *source = ev_ctx.timer_source;
+    struct io_uring_sqe *sqe;
+
+    /* read when submitted */
+    ev_ctx.timer_expire.tv_sec = expire_usec / USEC_PER_SEC;
+    ev_ctx.timer_expire.tv_nsec = (expire_usec % USEC_PER_SEC) * NSEC_PER_USEC;
+
+    if (source->inflight) {
+        sqe = uring_prep(source, URING_OP_IGNORE, IORING_OP_TIMEOUT_REMOVE);
+        if (!sqe)
+            return -EBUSY;
+
+        sqe->addr = uring_tag(source, URING_OP_TIMEOUT);
+        sqe->addr2 = (uintptr_t)&ev_ctx.timer_expire;
+        sqe->timeout_flags = IORING_TIMEOUT_UPDATE | IORING_TIMEOUT_ABS;
+
+        return 0;
+    }
+
+    sqe = uring_prep(source, URING_OP_TIMEOUT, IORING_OP_TIMEOUT);
+    if (!sqe)
+        return -EBUSY;
+
+    sqe->addr = (uintptr_t)&ev_ctx.timer_expire;
+    sqe->len = 1;
+    sqe->timeout_flags = IORING_TIMEOUT_ABS;
+
+    return 0;
+}
+
+/* Cancel what's in flight for @source, completions that still come are ignored */
+static void uring_cancel(struct EventSource *source)
+{
+    struct io_uring_sqe *sqe;
+
+    switch (source->type) {
+    case EVENT_GENERIC:
+        sqe = uring_prep(source, URING_OP_IGNORE, IORING_OP_POLL_REMOVE);
+        if (sqe)
+            sqe->addr = uring_tag(source, URING_OP_POLL);
+        break;
+    case EVENT_READ:
+        sqe = uring_prep(source, URING_OP_IGNORE, IORING_OP_POLL_REMOVE);
+        if (sqe)
+            sqe->addr = uring_tag(source, URING_OP_READ_POLL);
+        sqe = uring_prep(source, URING_OP_IGNORE, IORING_OP_ASYNC_CANCEL);
+        if (sqe)
+            sqe->addr = uring_tag(source, URING_OP_READ);
+        break;
+    case EVENT_TIMEOUT:
+    case EVENT_SEND:
+        /* timeouts aren't sources of their own and sends complete on their own */
+        break;
     }
+}
+
+/* Stop dispatching to @source and free it: safe from any callback */
+static void release_source(struct EventSource *source)
+{
+    if (use_uring() && source->inflight)
+        uring_cancel(source);
+
+    source_free(source);
+}
+
+static struct EventSource *_event_loop_add_source(enum EventType type, int fd, void *data,
+                                                  int ev_mask, EventCallback cb)
+{
+    struct EventSource *source;
+    struct epoll_event ev = { };
+
+    source = source_alloc(type);
+    if (!source)
+        return NULL;
 
     source->user_data = data;
     source->cb = cb;
     source->fd = fd;
+    source->ev_mask = ev_mask;
+
+    /* io_uring operations are submitted by the caller, that knows the kind of source */
+    if (use_uring())
+        goto done;
 
     ev.events = ev_mask;
-    ev.data.ptr = source;
+    ev.data.u64 = source->id;
 
-    r = epoll_ctl(ev_ctx.fd, EPOLL_CTL_ADD, fd, &ev);
-    if (r < 0) {
-        r = -errno;
+    if (epoll_ctl(ev_ctx.fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
         log_error("Could not add fd: %d (%m)\n", fd);
-        goto fail_epoll;
+        source_free(source);
+        return NULL;
     }
 
+done:
     log_debug("source %d added\n", fd);
 
-    return 0;
+    return source;
+}
 
-fail_epoll:
-    array_pop(&ev_ctx.sources);
-    return r;
+struct EventSource *event_loop_add_source(int fd, void *data, int ev_mask, EventCallback cb)
+{
+    struct EventSource *source;
+
+    source = _event_loop_add_source(EVENT_GENERIC, fd, data, ev_mask, cb);
+    if (!source)
+        return NULL;
+
+    if (use_uring() && uring_arm_poll(source) < 0) {
+        source_free(source);
+        return NULL;
+    }
+
+    return source;
 }
 
-int event_loop_add_source(int fd, void *data, int ev_mask, EventCallback cb)
+struct EventSource *event_loop_add_read_source(int fd, void *buf, size_t len, void *data,
+                                               EventReadCallback cb)
 {
     struct EventSource *source;
-    int r;
+    struct ReadSource *rs;
 
-    source = calloc(1, sizeof(*source));
-    if (!source) {
-        log_error("Could not add source (%m)\n");
-        return -errno;
+    source = _event_loop_add_source(EVENT_READ, fd, data, EPOLLIN, NULL);
+    if (!source)
+        return NULL;
+
+    rs = (struct ReadSource *)source;
+    rs->buf = buf;
+    rs->len = len;
+    rs->cb = cb;
+
+    if (use_uring() && uring_arm_read(rs) < 0) {
+        source_free(source);
+        return NULL;
     }
 
-    r = _event_loop_add_source(source, fd, data, ev_mask, cb);
-    if (r < 0) {
-        free(source);
-        return r;
+    return source;
+}
+
+int event_loop_remove_source(struct EventSource *source)
+{
+    int fd = source->fd, r = 0;
+
+    assert(source->type == EVENT_GENERIC || source->type == EVENT_READ);
+
+    if (!use_uring() && epoll_ctl(ev_ctx.fd, EPOLL_CTL_DEL, fd, NULL) < 0) {
+        r = -errno;
+        log_error("Could not remove fd: %d (%m)\n", fd);
     }
 
-    return 0;
+    /* released anyway: nothing is dispatched to it and the fd is closed by the caller */
+    release_source(source);
+
+    log_debug("source %d removed\n", fd);
+
+    return r;
 }
 
-int event_loop_remove_source(int fd)
+static bool timer_before(const struct TimeoutSource *a, const struct TimeoutSource *b)
 {
-    struct EventSource *source;
-    int i;
+    return a->expire_usec < b->expire_usec;
+}
 
-    for (i = 0; i < (int) ev_ctx.sources.count; i++) {
-        source = ev_ctx.sources.array[i];
+static struct TimeoutSource *timer_at(unsigned int i)
+{
+    return ev_ctx.timers.array[i];
+}
 
-        if (source->fd == fd)
+static void timer_set(unsigned int i, struct TimeoutSource *t)
+{
+    ev_ctx.timers.array[i] = t;
+    t->heap_index = i;
+}
+
+static void timers_sift_up(unsigned int i)
+{
+    struct TimeoutSource *t = timer_at(i);
+
+    while (i > 0 && timer_before(t, timer_at((i - 1) / 2))) {
+        timer_set(i, timer_at((i - 1) / 2));
+        i = (i - 1) / 2;
+    }
+
+    timer_set(i, t);
+}
+
+static void timers_sift_down(unsigned int i)
+{
+    struct TimeoutSource *t = timer_at(i);
+    unsigned int n = ev_ctx.timers.count;
+
+    for (;;) {
+        unsigned int child = 2 * i + 1;
+
+        if (child >= n)
+            break;
+        if (child + 1 < n && timer_before(timer_at(child + 1), timer_at(child)))
+            child++;
+        if (!timer_before(timer_at(child), t))
             break;
+
+        timer_set(i, timer_at(child));
+        i = child;
     }
 
-    if (i >= (int) ev_ctx.sources.count) {
-        log_error("fd not found: %d\n", fd);
-        return -EINVAL;
+    timer_set(i, t);
+}
+
+static int timers_insert(struct TimeoutSource *t)
+{
+    int r = array_append(&ev_ctx.timers, t);
+
+    if (r < 0)
+        return r;
+
+    timers_sift_up(ev_ctx.timers.count - 1);
+
+    return 0;
+}
+
+static void timers_remove(struct TimeoutSource *t)
+{
+    unsigned int i = t->heap_index;
+    struct TimeoutSource *last = timer_at(ev_ctx.timers.count - 1);
+
+    array_pop(&ev_ctx.timers);
+    t->heap_index = -1;
+
+    if (last == t)
+        return;
+
+    /* the last one takes its place, then goes up or down */
+    timer_set(i, last);
+    timers_sift_up(i);
+    timers_sift_down(last->heap_index);
+}
+
+/* Make the loop wake up for the earliest timeout, if it changed */
+static void timers_program(void)
+{
+    usec_t expire_usec;
+
+    /* done once all timeouts due were run */
+    if (ev_ctx.dispatching_timers)
+        return;
+
+    expire_usec = ev_ctx.timers.count ? timer_at(0)->expire_usec : 0;
+
+    /* early, to poll until it's due: nothing to arm if the loop is already polling */
+    if (expire_usec && ev_ctx.busy_poll_usec) {
+        expire_usec -= min(expire_usec - 1, ev_ctx.busy_poll_usec);
+        if (expire_usec <= now_usec())
+            expire_usec = 0;
     }
 
-    if (epoll_ctl(ev_ctx.fd, EPOLL_CTL_DEL, fd, NULL) < 0) {
-        log_error("Could not remove fd: %d (%m)", fd);
-        return -errno;
+    if (expire_usec == ev_ctx.timer_armed_usec)
+        return;
+
+    /* with io_uring a spurious expiration is cheaper than cancelling */
+    if (use_uring()) {
+        if (expire_usec && uring_arm_timer(expire_usec) >= 0)
+            ev_ctx.timer_armed_usec = expire_usec;
+    } else {
+        /* a zeroed it_value disarms it */
+        struct itimerspec ts = {
+            .it_value.tv_sec = expire_usec / USEC_PER_SEC,
+            .it_value.tv_nsec = (expire_usec % USEC_PER_SEC) * NSEC_PER_USEC,
+        };
+
+        if (timerfd_settime(ev_ctx.timer_source->fd, TFD_TIMER_ABSTIME, &ts, NULL) < 0)
+            log_error("unable to arm timerfd: %m\n");
+        else
+            ev_ctx.timer_armed_usec = expire_usec;
     }
+}
 
-    free(source);
-    array_remove_at(&ev_ctx.sources, i);
+/* Run the timeouts due, all of them in the same wakeup */
+static void timers_dispatch(void)
+{
+    usec_t now = now_usec();
 
-    log_debug("source %d removed\n", fd);
+    ev_ctx.dispatching_timers = true;
 
-    return 0;
+    /* callbacks may add, remove and rearm timeouts: look at the earliest again every time */
+    while (ev_ctx.timers.count && timer_at(0)->expire_usec <= now) {
+        struct TimeoutSource *t = timer_at(0);
+
+        if (t->period_usec) {
+            /* like a timerfd: missed expirations are reported once */
+            t->expire_usec += t->period_usec;
+            if (t->expire_usec <= now)
+                t->expire_usec += ((now - t->expire_usec) / t->period_usec + 1) * t->period_usec;
+            timers_sift_down(0);
+        } else {
+            timers_remove(t);
+        }
+
+        t->event.cb(-1, t->event.user_data, EPOLLIN);
+    }
+
+    ev_ctx.dispatching_timers = false;
+    timers_program();
 }
 
-struct EventSource *event_loop_add_timeout(unsigned long timeout_msec, void *data, EventCallback cb)
+static void busy_poll_adapt(usec_t late_usec)
 {
-    struct TimeoutSource *source;
-    int r, fd;
+    usec_t window;
 
-    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
-    if (fd < 0) {
-        log_error("unable to create timerfd: %m\n");
-        return NULL;
+    ev_ctx.wakeup_late_usec = (ev_ctx.wakeup_late_usec * 7 + late_usec) / 8;
+
+    window = ev_ctx.wakeup_late_usec * BUSY_POLL_LATENESS_FACTOR;
+    ev_ctx.busy_poll_usec = min(max(window, (usec_t)BUSY_POLL_MIN_USEC), ev_ctx.busy_poll_max_usec);
+}
+
+/* The kernel timer fired, for the earliest timeout or ahead of it with busy polling */
+static void timer_expired(void)
+{
+    usec_t armed_usec = ev_ctx.timer_armed_usec;
+
+    if (ev_ctx.busy_poll_max_usec && armed_usec) {
+        usec_t now = now_usec();
+
+        /* not a stale expiration of an io_uring timeout */
+        if (now >= armed_usec)
+            busy_poll_adapt(now - armed_usec);
     }
 
-    source = calloc(1, sizeof(*source));
-    if (!source) {
-        log_error("Could not add source (%m)\n");
-        goto fail_alloc;
+    ev_ctx.timer_armed_usec = 0;
+    timers_dispatch();
+}
+
+/*
+ * Whether the earliest timeout is close enough for the loop to poll rather than block. When it's
+ * due it's run from here: the kernel timer was armed ahead of it
+ */
+static bool busy_poll(void)
+{
+    usec_t now;
+
+    if (!ev_ctx.busy_poll_max_usec || !ev_ctx.timers.count)
+        return false;
+
+    now = now_usec();
+    if (timer_at(0)->expire_usec <= now) {
+        timers_dispatch();
+        if (!ev_ctx.timers.count)
+            return false;
+        now = now_usec();
     }
 
-    r = _event_loop_add_source(&source->event, fd, data, EPOLLIN, cb);
-    if (r < 0)
-        goto fail_add_source;
+    return timer_at(0)->expire_usec <= now + ev_ctx.busy_poll_usec;
+}
+
+void event_loop_set_busy_poll(usec_t max_usec)
+{
+    ev_ctx.busy_poll_max_usec = max_usec;
+    /* start wide, it narrows down as wakeups turn out to be punctual */
+    ev_ctx.busy_poll_usec = max_usec;
+    ev_ctx.wakeup_late_usec = max_usec / BUSY_POLL_LATENESS_FACTOR;
+
+    ev_ctx.timer_armed_usec = 0;
+    timers_program();
+}
+
+static struct EventSource *add_timeout(usec_t delay_usec, usec_t period_usec, void *data,
+                                       EventCallback cb)
+{
+    struct TimeoutSource *source;
+
+    source = (struct TimeoutSource *)source_alloc(EVENT_TIMEOUT);
+    if (!source)
+        return NULL;
+
+    source->event.user_data = data;
+    source->event.cb = cb;
+    source->period_usec = period_usec;
+    source->expire_usec = now_usec() + delay_usec;
 
-    source->ts.it_interval.tv_sec = timeout_msec / MSEC_PER_SEC;
-    source->ts.it_interval.tv_nsec = (timeout_msec % MSEC_PER_SEC) * NSEC_PER_MSEC;
-    source->ts.it_value.tv_sec = source->ts.it_interval.tv_sec;
-    source->ts.it_value.tv_nsec = source->ts.it_interval.tv_nsec;
-    source->event.type = EVENT_TIMEOUT;
+    if (timers_insert(source) < 0) {
+        log_error("Could not add timeout\n");
+        source_free(&source->event);
+        return NULL;
+    }
 
-    /* start timeout */
-    timerfd_settime(fd, 0, &source->ts, NULL);
+    timers_program();
 
-    log_debug("timeout added: fd=%d\n", fd);
+    log_debug("timeout added: %" PRIu64 " usec\n", period_usec ?: delay_usec);
 
     return &source->event;
+}
+
+struct EventSource *event_loop_add_timeout_usec(usec_t timeout_usec, void *data, EventCallback cb)
+{
+    return add_timeout(timeout_usec, timeout_usec, data, cb);
+}
+
+struct EventSource *event_loop_add_timeout(unsigned long timeout_msec, void *data, EventCallback cb)
+{
+    return event_loop_add_timeout_usec(timeout_msec * USEC_PER_MSEC, data, cb);
+}
 
-fail_add_source:
-    free(source);
-fail_alloc:
-    close(fd);
-    return NULL;
+struct EventSource *event_loop_add_oneshot_usec(usec_t delay_usec, void *data, EventCallback cb)
+{
+    return add_timeout(delay_usec, 0, data, cb);
 }
 
 int event_loop_remove_timeout(struct EventSource *source)
 {
-    int r, fd;
+    struct TimeoutSource *timeout = (struct TimeoutSource *)source;
 
     assert(source->type == EVENT_TIMEOUT);
 
-    fd = source->fd;
-    r = event_loop_remove_source(fd);
-    close(fd);
+    if (timeout->heap_index >= 0) {
+        timers_remove(timeout);
+        timers_program();
+    }
 
-    return r;
+    source_free(source);
+
+    return 0;
+}
+
+/*
+ * Make the next expiration of @source happen @delay_usec from now, keeping its period: following
+ * expirations happen every period after this one. One-shot timeouts are armed again
+ */
+int event_loop_rearm_timeout(struct EventSource *source, usec_t delay_usec)
+{
+    struct TimeoutSource *timeout = (struct TimeoutSource *)source;
+    int r;
+
+    assert(source->type == EVENT_TIMEOUT);
+
+    /* not due again in the same dispatch */
+    if (delay_usec == 0)
+        delay_usec = 1;
+
+    timeout->expire_usec = now_usec() + delay_usec;
+
+    if (timeout->heap_index < 0) {
+        r = timers_insert(timeout);
+        if (r < 0)
+            return r;
+    } else {
+        timers_sift_up(timeout->heap_index);
+        timers_sift_down(timeout->heap_index);
+    }
+
+    timers_program();
+
+    return 0;
+}
+
+struct EventSource *event_loop_add_send_source(int fd, void *data, EventSendCallback cb)
+{
+    struct SendSource *source;
+
+    if (!use_uring())
+        return NULL;
+
+    source = (struct SendSource *)source_alloc(EVENT_SEND);
+    if (!source)
+        return NULL;
+
+    /* the fd may be shared, and with a source of another type */
+    source->event.user_data = data;
+    source->event.fd = fd;
+    source->cb = cb;
+
+    return &source->event;
+}
+
+int event_loop_submit_send(struct EventSource *source, const struct msghdr *msg)
+{
+    struct io_uring_sqe *sqe;
+
+    assert(source->type == EVENT_SEND);
+
+    if (source->inflight)
+        return -EBUSY;
+
+    sqe = uring_prep(source, URING_OP_SEND, IORING_OP_SENDMSG);
+    if (!sqe)
+        return -EBUSY;
+
+    sqe->fd = source->fd;
+    sqe->addr = (uintptr_t)msg;
+    sqe->len = 1;
+
+    return 0;
+}
+
+void event_loop_remove_send_source(struct EventSource *source)
+{
+    assert(source->type == EVENT_SEND);
+
+    release_source(source);
 }
 
 void event_loop_stop(void)
@@ -215,26 +926,176 @@ void event_loop_stop(void)
     ev_ctx.should_exit = true;
 }
 
-void event_loop_run(void)
+/* Drain @rs, as reads are only submitted for io_uring */
+static void epoll_read(struct ReadSource *rs)
+{
+    uint64_t id = rs->event.id;
+    ssize_t r;
+
+    for (;;) {
+        r = read(rs->event.fd, rs->buf, rs->len);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                rs->cb(rs->event.user_data, rs->buf, -errno);
+            return;
+        }
+
+        rs->cb(rs->event.user_data, rs->buf, r);
+
+        /* short read: nothing else pending, save a syscall */
+        if ((size_t)r < rs->len || r == 0 || !source_get(id))
+            return;
+    }
+}
+
+static void epoll_run(void)
 {
     const int max_events = 16;
     struct epoll_event events[max_events];
 
-    if (ev_ctx.fd < 0)
-        return;
-
     while (!ev_ctx.should_exit) {
+        int timeout = busy_poll() ? 0 : -1;
         int r, i;
 
-        r = epoll_wait(ev_ctx.fd, events, max_events, -1);
+        /* stopped by a timeout run while busy polling */
+        if (ev_ctx.should_exit)
+            break;
+
+        r = epoll_wait(ev_ctx.fd, events, max_events, timeout);
         if (r < 0 && errno == EINTR) {
             log_debug("Interrupted epoll (%m)\n");
             continue;
         }
 
         for (i = 0; i < r; i++) {
-            struct EventSource *source = events[i].data.ptr;
-            source->cb(source->fd, source->user_data, events[i].events);
+            /* removed by a callback earlier in the batch */
+            struct EventSource *source = source_get(events[i].data.u64);
+            uint64_t count = 0;
+
+            if (!source)
+                continue;
+
+            switch (source->type) {
+            case EVENT_TIMEOUT:
+                if (read(source->fd, &count, sizeof(count)) < 1 || count == 0)
+                    break;
+                timer_expired();
+                break;
+            case EVENT_READ:
+                epoll_read((struct ReadSource *)source);
+                break;
+            default:
+                source->cb(source->fd, source->user_data, events[i].events);
+                break;
+            }
+        }
+    }
+}
+
+static void uring_read_complete(struct ReadSource *rs, int res)
+{
+    uint64_t id = rs->event.id;
+
+    /* readiness was lost between poll and read, or poll failed and broke the link */
+    if (res == -EAGAIN || res == -EINTR) {
+        uring_arm_read(rs);
+        return;
+    }
+
+    rs->cb(rs->event.user_data, rs->buf, res);
+
+    if (res > 0 && source_get(id))
+        uring_arm_read(rs);
+}
+
+static void uring_dispatch(const struct io_uring_cqe *cqe)
+{
+    enum UringOp op = cqe->user_data & _URING_OP_MASK;
+    struct EventSource *source;
+    uint64_t id;
+
+    if (op == URING_OP_IGNORE)
+        return;
+
+    /* cancelled, or completed after the source was removed */
+    id = cqe->user_data & ~(uint64_t)_URING_OP_MASK;
+    source = source_get(id);
+    if (!source)
+        return;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        source->inflight--;
+
+    switch (op) {
+    case URING_OP_POLL:
+        if (cqe->res < 0) {
+            log_error("poll on fd %d failed: %s\n", source->fd, strerror(-cqe->res));
+            return;
+        }
+
+        source->cb(source->fd, source->user_data, cqe->res);
+
+        /* multishot poll may end, e.g. on overflow */
+        if (!(cqe->flags & IORING_CQE_F_MORE) && source_get(id))
+            uring_arm_poll(source);
+        break;
+    case URING_OP_TIMEOUT:
+        /* expired, or an update raced with the expiration: anything due is run anyway */
+        timer_expired();
+        break;
+    case URING_OP_READ_POLL:
+        /* the read linked to it tells what happened */
+        break;
+    case URING_OP_READ:
+        uring_read_complete((struct ReadSource *)source, cqe->res);
+        break;
+    case URING_OP_SEND:
+        ((struct SendSource *)source)->cb(source->user_data, cqe->res);
+        break;
+    default:
+        break;
+    }
+}
+
+static void uring_run(void)
+{
+    while (!ev_ctx.should_exit) {
+        unsigned int wait_nr = busy_poll() ? 0 : 1;
+        struct io_uring_cqe *cqe;
+        int r;
+
+        if (ev_ctx.should_exit)
+            break;
+
+        /*
+         * What callbacks queued is submitted with the wait, a single syscall. Busy polling only
+         * submits, completions are checked in the ring without entering the kernel
+         */
+        r = uring_submit_and_wait(&ev_ctx.uring, wait_nr);
+        if (r < 0 && r != -EINTR && r != -EBUSY && r != -EAGAIN) {
+            log_error("io_uring: %s\n", strerror(-r));
+            return;
+        }
+
+        while ((cqe = uring_peek_cqe(&ev_ctx.uring))) {
+            struct io_uring_cqe copy = *cqe;
+
+            /* seen first: callbacks may queue more than the completion queue has room for */
+            uring_cqe_seen(&ev_ctx.uring);
+            uring_dispatch(&copy);
         }
     }
 }
+
+void event_loop_run(void)
+{
+    if (ev_ctx.fd < 0)
+        return;
+
+    if (use_uring())
+        uring_run();
+    else
+        epoll_run();
+}
@@ -4,18 +4,78 @@
 #pragma once
 
 #include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
 
-int event_loop_init(void);
+#include "util.h"
+
+enum EventLoopBackend {
+    EVENT_LOOP_EPOLL,
+    /* completions of submitted operations, one syscall per loop iteration */
+    EVENT_LOOP_IO_URING,
+    _EVENT_LOOP_BACKEND_UNKNOWN = -1,
+};
+
+enum EventLoopBackend event_loop_backend_from_str(const char *s);
+
+/* io_uring falls back to epoll when the kernel doesn't support it */
+int event_loop_init(enum EventLoopBackend backend);
 void event_loop_shutdown(void);
 
+/*
+ * Timeout callbacks are called once per expiration, even if more than one period elapsed, with
+ * @fd -1. Timeouts have no fd of their own: they are all kept sorted by expiration and a single
+ * timer wakes up the loop for the earliest, so adding, removing and rearming them is cheap
+ */
 typedef void (*EventCallback)(int fd, void *data, int ev_mask);
+
+/*
+ * Handle to a registered fd or timeout, NULL when adding fails. Adding and removing are constant
+ * time and any source, including the one being dispatched, can be removed from a callback: events
+ * already pending for it are dropped
+ */
 struct EventSource;
 
-int event_loop_add_source(int fd, void *data, int ev_mask, EventCallback cb);
-int event_loop_remove_source(int fd);
+struct EventSource *event_loop_add_source(int fd, void *data, int ev_mask, EventCallback cb);
+/* For sources from event_loop_add_source() and event_loop_add_read_source() */
+int event_loop_remove_source(struct EventSource *source);
 struct EventSource *event_loop_add_timeout(unsigned long timeout_msec, void *data,
                                            EventCallback cb);
+/* Periodic timeout with microsecond resolution, for output that needs precise pacing */
+struct EventSource *event_loop_add_timeout_usec(usec_t timeout_usec, void *data,
+                                                EventCallback cb);
+/* Expires once, then stays disarmed until rearmed: it must still be removed */
+struct EventSource *event_loop_add_oneshot_usec(usec_t delay_usec, void *data, EventCallback cb);
 int event_loop_remove_timeout(struct EventSource *source);
+int event_loop_rearm_timeout(struct EventSource *source, usec_t delay_usec);
+
+/*
+ * Called with what was read into the buffer, 0 on end of file or a negative errno. With epoll the
+ * fd is drained on each wakeup, with io_uring each completed read is resubmitted
+ */
+typedef void (*EventReadCallback)(void *data, void *buf, ssize_t len);
+
+/* Read from the non-blocking @fd into @buf whenever it's readable */
+struct EventSource *event_loop_add_read_source(int fd, void *buf, size_t len, void *data,
+                                               EventReadCallback cb);
+
+/* Called with the result of a submitted send: bytes sent or a negative errno */
+typedef void (*EventSendCallback)(void *data, int res);
+
+/*
+ * Sends through @fd submitted with the next wait of the loop rather than sent right away. Only
+ * with io_uring: NULL otherwise and the caller sends by itself
+ */
+struct EventSource *event_loop_add_send_source(int fd, void *data, EventSendCallback cb);
+/* @msg and what it points to must be valid until completion. -EBUSY if one is still pending */
+int event_loop_submit_send(struct EventSource *source, const struct msghdr *msg);
+void event_loop_remove_send_source(struct EventSource *source);
+
+/*
+ * Poll without blocking for up to @max_usec before each timeout is due, rather than relying on
+ * the wakeup being on time. The window adapts to the wakeup latency actually seen. 0 disables it
+ */
+void event_loop_set_busy_poll(usec_t max_usec);
 
 void event_loop_stop(void);
 void event_loop_run(void);
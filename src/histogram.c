@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+/* Copyright (c) 2020 Lucas De Marchi <lucas.de.marchi@gmail.com> */
+
+#include "histogram.h"
+
+#include <inttypes.h>
+
+#include "log.h"
+
+void histogram_add(struct Histogram *h, usec_t val)
+{
+    unsigned int i = val ? 63 - __builtin_clzll(val) : 0;
+
+    h->buckets[min(i, HISTOGRAM_BUCKETS - 1U)]++;
+    h->count++;
+    h->sum += val;
+    h->max = max(h->max, val);
+}
+
+/* Upper bound of the bucket containing the @percent percentile */
+usec_t histogram_percentile(const struct Histogram *h, unsigned int percent)
+{
+    unsigned long target = DIV_ROUND_UP(h->count * percent, 100), acc = 0;
+    unsigned int i;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS - 1; i++) {
+        acc += h->buckets[i];
+        if (acc >= target)
+            return min((usec_t)2 << i, h->max);
+    }
+
+    return h->max;
+}
+
+void histogram_log(const struct Histogram *h, const char *name)
+{
+    if (!h->count)
+        return;
+
+    log_info("%s: n=%lu avg=%" PRIu64 " p50<=%" PRIu64 " p90<=%" PRIu64 " p99<=%" PRIu64
+             " max=%" PRIu64 " usec\n",
+             name, h->count, h->sum / h->count, histogram_percentile(h, 50),
+             histogram_percentile(h, 90), histogram_percentile(h, 99), h->max);
+}
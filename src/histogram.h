@@ -0,0 +1,20 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+/* Copyright (c) 2020 Lucas De Marchi <lucas.de.marchi@gmail.com> */
+
+#pragma once
+
+#include "util.h"
+
+/* bucket i holds values in [2^i, 2^(i + 1)) usec, with 0 in the first one */
+#define HISTOGRAM_BUCKETS 24
+
+struct Histogram {
+    unsigned long count;
+    usec_t sum;
+    usec_t max;
+    unsigned long buckets[HISTOGRAM_BUCKETS];
+};
+
+void histogram_add(struct Histogram *h, usec_t val);
+usec_t histogram_percentile(const struct Histogram *h, unsigned int percent);
+void histogram_log(const struct Histogram *h, const char *name);
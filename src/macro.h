@@ -5,5 +5,6 @@
 
 #define _printf_format_(a, b) __attribute__((format(printf, a, b)))
 #define _pure_ __attribute__((pure))
+#define _noinline_ __attribute__((noinline))
 #define _cleanup_(x) __attribute__((cleanup(x)))
 #define _packed __attribute__((packed))
@@ -2,21 +2,22 @@
 /* Copyright (c) 2019 Lucas De Marchi <lucas.de.marchi@gmail.com> */
 
 #include <errno.h>
-#include <fcntl.h>
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <c-ini.h>
 #include <c-stdaux.h>
 
+#include "conffile.h"
 #include "controller.h"
 #include "demarc_signal.h"
 #include "event_loop.h"
 #include "log.h"
+#include "output.h"
+#include "realtime.h"
 #include "remote.h"
 #include "util.h"
 
@@ -33,19 +34,12 @@ static const char *device;
 static const char *remote_dest;
 static enum RemoteOutputFormat remote_output_format = REMOTE_OUTPUT_AP_UDP_SIMPLE;
 static bool verbose;
+static enum EventLoopBackend event_loop_backend = _EVENT_LOOP_BACKEND_UNKNOWN;
+static bool realtime;
+static struct ControllerOptions controller_opts;
 
 static CIniDomain *config_domain;
 
-static enum RemoteOutputFormat output_format_from_str(const char *s)
-{
-    if (strcasecmp(s, "ardupilot-udp-simple") == 0)
-        return REMOTE_OUTPUT_AP_UDP_SIMPLE;
-    if (strcasecmp(s, "ardupilot-sitl") == 0)
-        return REMOTE_OUTPUT_AP_SITL;
-
-    return _REMOTE_OUTPUT_UNKNOWN;
-}
-
 static void help(FILE *fp)
 {
     fprintf(fp,
@@ -54,12 +48,21 @@ static void help(FILE *fp)
             " --version             Show version\n"
             " -h --help             Print this message\n"
             " -v --verbose          Print debug messages\n"
-            " -o --output-format    Output format. One of: ardupilot-udp-simple, ardupilot-sitl\n"
-            "                       (default: ardupilot-udp-simple)\n"
+            " -o --output-format    Output format. One of: ardupilot-udp-simple, ardupilot-sitl,\n"
+            "                       mavlink (default: ardupilot-udp-simple)\n"
+            " --calibrate           Capture axis calibration until stopped. Nothing is sent\n"
+            " --record FILE         Record input events to FILE\n"
+            " --replay FILE         Replay input events from FILE instead of reading devices\n"
+            " --replay-fast         Replay without keeping the recorded timing\n"
+            " --event-loop BACKEND  Event loop backend. One of: epoll, io_uring (default: epoll)\n"
+            " --realtime            SCHED_FIFO, locked memory and the rest of the [Realtime]\n"
+            "                       settings in the configuration\n"
             "\n"
             "positional arguments:\n"
             " [input_device]        Controller's input device\n"
-            " [dest]                Optional destination - default 127.0.0.1:777\n",
+            " [dest]                Optional destinations, separated by spaces: network\n"
+            "                       addresses, serial ports, csv:FILE or shm:NAME - default\n"
+            "                       127.0.0.1:777\n",
             program_invocation_short_name);
 }
 
@@ -67,12 +70,24 @@ static enum ArgsResult parse_args(int argc, char *argv[])
 {
     enum {
         ARG_VERSION = 0x100,
+        ARG_CALIBRATE,
+        ARG_RECORD,
+        ARG_REPLAY,
+        ARG_REPLAY_FAST,
+        ARG_EVENT_LOOP,
+        ARG_REALTIME,
     };
     static const struct option long_options[] = {
         {"help", no_argument, NULL, 'h'},
         {"version", no_argument, NULL, ARG_VERSION},
         {"verbose", no_argument, NULL, 'v'},
         {"output-format", required_argument, NULL, 'o'},
+        {"calibrate", no_argument, NULL, ARG_CALIBRATE},
+        {"record", required_argument, NULL, ARG_RECORD},
+        {"replay", required_argument, NULL, ARG_REPLAY},
+        {"replay-fast", no_argument, NULL, ARG_REPLAY_FAST},
+        {"event-loop", required_argument, NULL, ARG_EVENT_LOOP},
+        {"realtime", no_argument, NULL, ARG_REALTIME},
         {},
     };
     static const char *short_options = "vho:";
@@ -90,12 +105,34 @@ static enum ArgsResult parse_args(int argc, char *argv[])
             puts(PACKAGE " version " PACKAGE_VERSION);
             return ARGS_RESULT_EXIT;
         case 'o':
-            remote_output_format = output_format_from_str(optarg);
+            remote_output_format = remote_output_format_from_str(optarg);
             if (remote_output_format == _REMOTE_OUTPUT_UNKNOWN) {
                 fprintf(stderr, "unknown format '%s'\n", optarg);
                 return ARGS_RESULT_FAILURE;
             }
             break;
+        case ARG_CALIBRATE:
+            controller_opts.flags |= CONTROLLER_FLAG_CALIBRATE;
+            break;
+        case ARG_RECORD:
+            controller_opts.record_file = optarg;
+            break;
+        case ARG_REPLAY:
+            controller_opts.replay_file = optarg;
+            break;
+        case ARG_REPLAY_FAST:
+            controller_opts.flags |= CONTROLLER_FLAG_REPLAY_FAST;
+            break;
+        case ARG_EVENT_LOOP:
+            event_loop_backend = event_loop_backend_from_str(optarg);
+            if (event_loop_backend == _EVENT_LOOP_BACKEND_UNKNOWN) {
+                fprintf(stderr, "unknown event loop '%s'\n", optarg);
+                return ARGS_RESULT_FAILURE;
+            }
+            break;
+        case ARG_REALTIME:
+            realtime = true;
+            break;
         case '?':
             return ARGS_RESULT_FAILURE;
         default:
@@ -104,6 +141,11 @@ static enum ArgsResult parse_args(int argc, char *argv[])
         }
     }
 
+    if ((controller_opts.flags & CONTROLLER_FLAG_REPLAY_FAST) && !controller_opts.replay_file) {
+        fprintf(stderr, "--replay-fast requires --replay\n");
+        return ARGS_RESULT_FAILURE;
+    }
+
     /* positional arguments: input device, destination */
     positional = argc - optind;
 
@@ -135,60 +177,24 @@ static void config_file_parse_general_group(CIniDomain *domain)
             device = value;
         else if (!remote_dest && strncaseeq(key, "Destination", keylen))
             remote_dest = value;
+        else if (event_loop_backend == _EVENT_LOOP_BACKEND_UNKNOWN
+                 && strncaseeq(key, "EventLoop", keylen)) {
+            event_loop_backend = event_loop_backend_from_str(value);
+            if (event_loop_backend == _EVENT_LOOP_BACKEND_UNKNOWN)
+                log_warning("conf: unknown EventLoop '%s', using epoll\n", value);
+        }
     }
 }
 
 static int config_file_init(CIniDomain **config_domainp)
 {
-    _c_cleanup_(c_closep) int fd = -1;
-    _c_cleanup_(c_ini_reader_freep) CIniReader *reader = NULL;
-    _c_cleanup_(c_ini_domain_unrefp) CIniDomain *domain = NULL;
-    const char *path = PKGSYSCONFDIR "/dema-rc.conf";
     int r;
 
-    fd = open(path, O_RDONLY | O_CLOEXEC);
-    if (fd < 0) {
-        if (errno != ENOENT) {
-            log_error("Could not open %s (%m)\n", path);
-            return -errno;
-        }
-        return 0;
-    }
-
-    r = c_ini_reader_new(&reader);
-    if (r < 0)
-        return r;
-
-    /* clang-format off */
-    c_ini_reader_set_mode(reader,
-                          C_INI_MODE_EXTENDED_WHITESPACE |
-                          C_INI_MODE_MERGE_GROUPS |
-                          C_INI_MODE_OVERRIDE_ENTRIES);
-    /* clang-format on */
-
-    for (;;) {
-        uint8_t buf[1024];
-        ssize_t len;
-
-        len = read(fd, buf, sizeof(buf));
-        if (len < 0)
-            return -errno;
-        else if (len == 0)
-            break;
-
-        r = c_ini_reader_feed(reader, buf, len);
-        if (r < 0)
-            return r;
-    }
-
-    r = c_ini_reader_seal(reader, &domain);
-    if (r < 0)
+    r = conffile_load(PKGSYSCONFDIR "/dema-rc.conf", config_domainp);
+    if (r < 0 || !*config_domainp)
         return r;
 
-    /* keep a ref around: this ensures all entries with their values are still valid */
-    *config_domainp = c_ini_domain_ref(domain);
-
-    config_file_parse_general_group(domain);
+    config_file_parse_general_group(*config_domainp);
 
     return 0;
 }
@@ -201,6 +207,7 @@ static void config_file_shutdown(void)
 
 int main(int argc, char *argv[])
 {
+    struct OutputDefaults output_defaults;
     int r;
 
     log_init();
@@ -218,7 +225,10 @@ int main(int argc, char *argv[])
     if (r < 0)
         goto fail;
 
-    r = event_loop_init();
+    if (event_loop_backend == _EVENT_LOOP_BACKEND_UNKNOWN)
+        event_loop_backend = EVENT_LOOP_EPOLL;
+
+    r = event_loop_init(event_loop_backend);
     if (r < 0)
         goto fail;
 
@@ -226,13 +236,21 @@ int main(int argc, char *argv[])
     if (r < 0)
         goto fail_signal;
 
-    r = controller_init(device, config_domain);
+    r = controller_init(device, config_domain, &controller_opts);
     if (r < 0)
         goto fail_controller;
 
-    r = remote_init(remote_dest, remote_output_format);
+    output_defaults.format = remote_output_format;
+    output_defaults.update_interval_usec = controller_get_update_interval();
+
+    r = output_init(remote_dest, &output_defaults);
+    if (r < 0)
+        goto fail_output;
+
+    /* once everything is allocated, so it's all locked in memory */
+    r = realtime_init(config_domain, realtime);
     if (r < 0)
-        goto fail_remote;
+        goto fail_output;
 
     /*
      * We don't make any more use of configuration after initializing everything, so just release
@@ -242,7 +260,7 @@ int main(int argc, char *argv[])
 
     event_loop_run();
 
-    remote_shutdown();
+    output_shutdown();
     controller_shutdown();
     signal_shutdown();
     event_loop_shutdown();
@@ -250,8 +268,8 @@ int main(int argc, char *argv[])
 
     return 0;
 
-fail_remote:
-    remote_shutdown();
+fail_output:
+    output_shutdown();
 fail_controller:
     signal_shutdown();
 fail_signal:
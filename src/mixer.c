@@ -0,0 +1,769 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+/* Copyright (c) 2020 Lucas De Marchi <lucas.de.marchi@gmail.com> */
+
+/*
+ * Channel mixer: each output channel is an expression over the (shaped) input channels. Values
+ * are deflections from center, in µs of PWM: inputs are in [-500, 500] and the result is clamped
+ * to the same range before being added back to the center.
+ *
+ * [Mixer]
+ * RC1 = 0.5 * RC1 + 0.5 * RC2
+ * RC2 = 0.5 * RC1 - 0.5 * RC2
+ * RC5 = -335 if RC9 > 0 and RC10 > 0 else 185 if RC9 > 0 else 315
+ * RC6 = switch3(RC11, RC12)
+ * RC7 = clamp(RC3 + 100, -200, 200)
+ *
+ * Expressions are compiled once, when the configuration is loaded, into instructions for a small
+ * stack machine. There are only forward jumps, so the cost per packet is bounded by the length of
+ * the program.
+ */
+
+#include "mixer.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <c-ini.h>
+
+#include "controller.h"
+#include "log.h"
+#include "util.h"
+
+#define PWM_CENTER 1500
+#define PWM_HALF_RANGE 500
+
+#define MAX_INSNS 512
+#define MAX_NODES 64
+#define MAX_STACK 16
+#define MAX_SWITCHES 8
+#define MAX_NESTING 32
+
+/* weights have 10 fractional bits */
+#define WEIGHT_SHIFT 10
+
+enum MixerOp {
+    OP_CONST,
+    OP_INPUT,
+    OP_SWITCH3,
+    OP_MUL,
+    OP_NEG,
+    OP_ADD,
+    OP_SUB,
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE,
+    OP_EQ,
+    OP_NE,
+    OP_AND,
+    OP_OR,
+    OP_NOT,
+    OP_MAX,
+    OP_MIN,
+    OP_JZ,
+    OP_JMP,
+    OP_STORE,
+};
+
+struct MixerInsn {
+    uint8_t op;
+    /* channel or switch for OP_INPUT, OP_SWITCH3 and OP_STORE */
+    uint8_t arg;
+    /* jump target for OP_JZ and OP_JMP */
+    uint16_t target;
+    int32_t k;
+};
+
+/*
+ * A 3-position switch from a pair of buttons: each press of one moves it down, the other up.
+ * Buttons toggle their channel, so a press is the channel crossing the center
+ */
+struct Switch3 {
+    uint8_t down, up;
+    bool last_down, last_up;
+    int pos;
+};
+
+static struct {
+    struct MixerInsn insns[MAX_INSNS];
+    unsigned int n_insns;
+    unsigned int n_outputs;
+
+    struct Switch3 switches[MAX_SWITCHES];
+    unsigned int n_switches;
+
+    bool started;
+} mixer_ctx;
+
+/* Expressions are parsed into a tree so the condition of "a if cond else b" can go first */
+enum NodeType {
+    NODE_CONST,
+    NODE_INPUT,
+    NODE_SWITCH3,
+    NODE_MUL,
+    NODE_UNARY,
+    NODE_BINARY,
+    NODE_IF,
+    NODE_CLAMP,
+};
+
+struct Node {
+    enum NodeType type;
+    enum MixerOp op;
+    double v;
+    int32_t lo, hi;
+    uint8_t ch;
+    /* children */
+    int a, b, c;
+};
+
+struct Parser {
+    const char *label;
+    const char *p;
+    unsigned int n_inputs;
+    struct Node nodes[MAX_NODES];
+    unsigned int n_nodes;
+    unsigned int nesting;
+    unsigned int depth, max_depth;
+    bool failed;
+};
+
+static void parse_error(struct Parser *ps, const char *msg)
+{
+    if (!ps->failed)
+        log_error("mixer: %s: %s at '%s'\n", ps->label, msg, ps->p);
+
+    ps->failed = true;
+}
+
+static void skip_space(struct Parser *ps)
+{
+    while (isspace(*ps->p))
+        ps->p++;
+}
+
+static bool accept(struct Parser *ps, const char *tok)
+{
+    size_t len = strlen(tok);
+
+    skip_space(ps);
+
+    if (!strneq(ps->p, tok, len))
+        return false;
+
+    /* keywords must not be the prefix of a longer word */
+    if (isalpha(tok[0]) && isalnum(ps->p[len]))
+        return false;
+
+    ps->p += len;
+
+    return true;
+}
+
+static void expect(struct Parser *ps, const char *tok)
+{
+    if (!accept(ps, tok))
+        parse_error(ps, tok[0] == ')' ? "expected ')'" : "expected ','");
+}
+
+static int node_new(struct Parser *ps, enum NodeType type)
+{
+    struct Node *n;
+
+    if (ps->n_nodes >= MAX_NODES) {
+        parse_error(ps, "expression too long");
+        return 0;
+    }
+
+    n = &ps->nodes[ps->n_nodes];
+    memset(n, 0, sizeof(*n));
+    n->type = type;
+
+    return ps->n_nodes++;
+}
+
+static int node_op(struct Parser *ps, enum NodeType type, enum MixerOp op, int a, int b)
+{
+    int n = node_new(ps, type);
+
+    ps->nodes[n].op = op;
+    ps->nodes[n].a = a;
+    ps->nodes[n].b = b;
+
+    return n;
+}
+
+static int parse_channel(struct Parser *ps)
+{
+    unsigned long ch;
+    char *end;
+
+    skip_space(ps);
+
+    if (!strncaseeq(ps->p, "RC", 2) || !isdigit(ps->p[2])) {
+        parse_error(ps, "expected channel");
+        return 0;
+    }
+
+    ch = strtoul(ps->p + 2, &end, 10);
+    if (ch < 1 || ch > ps->n_inputs) {
+        parse_error(ps, "channel not mapped");
+        return 0;
+    }
+
+    ps->p = end;
+
+    return ch - 1;
+}
+
+static int32_t parse_int(struct Parser *ps)
+{
+    bool neg = accept(ps, "-");
+    long l;
+    char *end;
+
+    skip_space(ps);
+    errno = 0;
+    l = strtol(ps->p, &end, 10);
+    if (end == ps->p) {
+        parse_error(ps, "expected integer");
+        return 0;
+    }
+    /* within int32 before negating, "-" followed by a negative number is valid */
+    if (errno == ERANGE || l > INT32_MAX || l < -INT32_MAX) {
+        parse_error(ps, "integer out of range");
+        return 0;
+    }
+    ps->p = end;
+
+    return neg ? -l : l;
+}
+
+static int parse_expr(struct Parser *ps);
+
+static int parse_primary(struct Parser *ps)
+{
+    int n;
+
+    skip_space(ps);
+
+    if (isdigit(*ps->p) || *ps->p == '.') {
+        char *end;
+
+        n = node_new(ps, NODE_CONST);
+        errno = 0;
+        ps->nodes[n].v = strtod(ps->p, &end);
+        if (errno == ERANGE || fabs(ps->nodes[n].v) > INT32_MAX)
+            parse_error(ps, "number out of range");
+        ps->p = end;
+    } else if (accept(ps, "(")) {
+        n = parse_expr(ps);
+        expect(ps, ")");
+    } else if (accept(ps, "clamp")) {
+        expect(ps, "(");
+        n = node_op(ps, NODE_CLAMP, 0, parse_expr(ps), 0);
+        expect(ps, ",");
+        ps->nodes[n].lo = parse_int(ps);
+        expect(ps, ",");
+        ps->nodes[n].hi = parse_int(ps);
+        expect(ps, ")");
+
+        if (ps->nodes[n].lo > ps->nodes[n].hi)
+            parse_error(ps, "empty clamp range");
+    } else if (accept(ps, "switch3")) {
+        expect(ps, "(");
+        n = node_new(ps, NODE_SWITCH3);
+        ps->nodes[n].a = parse_channel(ps);
+        expect(ps, ",");
+        ps->nodes[n].b = parse_channel(ps);
+        expect(ps, ")");
+    } else {
+        n = node_new(ps, NODE_INPUT);
+        ps->nodes[n].ch = parse_channel(ps);
+    }
+
+    return n;
+}
+
+static int parse_unary(struct Parser *ps)
+{
+    int a;
+
+    if (!accept(ps, "-"))
+        return parse_primary(ps);
+
+    if (++ps->nesting > MAX_NESTING) {
+        parse_error(ps, "too many nested expressions");
+        return 0;
+    }
+
+    a = parse_unary(ps);
+    ps->nesting--;
+
+    /* keep negative numbers as constants so they can be weights */
+    if (ps->nodes[a].type == NODE_CONST) {
+        ps->nodes[a].v = -ps->nodes[a].v;
+        return a;
+    }
+
+    return node_op(ps, NODE_UNARY, OP_NEG, a, 0);
+}
+
+/* Only multiplication by a constant weight: anything else has no meaning for deflections */
+static int parse_product(struct Parser *ps)
+{
+    int a = parse_unary(ps);
+
+    while (!ps->failed && accept(ps, "*")) {
+        int b = parse_unary(ps), n;
+        struct Node *na = &ps->nodes[a], *nb = &ps->nodes[b];
+
+        if (na->type == NODE_CONST && nb->type == NODE_CONST) {
+            na->v *= nb->v;
+            if (fabs(na->v) > INT32_MAX)
+                parse_error(ps, "number out of range");
+            continue;
+        }
+
+        if (na->type != NODE_CONST && nb->type != NODE_CONST) {
+            parse_error(ps, "one of the factors must be a number");
+            break;
+        }
+
+        n = node_new(ps, NODE_MUL);
+        ps->nodes[n].v = na->type == NODE_CONST ? na->v : nb->v;
+        ps->nodes[n].a = na->type == NODE_CONST ? b : a;
+        a = n;
+    }
+
+    return a;
+}
+
+static int parse_sum(struct Parser *ps)
+{
+    int a = parse_product(ps);
+
+    while (!ps->failed) {
+        if (accept(ps, "+"))
+            a = node_op(ps, NODE_BINARY, OP_ADD, a, parse_product(ps));
+        else if (accept(ps, "-"))
+            a = node_op(ps, NODE_BINARY, OP_SUB, a, parse_product(ps));
+        else
+            break;
+    }
+
+    return a;
+}
+
+static int parse_comparison(struct Parser *ps)
+{
+    /* longest first */
+    static const struct {
+        const char *tok;
+        enum MixerOp op;
+    } ops[] = {
+        { "<=", OP_LE }, { ">=", OP_GE }, { "==", OP_EQ },
+        { "!=", OP_NE }, { "<", OP_LT },  { ">", OP_GT },
+    };
+    int a = parse_sum(ps);
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(ops); i++)
+        if (accept(ps, ops[i].tok))
+            return node_op(ps, NODE_BINARY, ops[i].op, a, parse_sum(ps));
+
+    return a;
+}
+
+static int parse_not(struct Parser *ps)
+{
+    int a;
+
+    if (!accept(ps, "not"))
+        return parse_comparison(ps);
+
+    if (++ps->nesting > MAX_NESTING) {
+        parse_error(ps, "too many nested expressions");
+        return 0;
+    }
+
+    a = parse_not(ps);
+    ps->nesting--;
+
+    return node_op(ps, NODE_UNARY, OP_NOT, a, 0);
+}
+
+static int parse_and(struct Parser *ps)
+{
+    int a = parse_not(ps);
+
+    while (!ps->failed && accept(ps, "and"))
+        a = node_op(ps, NODE_BINARY, OP_AND, a, parse_not(ps));
+
+    return a;
+}
+
+static int parse_or(struct Parser *ps)
+{
+    int a = parse_and(ps);
+
+    while (!ps->failed && accept(ps, "or"))
+        a = node_op(ps, NODE_BINARY, OP_OR, a, parse_and(ps));
+
+    return a;
+}
+
+/* expr := or ["if" or "else" expr] */
+static int parse_expr(struct Parser *ps)
+{
+    int a, n;
+
+    if (++ps->nesting > MAX_NESTING) {
+        parse_error(ps, "too many nested expressions");
+        return 0;
+    }
+
+    a = parse_or(ps);
+    if (ps->failed || !accept(ps, "if")) {
+        ps->nesting--;
+        return a;
+    }
+
+    n = node_new(ps, NODE_IF);
+    ps->nodes[n].a = a;
+    ps->nodes[n].c = parse_or(ps);
+
+    if (!accept(ps, "else")) {
+        parse_error(ps, "expected 'else'");
+        ps->nesting--;
+        return n;
+    }
+
+    ps->nodes[n].b = parse_expr(ps);
+    ps->nesting--;
+
+    return n;
+}
+
+static struct MixerInsn *emit(struct Parser *ps, enum MixerOp op, int stack_change)
+{
+    struct MixerInsn *insn;
+
+    if (mixer_ctx.n_insns >= MAX_INSNS) {
+        parse_error(ps, "program too long");
+        return NULL;
+    }
+
+    ps->depth += stack_change;
+    ps->max_depth = max(ps->max_depth, ps->depth);
+
+    insn = &mixer_ctx.insns[mixer_ctx.n_insns++];
+    memset(insn, 0, sizeof(*insn));
+    insn->op = op;
+
+    return insn;
+}
+
+static int add_switch3(struct Parser *ps, uint8_t down, uint8_t up)
+{
+    unsigned int i;
+
+    /* same pair used by more than one output: share the state */
+    for (i = 0; i < mixer_ctx.n_switches; i++)
+        if (mixer_ctx.switches[i].down == down && mixer_ctx.switches[i].up == up)
+            return i;
+
+    if (mixer_ctx.n_switches >= MAX_SWITCHES) {
+        parse_error(ps, "too many switches");
+        return 0;
+    }
+
+    mixer_ctx.switches[i] = (struct Switch3) { .down = down, .up = up };
+
+    return mixer_ctx.n_switches++;
+}
+
+/* Numbers were kept within int32 while parsing, this is for rounding and the weight scale */
+static int32_t compile_int32(struct Parser *ps, double v, const char *msg)
+{
+    v = round(v);
+    if (!(v >= INT32_MIN && v <= INT32_MAX)) {
+        parse_error(ps, msg);
+        return 0;
+    }
+
+    return v;
+}
+
+static void compile_node(struct Parser *ps, int idx)
+{
+    const struct Node *n = &ps->nodes[idx];
+    struct MixerInsn *insn, *jz, *jmp;
+
+    if (ps->failed)
+        return;
+
+    switch (n->type) {
+    case NODE_CONST:
+        insn = emit(ps, OP_CONST, 1);
+        if (insn)
+            insn->k = compile_int32(ps, n->v, "constant out of range");
+        break;
+    case NODE_INPUT:
+        insn = emit(ps, OP_INPUT, 1);
+        if (insn)
+            insn->arg = n->ch;
+        break;
+    case NODE_SWITCH3:
+        insn = emit(ps, OP_SWITCH3, 1);
+        if (insn)
+            insn->arg = add_switch3(ps, n->a, n->b);
+        break;
+    case NODE_MUL:
+        compile_node(ps, n->a);
+        insn = emit(ps, OP_MUL, 0);
+        if (insn)
+            insn->k = compile_int32(ps, n->v * (1 << WEIGHT_SHIFT),
+                                    "weight out of range");
+        break;
+    case NODE_UNARY:
+        compile_node(ps, n->a);
+        emit(ps, n->op, 0);
+        break;
+    case NODE_BINARY:
+        compile_node(ps, n->a);
+        compile_node(ps, n->b);
+        emit(ps, n->op, -1);
+        break;
+    case NODE_CLAMP:
+        compile_node(ps, n->a);
+        insn = emit(ps, OP_MAX, 0);
+        if (insn)
+            insn->k = n->lo;
+        insn = emit(ps, OP_MIN, 0);
+        if (insn)
+            insn->k = n->hi;
+        break;
+    case NODE_IF:
+        /* cond; jz else; a; jmp end; else: b; end: */
+        compile_node(ps, n->c);
+        jz = emit(ps, OP_JZ, -1);
+        compile_node(ps, n->a);
+        jmp = emit(ps, OP_JMP, 0);
+        if (!jz || !jmp)
+            break;
+
+        /* only one of the branches leaves its value on the stack */
+        ps->depth--;
+        jz->target = mixer_ctx.n_insns;
+        compile_node(ps, n->b);
+        jmp->target = mixer_ctx.n_insns;
+        break;
+    }
+}
+
+static int compile_output(const char *key, const char *value, unsigned int n_inputs)
+{
+    struct Parser ps = {
+        .label = key,
+        .p = value,
+        .n_inputs = n_inputs,
+    };
+    unsigned int n_insns = mixer_ctx.n_insns;
+    struct MixerInsn *insn;
+    unsigned long ch;
+    int root;
+
+    if (!strncaseeq(key, "RC", 2) || safe_atoul(key + 2, &ch) < 0 || ch < 1
+        || ch > MAX_CHANNELS) {
+        log_error("mixer: invalid output channel %s\n", key);
+        return -EINVAL;
+    }
+
+    root = parse_expr(&ps);
+    skip_space(&ps);
+    if (!ps.failed && *ps.p)
+        parse_error(&ps, "unexpected input");
+
+    compile_node(&ps, root);
+    insn = emit(&ps, OP_STORE, -1);
+    if (insn)
+        insn->arg = ch - 1;
+
+    if (!ps.failed && ps.max_depth > MAX_STACK)
+        parse_error(&ps, "expression too complex");
+
+    if (ps.failed) {
+        mixer_ctx.n_insns = n_insns;
+        return -EINVAL;
+    }
+
+    mixer_ctx.n_outputs = max(mixer_ctx.n_outputs, (unsigned int)ch);
+
+    return 0;
+}
+
+int mixer_init(CIniDomain *config, unsigned int n_inputs)
+{
+    CIniGroup *group;
+    CIniEntry *entry;
+    int r;
+
+    group = config ? c_ini_domain_find(config, "Mixer", -1) : NULL;
+    if (!group)
+        return 0;
+
+    mixer_ctx.n_outputs = n_inputs;
+
+    for (entry = c_ini_group_iterate(group); entry; entry = c_ini_entry_next(entry)) {
+        const char *key = c_ini_entry_get_key(entry, NULL);
+        const char *value = c_ini_entry_get_value(entry, NULL);
+
+        r = compile_output(key, value, n_inputs);
+        if (r < 0)
+            return r;
+    }
+
+    log_info("mixer: %u outputs, %u instructions\n", mixer_ctx.n_outputs, mixer_ctx.n_insns);
+
+    return 0;
+}
+
+void mixer_shutdown(void)
+{
+    mixer_ctx.n_insns = 0;
+    mixer_ctx.n_switches = 0;
+    mixer_ctx.started = false;
+}
+
+static void mixer_update_switches(const int in[])
+{
+    unsigned int i;
+
+    for (i = 0; i < mixer_ctx.n_switches; i++) {
+        struct Switch3 *sw = &mixer_ctx.switches[i];
+        bool down = in[sw->down] > PWM_CENTER, up = in[sw->up] > PWM_CENTER;
+
+        if (mixer_ctx.started) {
+            if (down != sw->last_down)
+                sw->pos = max(sw->pos - 1, -1);
+            if (up != sw->last_up)
+                sw->pos = min(sw->pos + 1, 1);
+        }
+
+        sw->last_down = down;
+        sw->last_up = up;
+    }
+}
+
+/* Results that don't fit the stack are held at the limit, far beyond any deflection */
+static inline int32_t saturate(int64_t v)
+{
+    return constrain(v, INT32_MIN, INT32_MAX);
+}
+
+unsigned int mixer_apply(const int in[], int out[], unsigned int n_inputs)
+{
+    int32_t stack[MAX_STACK];
+    unsigned int pc, i;
+    int sp = 0;
+
+    if (!mixer_ctx.n_insns) {
+        memcpy(out, in, n_inputs * sizeof(*out));
+        return n_inputs;
+    }
+
+    mixer_update_switches(in);
+    mixer_ctx.started = true;
+
+    /* outputs not in the mixer pass through */
+    for (i = 0; i < mixer_ctx.n_outputs; i++)
+        out[i] = i < n_inputs ? in[i] : PWM_CENTER;
+
+    for (pc = 0; pc < mixer_ctx.n_insns; pc++) {
+        const struct MixerInsn *insn = &mixer_ctx.insns[pc];
+        int32_t b;
+
+        switch (insn->op) {
+        case OP_CONST:
+            stack[sp++] = insn->k;
+            break;
+        case OP_INPUT:
+            stack[sp++] = in[insn->arg] - PWM_CENTER;
+            break;
+        case OP_SWITCH3:
+            stack[sp++] = mixer_ctx.switches[insn->arg].pos * PWM_HALF_RANGE;
+            break;
+        case OP_MUL:
+            stack[sp - 1] = saturate(((int64_t)stack[sp - 1] * insn->k
+                                      + (1 << (WEIGHT_SHIFT - 1))) >> WEIGHT_SHIFT);
+            break;
+        case OP_NEG:
+            stack[sp - 1] = saturate(-(int64_t)stack[sp - 1]);
+            break;
+        case OP_NOT:
+            stack[sp - 1] = !stack[sp - 1];
+            break;
+        case OP_MAX:
+            stack[sp - 1] = max(stack[sp - 1], insn->k);
+            break;
+        case OP_MIN:
+            stack[sp - 1] = min(stack[sp - 1], insn->k);
+            break;
+        case OP_JZ:
+            if (!stack[--sp])
+                pc = insn->target - 1;
+            break;
+        case OP_JMP:
+            pc = insn->target - 1;
+            break;
+        case OP_STORE:
+            b = stack[--sp];
+            out[insn->arg] = PWM_CENTER + constrain(b, -PWM_HALF_RANGE, PWM_HALF_RANGE);
+            break;
+        default:
+            /* binary operators */
+            b = stack[--sp];
+
+            switch (insn->op) {
+            case OP_ADD:
+                stack[sp - 1] = saturate((int64_t)stack[sp - 1] + b);
+                break;
+            case OP_SUB:
+                stack[sp - 1] = saturate((int64_t)stack[sp - 1] - b);
+                break;
+            case OP_LT:
+                stack[sp - 1] = stack[sp - 1] < b;
+                break;
+            case OP_LE:
+                stack[sp - 1] = stack[sp - 1] <= b;
+                break;
+            case OP_GT:
+                stack[sp - 1] = stack[sp - 1] > b;
+                break;
+            case OP_GE:
+                stack[sp - 1] = stack[sp - 1] >= b;
+                break;
+            case OP_EQ:
+                stack[sp - 1] = stack[sp - 1] == b;
+                break;
+            case OP_NE:
+                stack[sp - 1] = stack[sp - 1] != b;
+                break;
+            case OP_AND:
+                stack[sp - 1] = stack[sp - 1] && b;
+                break;
+            case OP_OR:
+                stack[sp - 1] = stack[sp - 1] || b;
+                break;
+            }
+            break;
+        }
+    }
+
+    return mixer_ctx.n_outputs;
+}
@@ -0,0 +1,12 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+/* Copyright (c) 2020 Lucas De Marchi <lucas.de.marchi@gmail.com> */
+
+#pragma once
+
+typedef struct CIniDomain CIniDomain;
+
+int mixer_init(CIniDomain *config, unsigned int n_inputs);
+void mixer_shutdown(void);
+
+/* Compute outputs from @in, return the number of outputs */
+unsigned int mixer_apply(const int in[], int out[], unsigned int n_inputs);
@@ -0,0 +1,122 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+/* Copyright (c) 2020 Lucas De Marchi <lucas.de.marchi@gmail.com> */
+
+#include "output.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "csv.h"
+#include "log.h"
+#include "remote.h"
+#include "serial.h"
+#include "shm.h"
+#include "util.h"
+
+#define DEFAULT_DEST "127.0.0.1:777"
+
+/* the first one that matches an entry gets it */
+static const struct OutputBackend *const backends[] = {
+    &serial_output_backend,
+    &csv_output_backend,
+    &shm_output_backend,
+    /* anything else is a network address */
+    &udp_output_backend,
+};
+
+static struct {
+    /* backends with at least one output, by index in backends[] */
+    bool active[ARRAY_SIZE(backends)];
+} output_ctx;
+
+static int find_backend(const char *spec)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(backends); i++)
+        if (backends[i]->match(spec))
+            return i;
+
+    return -ENOENT;
+}
+
+int output_init(const char *dest, const struct OutputDefaults *defaults)
+{
+    _cleanup_free_ char *buf = NULL;
+    char *saveptr, *entry;
+    bool any = false;
+    int r;
+
+    buf = strdup(dest ?: DEFAULT_DEST);
+    if (!buf)
+        return -ENOMEM;
+
+    for (entry = strtok_r(buf, " \t", &saveptr); entry; entry = strtok_r(NULL, " \t", &saveptr)) {
+        _cleanup_free_ char *s = strdup(entry);
+        int i;
+
+        if (!s)
+            return -ENOMEM;
+
+        i = find_backend(s);
+        if (i < 0) {
+            log_error("no output for destination %s\n", entry);
+            return -EINVAL;
+        }
+
+        log_debug("%s output for %s\n", backends[i]->name, entry);
+
+        /* before init so a backend left with partial state is shut down */
+        output_ctx.active[i] = any = true;
+
+        r = backends[i]->init(s, defaults);
+        if (r < 0) {
+            log_error("could not use destination %s\n", entry);
+            return r;
+        }
+    }
+
+    if (!any) {
+        log_error("no destination\n");
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static bool output_wanted(size_t i, bool network)
+{
+    return output_ctx.active[i] && (network || !backends[i]->network);
+}
+
+void output_send(const int val[], int count, usec_t timestamp_usec, bool network)
+{
+    size_t i;
+    usec_t now;
+
+    for (i = 0; i < ARRAY_SIZE(backends); i++)
+        if (output_wanted(i, network))
+            backends[i]->encode(val, count, timestamp_usec);
+
+    now = now_usec();
+
+    for (i = 0; i < ARRAY_SIZE(backends); i++)
+        if (output_wanted(i, network) && backends[i]->send)
+            backends[i]->send(now);
+}
+
+void output_shutdown(void)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(backends); i++) {
+        if (!output_ctx.active[i])
+            continue;
+
+        if (backends[i]->stats)
+            backends[i]->stats();
+        backends[i]->shutdown();
+        output_ctx.active[i] = false;
+    }
+}
@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+/* Copyright (c) 2020 Lucas De Marchi <lucas.de.marchi@gmail.com> */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "remote.h"
+#include "util.h"
+
+struct OutputDefaults {
+    /* format of network destinations that don't specify one */
+    enum RemoteOutputFormat format;
+    /* interval of the periodic sends, used as grid for launch times */
+    usec_t update_interval_usec;
+};
+
+/*
+ * An output backend owns the state of all its outputs. Each tick all backends encode the same
+ * channel values before any of them sends, so outputs don't drift apart by the time it takes to
+ * send to the others.
+ */
+struct OutputBackend {
+    const char *name;
+    /* sends over the network: the outputs SendOnChange saves airtime on */
+    bool network;
+    /* whether @spec, an entry of the destination list, is for this backend */
+    bool (*match)(const char *spec);
+    /* add an output for @spec, that may be modified while parsing */
+    int (*init)(char *spec, const struct OutputDefaults *defaults);
+    /* prepare what is sent for @val */
+    void (*encode)(const int val[], int count, usec_t timestamp_usec);
+    /* optional: backends paced by their own timers send from there */
+    void (*send)(usec_t now);
+    /* optional: log statistics */
+    void (*stats)(void);
+    void (*shutdown)(void);
+};
+
+/* @dest: space separated list of outputs */
+int output_init(const char *dest, const struct OutputDefaults *defaults);
+void output_shutdown(void);
+
+/*
+ * @timestamp_usec: CLOCK_MONOTONIC time of the newest input sample in @val. Network outputs are
+ * skipped unless @network: the others, e.g. serial receivers that go to failsafe without frames,
+ * get every update
+ */
+void output_send(const int val[], int count, usec_t timestamp_usec, bool network);
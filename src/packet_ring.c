@@ -0,0 +1,217 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+/* Copyright (c) 2020 Lucas De Marchi <lucas.de.marchi@gmail.com> */
+
+#include "packet_ring.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* RC packets are small: 16 frames per page, 32 in flight at most */
+#define RING_FRAME_SIZE 256
+#define RING_BLOCK_SIZE 4096
+#define RING_BLOCK_NR 2
+
+#define RING_DATA_OFFSET (TPACKET2_HDRLEN - sizeof(struct sockaddr_ll))
+
+int parse_mac(const char *s, uint8_t mac[ETH_ALEN])
+{
+    unsigned int b[ETH_ALEN];
+    char end;
+    int i;
+
+    if (sscanf(s, "%2x:%2x:%2x:%2x:%2x:%2x%c", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5], &end)
+        != ETH_ALEN)
+        return -EINVAL;
+
+    for (i = 0; i < ETH_ALEN; i++)
+        mac[i] = b[i];
+
+    return 0;
+}
+
+static uint16_t ip_checksum(const struct iphdr *ip)
+{
+    const uint16_t *p = (const uint16_t *)ip;
+    uint32_t sum = 0;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(*ip) / 2; i++)
+        sum += p[i];
+
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum += sum >> 16;
+
+    return ~sum;
+}
+
+static int ring_setup(struct PacketRing *pr)
+{
+    const struct tpacket_req req = {
+        .tp_block_size = RING_BLOCK_SIZE,
+        .tp_block_nr = RING_BLOCK_NR,
+        .tp_frame_size = RING_FRAME_SIZE,
+        .tp_frame_nr = RING_BLOCK_SIZE / RING_FRAME_SIZE * RING_BLOCK_NR,
+    };
+    int version = TPACKET_V2, loss = 1;
+
+    if (setsockopt(pr->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0)
+        return -errno;
+
+    /* a malformed frame is dropped rather than stopping the ring */
+    if (setsockopt(pr->fd, SOL_PACKET, PACKET_LOSS, &loss, sizeof(loss)) < 0)
+        return -errno;
+
+    if (setsockopt(pr->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0)
+        return -errno;
+
+    pr->ring_size = req.tp_block_size * req.tp_block_nr;
+    pr->ring = mmap(NULL, pr->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, pr->fd, 0);
+    if (pr->ring == MAP_FAILED) {
+        pr->ring = NULL;
+        return -errno;
+    }
+
+    pr->frame_size = req.tp_frame_size;
+    pr->frame_nr = req.tp_frame_nr;
+
+    return 0;
+}
+
+static int header_init(struct PacketRing *pr, unsigned int ifindex,
+                       const uint8_t dst_mac[ETH_ALEN], const struct sockaddr_in *src,
+                       const struct sockaddr_in *dst, uint8_t tos)
+{
+    struct ifreq ifr = { };
+
+    if (!if_indextoname(ifindex, ifr.ifr_name))
+        return -errno;
+
+    if (ioctl(pr->fd, SIOCGIFHWADDR, &ifr) < 0)
+        return -errno;
+
+    memcpy(pr->hdr.eth.ether_dhost, dst_mac, ETH_ALEN);
+    memcpy(pr->hdr.eth.ether_shost, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+    pr->hdr.eth.ether_type = htons(ETHERTYPE_IP);
+
+    pr->hdr.ip = (struct iphdr) {
+        .version = 4,
+        .ihl = sizeof(struct iphdr) / 4,
+        .tos = tos,
+        .frag_off = htons(IP_DF),
+        .ttl = 64,
+        .protocol = IPPROTO_UDP,
+        .saddr = src->sin_addr.s_addr,
+        .daddr = dst->sin_addr.s_addr,
+    };
+
+    /* no UDP checksum, optional for IPv4 */
+    pr->hdr.udp = (struct udphdr) {
+        .source = src->sin_port,
+        .dest = dst->sin_port,
+    };
+
+    return 0;
+}
+
+int packet_ring_init(struct PacketRing *pr, unsigned int ifindex, const uint8_t dst_mac[ETH_ALEN],
+                     const struct sockaddr_in *src, const struct sockaddr_in *dst, uint8_t tos,
+                     int priority)
+{
+    /* protocol 0: transmit only, nothing received is queued to the socket */
+    const struct sockaddr_ll ll = {
+        .sll_family = AF_PACKET,
+        .sll_ifindex = ifindex,
+    };
+    int one = 1, r;
+
+    memset(pr, 0, sizeof(*pr));
+
+    pr->fd = socket(AF_PACKET, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (pr->fd < 0)
+        return -errno;
+
+    r = header_init(pr, ifindex, dst_mac, src, dst, tos);
+    if (r < 0)
+        goto fail;
+
+    if (setsockopt(pr->fd, SOL_SOCKET, SO_PRIORITY, &priority, sizeof(priority)) < 0) {
+        r = -errno;
+        goto fail;
+    }
+
+    if (setsockopt(pr->fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one)) < 0) {
+        r = -errno;
+        goto fail;
+    }
+
+    r = ring_setup(pr);
+    if (r < 0)
+        goto fail;
+
+    if (bind(pr->fd, (const struct sockaddr *)&ll, sizeof(ll)) < 0) {
+        r = -errno;
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    packet_ring_close(pr);
+    return r;
+}
+
+void packet_ring_close(struct PacketRing *pr)
+{
+    if (pr->ring)
+        munmap(pr->ring, pr->ring_size);
+    if (pr->fd >= 0)
+        close(pr->fd);
+
+    pr->ring = NULL;
+    pr->fd = -1;
+}
+
+int packet_ring_send(struct PacketRing *pr, const void *payload, size_t len)
+{
+    struct tpacket2_hdr *tp = (struct tpacket2_hdr *)(pr->ring + pr->head * pr->frame_size);
+    uint8_t *frame = (uint8_t *)tp + RING_DATA_OFFSET;
+    /* patched here: after the Ethernet header they aren't aligned in the frame */
+    struct iphdr ip = pr->hdr.ip;
+    struct udphdr udp = pr->hdr.udp;
+
+    if (RING_DATA_OFFSET + sizeof(pr->hdr) + len > pr->frame_size)
+        return -EMSGSIZE;
+
+    /* still waiting to be sent by the kernel */
+    if (__atomic_load_n(&tp->tp_status, __ATOMIC_ACQUIRE) != TP_STATUS_AVAILABLE)
+        return -EAGAIN;
+
+    ip.tot_len = htons(sizeof(ip) + sizeof(udp) + len);
+    ip.id = htons(pr->ip_id++);
+    ip.check = ip_checksum(&ip);
+    udp.len = htons(sizeof(udp) + len);
+
+    memcpy(frame, &pr->hdr.eth, sizeof(pr->hdr.eth));
+    memcpy(frame + sizeof(pr->hdr.eth), &ip, sizeof(ip));
+    memcpy(frame + sizeof(pr->hdr.eth) + sizeof(ip), &udp, sizeof(udp));
+    memcpy(frame + sizeof(pr->hdr), payload, len);
+
+    tp->tp_len = sizeof(pr->hdr) + len;
+    __atomic_store_n(&tp->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+
+    pr->head = (pr->head + 1) % pr->frame_nr;
+
+    /* frames left behind by a failed kick go out with the next one */
+    if (send(pr->fd, NULL, 0, MSG_DONTWAIT) < 0 && errno != EAGAIN)
+        return -errno;
+
+    return 0;
+}
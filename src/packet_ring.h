@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+/* Copyright (c) 2020 Lucas De Marchi <lucas.de.marchi@gmail.com> */
+
+#pragma once
+
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "macro.h"
+
+/*
+ * Complete Ethernet/IPv4/UDP frames queued on a memory mapped PACKET_TX_RING. Headers come from a
+ * template built once: each frame only patches the payload, lengths, IP id and checksum.
+ */
+struct PacketRing {
+    int fd;
+    uint8_t *ring;
+    size_t ring_size;
+    unsigned int frame_size;
+    unsigned int frame_nr;
+    /* next frame to fill */
+    unsigned int head;
+
+    struct _packed {
+        struct ether_header eth;
+        struct iphdr ip;
+        struct udphdr udp;
+    } hdr;
+    uint16_t ip_id;
+};
+
+/*
+ * Frames from @src to @dst through @ifindex, with @dst_mac as next hop. They go straight to the
+ * driver, bypassing the queueing discipline: @priority is only used by drivers, e.g. Wi-Fi
+ * access category
+ */
+int packet_ring_init(struct PacketRing *pr, unsigned int ifindex, const uint8_t dst_mac[ETH_ALEN],
+                     const struct sockaddr_in *src, const struct sockaddr_in *dst, uint8_t tos,
+                     int priority);
+void packet_ring_close(struct PacketRing *pr);
+
+/* Queue a frame with @payload and kick transmission. -EAGAIN when the ring is full */
+int packet_ring_send(struct PacketRing *pr, const void *payload, size_t len);
+
+int parse_mac(const char *s, uint8_t mac[ETH_ALEN]);
@@ -0,0 +1,218 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+/* Copyright (c) 2020 Lucas De Marchi <lucas.de.marchi@gmail.com> */
+
+#include "realtime.h"
+
+#include <errno.h>
+#include <malloc.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <c-ini.h>
+
+#include "event_loop.h"
+#include "log.h"
+#include "macro.h"
+#include "util.h"
+
+#define DEFAULT_PRIORITY 50
+/* more than the event loop and the output ever need */
+#define PREFAULT_STACK_SIZE (256 * 1024)
+#define PREFAULT_HEAP_SIZE (1024 * 1024)
+
+struct RealtimeOptions {
+    bool enable;
+    int priority;
+    cpu_set_t cpus;
+    bool lock_memory;
+    usec_t busy_poll_usec;
+};
+
+/* "0,2-3" */
+static int parse_cpu_list(const char *s, cpu_set_t *cpus)
+{
+    CPU_ZERO(cpus);
+
+    while (*s) {
+        unsigned long first, last;
+        char *end;
+
+        errno = 0;
+        first = last = strtoul(s, &end, 10);
+        if (errno || end == s)
+            return -EINVAL;
+
+        if (*end == '-') {
+            s = end + 1;
+            last = strtoul(s, &end, 10);
+            if (errno || end == s || last < first)
+                return -EINVAL;
+        }
+
+        if (last >= CPU_SETSIZE)
+            return -EINVAL;
+
+        for (; first <= last; first++)
+            CPU_SET(first, cpus);
+
+        s = end;
+        if (*s == ',')
+            s++;
+        else if (*s)
+            return -EINVAL;
+    }
+
+    return CPU_COUNT(cpus) ? 0 : -EINVAL;
+}
+
+static void parse_options(CIniDomain *config, struct RealtimeOptions *opts)
+{
+    CIniGroup *group;
+    CIniEntry *entry;
+
+    group = config ? c_ini_domain_find(config, "Realtime", -1) : NULL;
+    for (entry = group ? c_ini_group_iterate(group) : NULL; entry;
+         entry = c_ini_entry_next(entry)) {
+        const char *key, *value;
+        unsigned long ul;
+        size_t keylen;
+        int b;
+
+        key = c_ini_entry_get_key(entry, &keylen);
+        value = c_ini_entry_get_value(entry, NULL);
+
+        if (strncaseeq(key, "Enable", keylen)) {
+            b = parse_boolean(value);
+            if (b < 0)
+                goto invalid;
+            opts->enable |= b;
+        } else if (strncaseeq(key, "Priority", keylen)) {
+            if (safe_atoul(value, &ul) < 0 || ul < 1 || ul > 99)
+                goto invalid;
+            opts->priority = ul;
+        } else if (strncaseeq(key, "CPUAffinity", keylen)) {
+            if (parse_cpu_list(value, &opts->cpus) < 0)
+                goto invalid;
+        } else if (strncaseeq(key, "LockMemory", keylen)) {
+            b = parse_boolean(value);
+            if (b < 0)
+                goto invalid;
+            opts->lock_memory = b;
+        } else if (strncaseeq(key, "BusyPollUSec", keylen)) {
+            if (safe_atoul(value, &ul) < 0)
+                goto invalid;
+            opts->busy_poll_usec = ul;
+        }
+
+        continue;
+
+invalid:
+        log_warning("Invalid value Realtime.%.*s=%s\n", (int)keylen, key, value);
+    }
+}
+
+/* Touch the pages now, so the first time they are used doesn't stall on a page fault */
+static _noinline_ void prefault_stack(void)
+{
+    volatile unsigned char stack[PREFAULT_STACK_SIZE];
+    size_t i;
+
+    for (i = 0; i < sizeof(stack); i += 4096)
+        stack[i] = 0;
+}
+
+static int prefault_heap(void)
+{
+    unsigned char *p;
+    size_t i;
+
+    /* keep what's freed in the heap, and allocate everything from it */
+    if (!mallopt(M_TRIM_THRESHOLD, -1) || !mallopt(M_MMAP_MAX, 0))
+        return -EINVAL;
+
+    p = malloc(PREFAULT_HEAP_SIZE);
+    if (!p)
+        return -ENOMEM;
+
+    for (i = 0; i < PREFAULT_HEAP_SIZE; i += 4096)
+        p[i] = 0;
+
+    free(p);
+
+    return 0;
+}
+
+static void set_affinity(const cpu_set_t *cpus)
+{
+    if (sched_setaffinity(0, sizeof(*cpus), cpus) < 0)
+        log_warning("realtime: could not set CPU affinity: %m\n");
+    else
+        log_info("realtime: running on %d CPU(s)\n", CPU_COUNT(cpus));
+}
+
+static void lock_memory(void)
+{
+    int r;
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        log_warning("realtime: could not lock memory, needs CAP_IPC_LOCK or a higher "
+                    "RLIMIT_MEMLOCK: %m\n");
+        return;
+    }
+
+    r = prefault_heap();
+    if (r < 0)
+        log_warning("realtime: could not prefault heap: %s\n", strerror(-r));
+    prefault_stack();
+
+    log_info("realtime: memory locked, %d KiB of stack and %d KiB of heap prefaulted\n",
+             PREFAULT_STACK_SIZE / 1024, r < 0 ? 0 : PREFAULT_HEAP_SIZE / 1024);
+}
+
+static void set_scheduler(int priority)
+{
+    const struct sched_param param = {
+        .sched_priority = priority,
+    };
+
+    /* not inherited by child processes */
+    if (sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK, &param) < 0)
+        log_warning("realtime: could not set SCHED_FIFO priority %d, needs CAP_SYS_NICE or "
+                    "RLIMIT_RTPRIO: %m\n", priority);
+    else
+        log_info("realtime: SCHED_FIFO priority %d\n", priority);
+}
+
+int realtime_init(CIniDomain *config, bool enable)
+{
+    struct RealtimeOptions opts = {
+        .enable = enable,
+        .priority = DEFAULT_PRIORITY,
+        .lock_memory = true,
+    };
+
+    CPU_ZERO(&opts.cpus);
+    parse_options(config, &opts);
+
+    if (!opts.enable)
+        return 0;
+
+    if (CPU_COUNT(&opts.cpus))
+        set_affinity(&opts.cpus);
+
+    if (opts.lock_memory)
+        lock_memory();
+
+    if (opts.busy_poll_usec) {
+        event_loop_set_busy_poll(opts.busy_poll_usec);
+        log_info("realtime: busy polling up to %" PRIu64 " us before each timeout\n",
+                 opts.busy_poll_usec);
+    }
+
+    /* last: prefaulting can take a while, better not done at real-time priority */
+    set_scheduler(opts.priority);
+
+    return 0;
+}
@@ -0,0 +1,16 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+/* Copyright (c) 2020 Lucas De Marchi <lucas.de.marchi@gmail.com> */
+
+#pragma once
+
+#include <stdbool.h>
+
+typedef struct CIniDomain CIniDomain;
+
+/*
+ * Real-time mode from the [Realtime] group, or forced by @enable: SCHED_FIFO, CPU affinity,
+ * locked and prefaulted memory and busy polling in the event loop. To be called once everything
+ * is initialized, so what was allocated so far is locked too. Settings that can't be applied are
+ * reported and skipped, they are not fatal
+ */
+int realtime_init(CIniDomain *config, bool enable);
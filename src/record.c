@@ -0,0 +1,205 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+/* Copyright (c) 2020 Lucas De Marchi <lucas.de.marchi@gmail.com> */
+
+#include "record.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+#define RECORD_BUFFER_SIZE (64 * 1024)
+#define RECORD_FLUSH_INTERVAL_USEC USEC_PER_SEC
+
+static struct {
+    FILE *fp;
+    usec_t last_ts;
+    usec_t last_flush_ts;
+    bool failed;
+} record_ctx;
+
+struct ReplayReader {
+    FILE *fp;
+    usec_t ts;
+};
+
+int record_open(const char *path)
+{
+    struct RecordHeader hdr = {
+        .magic = RECORD_MAGIC,
+        .version = htole32(RECORD_VERSION),
+    };
+
+    record_ctx.fp = fopen(path, "wbe");
+    if (!record_ctx.fp) {
+        int r = -errno;
+
+        log_error("Could not open %s for recording: %m\n", path);
+        return r;
+    }
+
+    /* events are written as they arrive: let stdio batch them */
+    setvbuf(record_ctx.fp, NULL, _IOFBF, RECORD_BUFFER_SIZE);
+
+    if (fwrite(&hdr, sizeof(hdr), 1, record_ctx.fp) != 1) {
+        log_error("Could not write to %s: %m\n", path);
+        fclose(record_ctx.fp);
+        record_ctx.fp = NULL;
+        return -EIO;
+    }
+
+    log_info("Recording input events to %s\n", path);
+
+    return 0;
+}
+
+void record_close(void)
+{
+    if (!record_ctx.fp)
+        return;
+
+    if (fclose(record_ctx.fp) != 0)
+        log_error("Could not finish recording: %m\n");
+
+    record_ctx.fp = NULL;
+}
+
+bool record_is_enabled(void)
+{
+    return record_ctx.fp;
+}
+
+static void record_write(const void *buf, size_t len, usec_t ts)
+{
+    if (fwrite(buf, len, 1, record_ctx.fp) != 1 && !record_ctx.failed) {
+        log_error("Could not record event: %m\n");
+        record_ctx.failed = true;
+    }
+
+    /* don't lose much on a crash */
+    if (ts - record_ctx.last_flush_ts >= RECORD_FLUSH_INTERVAL_USEC) {
+        fflush(record_ctx.fp);
+        record_ctx.last_flush_ts = ts;
+    }
+}
+
+static void record_fill(struct RecordEvent *ev, unsigned int device, uint8_t type, uint16_t code,
+                        int32_t value, usec_t ts)
+{
+    usec_t delta = record_ctx.last_ts ? ts - record_ctx.last_ts : 0;
+
+    /* the clock doesn't go back, but the source of the timestamp may change on reattach */
+    if (ts < record_ctx.last_ts)
+        delta = 0;
+
+    ev->delta_usec = htole32(min(delta, (usec_t)UINT32_MAX));
+    ev->device = device;
+    ev->type = type;
+    ev->code = htole16(code);
+    ev->value = htole32(value);
+
+    record_ctx.last_ts = max(ts, record_ctx.last_ts);
+}
+
+void record_event(unsigned int device, uint8_t type, uint16_t code, int32_t value, usec_t ts)
+{
+    struct RecordEvent ev;
+
+    if (!record_ctx.fp)
+        return;
+
+    record_fill(&ev, device, type, code, value, ts);
+    record_write(&ev, sizeof(ev), ts);
+}
+
+void record_absinfo(unsigned int device, uint16_t code, int32_t value,
+                    const struct RecordAbsinfo *absinfo, usec_t ts)
+{
+    struct {
+        struct RecordEvent ev;
+        struct RecordAbsinfo absinfo;
+    } _packed rec;
+
+    if (!record_ctx.fp)
+        return;
+
+    record_fill(&rec.ev, device, RECORD_ABSINFO, code, value, ts);
+    rec.absinfo.minimum = htole32(absinfo->minimum);
+    rec.absinfo.maximum = htole32(absinfo->maximum);
+    rec.absinfo.fuzz = htole32(absinfo->fuzz);
+    rec.absinfo.flat = htole32(absinfo->flat);
+
+    record_write(&rec, sizeof(rec), ts);
+}
+
+int replay_open(const char *path, struct ReplayReader **readerp)
+{
+    struct ReplayReader *reader;
+    struct RecordHeader hdr;
+
+    reader = calloc(1, sizeof(*reader));
+    if (!reader)
+        return -ENOMEM;
+
+    reader->fp = fopen(path, "rbe");
+    if (!reader->fp) {
+        int r = -errno;
+
+        log_error("Could not open %s for replay: %m\n", path);
+        free(reader);
+        return r;
+    }
+
+    /* streamed, so recordings don't need to fit in memory */
+    setvbuf(reader->fp, NULL, _IOFBF, RECORD_BUFFER_SIZE);
+
+    if (fread(&hdr, sizeof(hdr), 1, reader->fp) != 1
+        || memcmp(hdr.magic, RECORD_MAGIC, sizeof(hdr.magic)) != 0
+        || le32toh(hdr.version) != RECORD_VERSION) {
+        log_error("%s is not a recording of input events\n", path);
+        replay_close(reader);
+        return -EINVAL;
+    }
+
+    *readerp = reader;
+
+    return 0;
+}
+
+void replay_close(struct ReplayReader *reader)
+{
+    if (!reader)
+        return;
+
+    fclose(reader->fp);
+    free(reader);
+}
+
+int replay_next(struct ReplayReader *reader, struct RecordEvent *ev,
+                struct RecordAbsinfo *absinfo, usec_t *ts)
+{
+    if (fread(ev, sizeof(*ev), 1, reader->fp) != 1)
+        return ferror(reader->fp) ? -EIO : 0;
+
+    ev->delta_usec = le32toh(ev->delta_usec);
+    ev->code = le16toh(ev->code);
+    ev->value = le32toh(ev->value);
+
+    if (ev->type == RECORD_ABSINFO) {
+        if (fread(absinfo, sizeof(*absinfo), 1, reader->fp) != 1)
+            return -EIO;
+
+        absinfo->minimum = le32toh(absinfo->minimum);
+        absinfo->maximum = le32toh(absinfo->maximum);
+        absinfo->fuzz = le32toh(absinfo->fuzz);
+        absinfo->flat = le32toh(absinfo->flat);
+    }
+
+    reader->ts += ev->delta_usec;
+    *ts = reader->ts;
+
+    return 1;
+}
@@ -0,0 +1,72 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+/* Copyright (c) 2020 Lucas De Marchi <lucas.de.marchi@gmail.com> */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "macro.h"
+#include "util.h"
+
+/*
+ * Binary log of the input events, to be replayed later. After the header, the file is a sequence
+ * of struct RecordEvent, all fields in little endian. Besides evdev events, some types not used
+ * by evdev describe the devices, so the same handlers can run on replay without a device.
+ */
+
+#define RECORD_MAGIC "DEMARCEV"
+#define RECORD_VERSION 1
+
+struct _packed RecordHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+enum RecordType {
+    /* axis info queried on attach, followed by a struct RecordAbsinfo */
+    RECORD_ABSINFO = 0xf0,
+    /* axis value and button state queried from the device on resync */
+    RECORD_RESYNC_ABS,
+    RECORD_RESYNC_KEY,
+    /* device attached or detached */
+    RECORD_ATTACH,
+    RECORD_DETACH,
+};
+
+struct _packed RecordEvent {
+    /* time since previous record */
+    uint32_t delta_usec;
+    uint8_t device;
+    /* EV_* or enum RecordType */
+    uint8_t type;
+    uint16_t code;
+    int32_t value;
+};
+
+/* value of the RecordEvent holds the current value */
+struct _packed RecordAbsinfo {
+    int32_t minimum;
+    int32_t maximum;
+    int32_t fuzz;
+    int32_t flat;
+};
+
+int record_open(const char *path);
+void record_close(void);
+bool record_is_enabled(void) _pure_;
+void record_event(unsigned int device, uint8_t type, uint16_t code, int32_t value, usec_t ts);
+void record_absinfo(unsigned int device, uint16_t code, int32_t value,
+                    const struct RecordAbsinfo *absinfo, usec_t ts);
+
+struct ReplayReader;
+
+int replay_open(const char *path, struct ReplayReader **readerp);
+void replay_close(struct ReplayReader *reader);
+/*
+ * Read next record into @ev and @absinfo, if it's a RECORD_ABSINFO. @ts is the time since the
+ * first record. Return 1 on success, 0 on end of file and < 0 on error
+ */
+int replay_next(struct ReplayReader *reader, struct RecordEvent *ev,
+                struct RecordAbsinfo *absinfo, usec_t *ts);
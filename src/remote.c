@@ -5,19 +5,45 @@
 
 #include <arpa/inet.h>
 #include <assert.h>
+#include <endian.h>
 #include <errno.h>
+#include <limits.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <net/if.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "event_loop.h"
+#include "histogram.h"
 #include "log.h"
 #include "macro.h"
+#include "output.h"
+#include "packet_ring.h"
 #include "util.h"
 
-#define DEFAULT_DEST "127.0.0.1"
-#define DEFAULT_PORT 777UL
+#define DEFAULT_PORT "777"
+
+/* Expedited Forwarding: mapped to the voice access category by most Wi-Fi drivers */
+#define DEFAULT_DSCP 46
+/* TC_PRIO_INTERACTIVE, the highest that doesn't need CAP_NET_ADMIN */
+#define DEFAULT_PRIORITY 6
+
+#define TXTIME_DEFAULT_DELAY_USEC 2000
+/*
+ * A launch time closer than this is moved to the next slot of the grid. Above the usual delta of
+ * etf, that drops packets that reach it later than launch time - delta
+ */
+#define TXTIME_DEFAULT_LEAD_USEC 600
 
 /* -- start AP RCINPUT_UDP protocol -- */
 
@@ -44,34 +70,223 @@ struct _packed rc_udp_sitl_packet {
 };
 /**/
 
-static struct {
-    int sfd;
-    struct sockaddr_in sockaddr;
+/* -- MAVLink v2 RC_CHANNELS_OVERRIDE -- */
+
+#define MAVLINK_STX_V2 0xfd
+#define MAVLINK_MSG_ID_RC_CHANNELS_OVERRIDE 70
+#define MAVLINK_RC_CHANNELS_OVERRIDE_CRC_EXTRA 124
+#define MAVLINK_RC_CHANNELS_OVERRIDE_NUM_CHANNELS 18
+/* chan1_raw..chan8_raw are in the base message, the others are extensions */
+#define MAVLINK_RC_CHANNELS_OVERRIDE_NUM_BASE 8
+
+#define MAVLINK_DEFAULT_SYSID 255 /* ground station */
+#define MAVLINK_DEFAULT_COMPID 190 /* MAV_COMP_ID_MISSIONPLANNER */
+#define MAVLINK_DEFAULT_TARGET_SYSID 1
+#define MAVLINK_DEFAULT_TARGET_COMPID 1 /* MAV_COMP_ID_AUTOPILOT1 */
+
+/* Base fields sorted by size, extensions in declaration order. All fields are Little Endian */
+struct _packed mavlink_rc_override_payload {
+    uint16_t chan_base[MAVLINK_RC_CHANNELS_OVERRIDE_NUM_BASE];
+    uint8_t target_system;
+    uint8_t target_component;
+    uint16_t chan_ext[MAVLINK_RC_CHANNELS_OVERRIDE_NUM_CHANNELS
+                      - MAVLINK_RC_CHANNELS_OVERRIDE_NUM_BASE];
+};
+
+struct _packed mavlink_rc_override_packet {
+    uint8_t magic;
+    uint8_t len;
+    uint8_t incompat_flags;
+    uint8_t compat_flags;
+    uint8_t seq;
+    uint8_t sysid;
+    uint8_t compid;
+    uint8_t msgid[3];
+    struct mavlink_rc_override_payload payload;
+    /* room for the checksum, that follows the payload after trailing zeros are removed */
+    uint8_t crc[2];
+};
+
+struct MavlinkIds {
+    unsigned long sysid;
+    unsigned long compid;
+    unsigned long target_sysid;
+    unsigned long target_compid;
+};
+
+/* ----------------------------------- */
+
+#define MAX_DESTINATIONS 8
+
+/* a receiver that refused a packet is considered down until this long without errors */
+#define UNREACHABLE_USEC USEC_PER_SEC
+
+/* -- acknowledgements -- */
+
+/*
+ * The receiver echoes each packet back, or at least the header up to the sequence number. The
+ * send time of recent packets is kept by sequence number to measure the RTT of the echoes.
+ */
+#define ACK_WINDOW 1024
+/* packets are checked for their echo a period after sent, the loss evaluated once per period */
+#define ACK_PERIOD_USEC (500 * USEC_PER_MSEC)
+/* packet loss, in percent, above which the rate is halved and below which it's raised again */
+#define ACK_LOSS_HIGH 10
+#define ACK_LOSS_LOW 2
+
+struct AckSlot {
+    usec_t sent_usec;
+    uint16_t seq;
+    bool acked;
+};
+
+struct AckState {
+    bool enabled;
+    struct AckSlot *window;
+    /* sequence numbers of the format wrap at this mask */
+    uint16_t seq_mask;
+    uint16_t last_seq;
+    bool have_last;
+    bool lossy;
+    /* the rate is adapted between the divider option and this */
+    unsigned long min_divider;
+    unsigned long max_divider;
+    /* packets sent before this were already checked */
+    usec_t checked_usec;
+    /* not yet checked when their slot was reused, added to the next check */
+    unsigned long evicted_sent;
+    unsigned long evicted_acked;
+    usec_t srtt;
+
+    struct {
+        unsigned long acked;
+        unsigned long lost;
+        unsigned long reordered;
+        /* duplicated, too late or not an echo of a packet of ours */
+        unsigned long ignored;
+        struct Histogram rtt;
+    } stats;
+};
+
+/* ----------------------------------- */
+
+/* Options set on the socket rather than per packet, so shared by multicast destinations */
+struct SocketOptions {
+    /* IP_TOS or IPV6_TCLASS: DSCP in the upper 6 bits */
+    int tos;
+    int priority;
+    /* clock of SO_TXTIME launch times, -1 to send right away */
+    int txtime_clock;
+};
+
+struct Destination {
+    struct sockaddr_storage sockaddr;
+    socklen_t sockaddr_len;
+    /* numeric address and port, and interface if given, for messages */
+    char name[INET6_ADDRSTRLEN + sizeof("[]:65535 via ") + IF_NAMESIZE];
+    /* destinations of a group send the same packets, with the same sequence numbers */
+    char group[32];
+    /* first of the group, that owns the packet, or NULL */
+    struct Destination *primary;
+    /* tick + 1 of the last packet encoded, for the other destinations of the group */
+    unsigned long encoded_tick;
+    enum RemoteOutputFormat format;
+    /* send one of every @divider packets */
+    unsigned long divider;
+    /* outgoing interface, 0 to let routing decide */
+    unsigned int ifindex;
+    /* connected socket for unicast, -1 for multicast that goes through a shared socket */
+    int fd;
+    struct SocketOptions sockopts;
+    /*
+     * With txtime, packets leave on a grid of txtime_interval_nsec starting at txtime_anchor,
+     * txtime_delay_nsec after the packet of each slot is normally encoded
+     */
+    nsec_t txtime_interval_nsec;
+    nsec_t txtime_delay_nsec;
+    nsec_t txtime_lead_nsec;
+    nsec_t txtime_anchor;
+    /* of the last packet, to tell which destination a drop reported on a shared socket is for */
+    nsec_t txtime_launch;
+    /* SCM_TXTIME payload in control, not necessarily aligned */
+    uint8_t *txtime;
+    /* packet templates: only channels, sequence and checksum change on each send */
     union {
         struct rc_udp_packet pkt;
         struct rc_udp_sitl_packet sitl_pkt;
+        struct mavlink_rc_override_packet mav_pkt;
     };
-    enum RemoteOutputFormat format;
+    union {
+        /* the larger of in_pktinfo and in6_pktinfo, then SCM_TXTIME */
+        char buf[CMSG_SPACE(sizeof(struct in6_pktinfo)) + CMSG_SPACE(sizeof(uint64_t))];
+        struct cmsghdr align;
+    } control;
+    size_t controllen;
+    struct iovec iov;
+    /* the packet as sent: iov, control and the address if not connected */
+    struct msghdr hdr;
+    /* with io_uring, sends are submitted with the next wait of the event loop */
+    struct EventSource *send_source;
+    struct EventSource *ack_source;
+    /* raw frames to this next hop through a packet ring, the socket only receives */
+    bool raw;
+    uint8_t raw_mac[ETH_ALEN];
+    struct PacketRing *ring;
     usec_t last_error_ts;
+    usec_t refused_ts;
+    bool unreachable;
+    /* encoded in this tick, to be sent */
+    bool due;
+
+    struct AckState ack;
+
+    struct {
+        unsigned long sent;
+        unsigned long failed;
+        /* dropped by the queueing discipline for their launch time, also in failed */
+        unsigned long late;
+    } stats;
+};
+
+static struct {
+    /* unconnected sockets for multicast, by address family, and their options */
+    int sfd4, sfd6;
+    struct SocketOptions sockopts4, sockopts6;
+    struct Destination dests[MAX_DESTINATIONS];
+    unsigned int n_dests;
+    unsigned long tick;
+    /* multicast messages due in this tick, sent with a single syscall per address family */
+    struct mmsghdr msgs[MAX_DESTINATIONS];
+    struct Destination *msg_dests[MAX_DESTINATIONS];
+    unsigned int n_msgs4, n_msgs6;
+    /* CRC-16/MCRF4XX used by MAVLink, one byte at a time */
+    uint16_t mavlink_crc_table[256];
 } remote_ctx = {
-    .sfd = -1,
+    .sfd4 = -1,
+    .sfd6 = -1,
+};
+
+static const char *const format_names[] = {
+    [REMOTE_OUTPUT_AP_UDP_SIMPLE] = "ardupilot-udp-simple",
+    [REMOTE_OUTPUT_AP_SITL] = "ardupilot-sitl",
+    [REMOTE_OUTPUT_MAVLINK] = "mavlink",
 };
 
-static int _send(const void *buf, size_t len)
+enum RemoteOutputFormat remote_output_format_from_str(const char *s)
 {
-    int r = sendto(remote_ctx.sfd, buf, len, 0, (struct sockaddr *)&remote_ctx.sockaddr,
-                   sizeof(struct sockaddr));
-    if (r == -1 && errno != EAGAIN) {
-        if (errno != ECONNREFUSED && errno != ENETUNREACH)
-            log_error("could not send packet: %m\n");
-    }
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(format_names); i++)
+        if (strcaseeq(s, format_names[i]))
+            return i;
 
-    return r;
+    return _REMOTE_OUTPUT_UNKNOWN;
 }
 
-static void sitl_send_pkt(const int val[], int count)
+static size_t sitl_fill_pkt(struct Destination *d, const int val[], int count,
+                            usec_t timestamp_usec)
 {
-    struct rc_udp_sitl_packet *pkt = &remote_ctx.sitl_pkt;
+    struct rc_udp_sitl_packet *pkt = &d->sitl_pkt;
     int i;
 
     assert(count <= SITL_NUM_CHANNELS);
@@ -79,13 +294,13 @@ static void sitl_send_pkt(const int val[], int count)
     for (i = 0; i < count; i++)
         pkt->ch[i] = val[i];
 
-    _send(pkt, sizeof(*pkt));
+    return sizeof(*pkt);
 }
 
-static void simple_send_pkt(const int val[], int count)
+static size_t simple_fill_pkt(struct Destination *d, const int val[], int count,
+                              usec_t timestamp_usec)
 {
-    struct rc_udp_packet *pkt = &remote_ctx.pkt;
-    ssize_t r;
+    struct rc_udp_packet *pkt = &d->pkt;
     int i;
 
     assert(count <= RCINPUT_UDP_NUM_CHANNELS);
@@ -94,72 +309,1240 @@ static void simple_send_pkt(const int val[], int count)
         pkt->ch[i] = val[i];
 
     pkt->seq++;
-    pkt->timestamp_usec = now_usec();
+    pkt->timestamp_usec = timestamp_usec;
+
+    return sizeof(*pkt);
+}
+
+static void mavlink_crc_init(void)
+{
+    unsigned int i, bit;
+
+    for (i = 0; i < 256; i++) {
+        uint16_t crc = i;
+
+        for (bit = 0; bit < 8; bit++)
+            crc = crc & 1 ? (crc >> 1) ^ 0x8408 : crc >> 1;
+
+        remote_ctx.mavlink_crc_table[i] = crc;
+    }
+}
+
+static inline uint16_t mavlink_crc_accumulate(uint16_t crc, uint8_t b)
+{
+    return (crc >> 8) ^ remote_ctx.mavlink_crc_table[(crc ^ b) & 0xff];
+}
+
+static void mavlink_pkt_init(struct Destination *d, const struct MavlinkIds *ids)
+{
+    struct mavlink_rc_override_packet *pkt = &d->mav_pkt;
+
+    memset(pkt, 0, sizeof(*pkt));
+    pkt->magic = MAVLINK_STX_V2;
+    pkt->sysid = ids->sysid;
+    pkt->compid = ids->compid;
+    pkt->msgid[0] = MAVLINK_MSG_ID_RC_CHANNELS_OVERRIDE & 0xff;
+    pkt->msgid[1] = (MAVLINK_MSG_ID_RC_CHANNELS_OVERRIDE >> 8) & 0xff;
+    pkt->msgid[2] = (MAVLINK_MSG_ID_RC_CHANNELS_OVERRIDE >> 16) & 0xff;
+    pkt->payload.target_system = ids->target_sysid;
+    pkt->payload.target_component = ids->target_compid;
+}
+
+static size_t mavlink_fill_pkt(struct Destination *d, const int val[], int count,
+                               usec_t timestamp_usec)
+{
+    struct mavlink_rc_override_packet *pkt = &d->mav_pkt;
+    const uint8_t *p, *end;
+    uint8_t *payload = (uint8_t *)&pkt->payload;
+    uint16_t crc = 0xffff;
+    size_t len;
+    int i;
+
+    assert(count <= MAVLINK_RC_CHANNELS_OVERRIDE_NUM_CHANNELS);
+
+    /*
+     * Channels we don't have are ignored by the vehicle: UINT16_MAX for the base ones, 0 for the
+     * extensions
+     */
+    for (i = 0; i < MAVLINK_RC_CHANNELS_OVERRIDE_NUM_BASE; i++)
+        pkt->payload.chan_base[i] = htole16(i < count ? val[i] : UINT16_MAX);
+    for (; i < MAVLINK_RC_CHANNELS_OVERRIDE_NUM_CHANNELS; i++)
+        pkt->payload.chan_ext[i - MAVLINK_RC_CHANNELS_OVERRIDE_NUM_BASE]
+            = htole16(i < count ? val[i] : 0);
+
+    /* MAVLink v2 drops trailing zeros from the payload, but keeps at least one byte */
+    for (len = sizeof(pkt->payload); len > 1 && payload[len - 1] == 0; len--)
+        ;
+
+    pkt->len = len;
+    pkt->seq++;
+
+    /* from len to the end of the payload, then the message's CRC_EXTRA */
+    for (p = &pkt->len, end = payload + len; p < end; p++)
+        crc = mavlink_crc_accumulate(crc, *p);
+    crc = mavlink_crc_accumulate(crc, MAVLINK_RC_CHANNELS_OVERRIDE_CRC_EXTRA);
+
+    payload[len] = crc & 0xff;
+    payload[len + 1] = crc >> 8;
+
+    return offsetof(struct mavlink_rc_override_packet, payload) + len + 2;
+}
+
+static void send_error(struct Destination *d, int err, usec_t now)
+{
+    d->stats.failed++;
+
+    /* ICMP port or host unreachable from a previous packet, reported on a connected socket */
+    if (err == ECONNREFUSED || err == EHOSTUNREACH) {
+        if (!d->unreachable)
+            log_warning("%s: receiver is down (%s)\n", d->name, strerror(err));
+        d->unreachable = true;
+        d->refused_ts = now;
+    } else if (err != EAGAIN && err != ENETUNREACH) {
+        log_error("could not send packet to %s: %s\n", d->name, strerror(err));
+    }
+
+    if (now - d->last_error_ts > 5 * USEC_PER_SEC) {
+        log_debug("%s: 5s without sending update\n", d->name);
+        d->last_error_ts = now;
+    }
+}
+
+static void send_sent(struct Destination *d, usec_t now)
+{
+    d->stats.sent++;
 
-    r = _send(pkt, sizeof(*pkt));
-    if (r == -1 && pkt->timestamp_usec - remote_ctx.last_error_ts > 5 * USEC_PER_SEC) {
-        log_debug("5s without sending update\n");
-        remote_ctx.last_error_ts = pkt->timestamp_usec;
+    if (d->unreachable && now - d->refused_ts >= UNREACHABLE_USEC) {
+        log_info("%s: receiver is back\n", d->name);
+        d->unreachable = false;
     }
 }
 
-void remote_send_pkt(const int val[], int count)
+static void send_msgs(int fd, unsigned int first, unsigned int n, usec_t now)
 {
-    switch (remote_ctx.format) {
+    unsigned int i = first;
+    int r;
+
+    while (i < first + n) {
+        r = sendmmsg(fd, &remote_ctx.msgs[i], first + n - i, 0);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+
+            /* the first message failed: skip it and try the others */
+            send_error(remote_ctx.msg_dests[i], errno, now);
+            i++;
+        } else {
+            for (; r > 0; r--, i++)
+                remote_ctx.msg_dests[i]->stats.sent++;
+        }
+    }
+}
+
+static void queue_msg(struct Destination *d, unsigned int n)
+{
+    remote_ctx.msgs[n].msg_hdr = d->hdr;
+    remote_ctx.msg_dests[n] = d;
+}
+
+/* Destination whose template is sent, shared by a group */
+static inline const struct Destination *packet_owner(const struct Destination *d)
+{
+    return d->primary ?: d;
+}
+
+static uint16_t packet_seq(const struct Destination *d)
+{
+    d = packet_owner(d);
+
+    return d->format == REMOTE_OUTPUT_MAVLINK ? d->mav_pkt.seq : d->pkt.seq;
+}
+
+/* Sequence number of an echoed packet */
+static int ack_parse(const struct Destination *d, const uint8_t *buf, size_t len, uint16_t *seq)
+{
+    d = packet_owner(d);
+
+    if (d->format == REMOTE_OUTPUT_MAVLINK) {
+        const struct mavlink_rc_override_packet *pkt = (const void *)buf;
+
+        if (len < offsetof(struct mavlink_rc_override_packet, payload)
+            || pkt->magic != MAVLINK_STX_V2 || pkt->sysid != d->mav_pkt.sysid
+            || pkt->msgid[0] != MAVLINK_MSG_ID_RC_CHANNELS_OVERRIDE)
+            return -EINVAL;
+
+        *seq = pkt->seq;
+    } else {
+        const struct rc_udp_packet *pkt = (const void *)buf;
+
+        if (len < offsetof(struct rc_udp_packet, ch) || pkt->version != RCINPUT_UDP_VERSION)
+            return -EINVAL;
+
+        *seq = pkt->seq;
+    }
+
+    return 0;
+}
+
+static void ack_received(struct Destination *d, uint16_t seq, usec_t now)
+{
+    struct AckState *ack = &d->ack;
+    struct AckSlot *slot = &ack->window[seq % ACK_WINDOW];
+    uint16_t ahead = (seq - ack->last_seq) & ack->seq_mask;
+    usec_t rtt;
+
+    if (!slot->sent_usec || slot->seq != seq || slot->acked) {
+        ack->stats.ignored++;
+        return;
+    }
+
+    /* too late, counted as lost even if it arrives before the check */
+    rtt = now - slot->sent_usec;
+    if (rtt > ACK_PERIOD_USEC) {
+        ack->stats.ignored++;
+        return;
+    }
+
+    slot->acked = true;
+    histogram_add(&ack->stats.rtt, rtt);
+    ack->srtt = ack->srtt ? (7 * ack->srtt + rtt) / 8 : rtt;
+    ack->stats.acked++;
+
+    /* more than half the sequence space ahead is behind */
+    if (ack->have_last && ahead > ack->seq_mask / 2) {
+        ack->stats.reordered++;
+    } else {
+        ack->last_seq = seq;
+        ack->have_last = true;
+    }
+}
+
+static int dest_socket(const struct Destination *d)
+{
+    if (d->fd >= 0)
+        return d->fd;
+
+    return d->sockaddr.ss_family == AF_INET ? remote_ctx.sfd4 : remote_ctx.sfd6;
+}
+
+/* Destination of the packet with @launch dropped from @fd, the first one using @fd if unknown */
+static struct Destination *txtime_dest(int fd, nsec_t launch)
+{
+    struct Destination *found = NULL;
+    unsigned int i;
+
+    for (i = 0; i < remote_ctx.n_dests; i++) {
+        struct Destination *d = &remote_ctx.dests[i];
+
+        if (!d->txtime || dest_socket(d) != fd)
+            continue;
+        if (d->txtime_launch == launch)
+            return d;
+        if (!found)
+            found = d;
+    }
+
+    return found;
+}
+
+/* Packets dropped by etf for their launch time, reported with SOF_TXTIME_REPORT_ERRORS */
+static void txtime_errors(int fd)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+        struct cmsghdr align;
+    } control;
+
+    for (;;) {
+        struct msghdr msg = {
+            .msg_control = control.buf,
+            .msg_controllen = sizeof(control.buf),
+        };
+        struct cmsghdr *cmsg;
+
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            return;
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            struct sock_extended_err serr;
+            struct Destination *d;
+
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+                && !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+                continue;
+
+            memcpy(&serr, CMSG_DATA(cmsg), sizeof(serr));
+            if (serr.ee_origin != SO_EE_ORIGIN_TXTIME)
+                continue;
+
+            d = txtime_dest(fd, (nsec_t)serr.ee_data << 32 | serr.ee_info);
+            if (!d)
+                continue;
+
+            if (!d->stats.late)
+                log_warning("%s: packets dropped for %s launch time, raise txtime-lead\n",
+                            d->name,
+                            serr.ee_code == SO_EE_CODE_TXTIME_MISSED ? "a missed" : "an invalid");
+            d->stats.late++;
+            d->stats.failed++;
+        }
+    }
+}
+
+static void ack_handler(int fd, void *data, int ev_mask)
+{
+    struct Destination *d = data;
+    uint8_t buf[512];
+    usec_t now = now_usec();
+    uint16_t seq;
+    ssize_t n;
+
+    /* otherwise reported again right away, as long as the error queue isn't empty */
+    if (ev_mask & EPOLLERR)
+        txtime_errors(fd);
+
+    for (;;) {
+        n = recv(fd, buf, sizeof(buf), 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            /* errors from previous packets are reported here too */
+            if (errno != EAGAIN)
+                send_error(d, errno, now);
+            return;
+        }
+
+        if (ack_parse(d, buf, n, &seq) < 0)
+            d->ack.stats.ignored++;
+        else
+            ack_received(d, seq, now);
+    }
+}
+
+static void ack_sent(struct Destination *d, usec_t now)
+{
+    struct AckState *ack = &d->ack;
+    uint16_t seq = packet_seq(d);
+    struct AckSlot *slot = &ack->window[seq % ACK_WINDOW];
+
+    /*
+     * Faster than the window, mavlink's 8 bit sequence in particular, slots are reused before
+     * the check gets to them: account for the packet now
+     */
+    if (slot->sent_usec && slot->sent_usec >= ack->checked_usec) {
+        ack->evicted_sent++;
+        ack->evicted_acked += slot->acked;
+    }
+
+    *slot = (struct AckSlot) {
+        .sent_usec = now,
+        .seq = seq,
+    };
+}
+
+/*
+ * Loss of the packets sent since the last check up to a period ago, whose echo should have
+ * arrived by now, and adapt the rate to it
+ */
+static void ack_update(struct Destination *d, usec_t now)
+{
+    struct AckState *ack = &d->ack;
+    unsigned long sent, acked, loss;
+    usec_t end = now - ACK_PERIOD_USEC;
+    unsigned int i;
+
+    if (!ack->checked_usec) {
+        ack->checked_usec = now;
+        return;
+    }
+
+    if (now - ack->checked_usec < 2 * ACK_PERIOD_USEC)
+        return;
+
+    sent = ack->evicted_sent;
+    acked = ack->evicted_acked;
+    ack->evicted_sent = ack->evicted_acked = 0;
+
+    for (i = 0; i < ACK_WINDOW; i++) {
+        const struct AckSlot *slot = &ack->window[i];
+
+        if (slot->sent_usec < ack->checked_usec || slot->sent_usec >= end)
+            continue;
+
+        sent++;
+        acked += slot->acked;
+    }
+
+    ack->checked_usec = end;
+    if (!sent)
+        return;
+
+    ack->stats.lost += sent - acked;
+    loss = (sent - acked) * 100 / sent;
+
+    log_debug("%s: %lu%% loss, rtt %" PRIu64 " us, sending one of every %lu packets\n", d->name,
+              loss, ack->srtt, d->divider);
+
+    if (loss > ACK_LOSS_HIGH && !ack->lossy) {
+        log_warning("%s: %lu%% of the packets lost, rtt %" PRIu64 " us\n", d->name, loss,
+                    ack->srtt);
+        ack->lossy = true;
+    } else if (loss < ACK_LOSS_LOW && ack->lossy) {
+        log_info("%s: link recovered, rtt %" PRIu64 " us\n", d->name, ack->srtt);
+        ack->lossy = false;
+    }
+
+    /* fewer packets under loss leave airtime for retransmissions, then slowly back to the rate */
+    if (loss > ACK_LOSS_HIGH && d->divider < ack->max_divider) {
+        d->divider = min(d->divider * 2, ack->max_divider);
+        log_info("%s: reducing rate to one of every %lu packets\n", d->name, d->divider);
+    } else if (loss < ACK_LOSS_LOW && d->divider > ack->min_divider) {
+        d->divider--;
+        log_info("%s: raising rate to one of every %lu packets\n", d->name, d->divider);
+    }
+}
+
+static nsec_t clock_now_nsec(int clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+
+    return (nsec_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* Launch time of the packet just encoded: the next slot of the grid that can still be met */
+static void txtime_update(struct Destination *d)
+{
+    nsec_t now = clock_now_nsec(d->sockopts.txtime_clock);
+    nsec_t launch, earliest = now + d->txtime_lead_nsec;
+    uint64_t txtime;
+
+    /* start the grid on the first packet, and again if the clock was stepped back */
+    if (!d->txtime_anchor
+        || d->txtime_anchor > now + d->txtime_delay_nsec + d->txtime_interval_nsec)
+        d->txtime_anchor = now + d->txtime_delay_nsec;
+
+    launch = d->txtime_anchor;
+    if (earliest > launch) {
+        nsec_t slots = DIV_ROUND_UP(earliest - launch, d->txtime_interval_nsec);
+
+        launch += slots * d->txtime_interval_nsec;
+    }
+
+    txtime = d->txtime_launch = launch;
+    memcpy(d->txtime, &txtime, sizeof(txtime));
+}
+
+static void encode_pkt(struct Destination *d, const int val[], int count,
+                       usec_t timestamp_usec)
+{
+    switch (d->format) {
     case REMOTE_OUTPUT_AP_UDP_SIMPLE:
-        return simple_send_pkt(val, count);
+        d->iov.iov_len = simple_fill_pkt(d, val, count, timestamp_usec);
+        break;
     case REMOTE_OUTPUT_AP_SITL:
-        return sitl_send_pkt(val, count);
+        d->iov.iov_len = sitl_fill_pkt(d, val, count, timestamp_usec);
+        break;
+    case REMOTE_OUTPUT_MAVLINK:
+        d->iov.iov_len = mavlink_fill_pkt(d, val, count, timestamp_usec);
+        break;
     default:
         break;
     }
 }
 
-int remote_init(const char *remote_dest, enum RemoteOutputFormat format)
+static void udp_encode(const int val[], int count, usec_t timestamp_usec)
 {
-    const char *addr;
-    _cleanup_free_ char *buf = NULL;
-    char *p;
-    unsigned long port;
+    unsigned long tick = remote_ctx.tick++;
+    unsigned int i;
 
-    if (!remote_dest) {
-        addr = DEFAULT_DEST;
-        port = DEFAULT_PORT;
+    /* drops of the previous packets, before their launch times are overwritten */
+    if (remote_ctx.sfd4 >= 0 && remote_ctx.sockopts4.txtime_clock >= 0)
+        txtime_errors(remote_ctx.sfd4);
+    if (remote_ctx.sfd6 >= 0 && remote_ctx.sockopts6.txtime_clock >= 0)
+        txtime_errors(remote_ctx.sfd6);
+
+    for (i = 0; i < remote_ctx.n_dests; i++) {
+        struct Destination *d = &remote_ctx.dests[i];
+        struct Destination *owner = d->primary ?: d;
+
+        if (tick % d->divider)
+            continue;
+
+        /* once per tick for the whole group, even if the first one isn't due */
+        if (owner->encoded_tick != tick + 1) {
+            encode_pkt(owner, val, count, timestamp_usec);
+            owner->encoded_tick = tick + 1;
+        }
+        d->iov.iov_len = owner->iov.iov_len;
+
+        if (d->txtime) {
+            if (d->fd >= 0)
+                txtime_errors(d->fd);
+            txtime_update(d);
+        }
+
+        if (d->fd >= 0 || d->send_source) {
+            d->due = true;
+        } else if (d->sockaddr.ss_family == AF_INET) {
+            /* IPv4 from the start of the array, IPv6 from the end */
+            queue_msg(d, remote_ctx.n_msgs4++);
+        } else {
+            queue_msg(d, MAX_DESTINATIONS - ++remote_ctx.n_msgs6);
+        }
+    }
+}
+
+static void send_completed(void *data, int res)
+{
+    struct Destination *d = data;
+
+    if (res < 0)
+        send_error(d, -res, now_usec());
+    else
+        send_sent(d, now_usec());
+}
+
+static void submit_send(struct Destination *d, usec_t now)
+{
+    int r = event_loop_submit_send(d->send_source, &d->hdr);
+
+    /* the previous one still waiting for room in the socket buffer counts as a failure */
+    if (r < 0) {
+        send_error(d, r == -EBUSY ? EAGAIN : -r, now);
+        return;
+    }
+
+    /* acknowledged or counted as lost, whatever the send result */
+    if (d->ack.window)
+        ack_sent(d, now);
+}
+
+static void udp_send(usec_t now)
+{
+    unsigned int i;
+    int r;
+
+    for (i = 0; i < remote_ctx.n_dests; i++) {
+        struct Destination *d = &remote_ctx.dests[i];
+
+        if (d->ack.window)
+            ack_update(d, now);
+
+        if (!d->due)
+            continue;
+
+        d->due = false;
+
+        if (d->send_source) {
+            submit_send(d, now);
+            continue;
+        }
+
+        if (d->ring) {
+            r = packet_ring_send(d->ring, d->iov.iov_base, d->iov.iov_len);
+            if (r < 0) {
+                send_error(d, -r, now);
+            } else {
+                send_sent(d, now);
+                if (d->ack.window)
+                    ack_sent(d, now);
+            }
+            continue;
+        }
+
+        /* connected: no route or neighbour lookup per packet */
+        if (sendmsg(d->fd, &d->hdr, 0) < 0) {
+            send_error(d, errno, now);
+        } else {
+            send_sent(d, now);
+            if (d->ack.window)
+                ack_sent(d, now);
+        }
+    }
+
+    if (remote_ctx.n_msgs4)
+        send_msgs(remote_ctx.sfd4, 0, remote_ctx.n_msgs4, now);
+    if (remote_ctx.n_msgs6)
+        send_msgs(remote_ctx.sfd6, MAX_DESTINATIONS - remote_ctx.n_msgs6, remote_ctx.n_msgs6,
+                  now);
+
+    remote_ctx.n_msgs4 = remote_ctx.n_msgs6 = 0;
+}
+
+static int parse_destination_option(struct Destination *d, const char *opt,
+                                    struct MavlinkIds *ids)
+{
+    const char *value = strchr(opt, '=');
+    unsigned long ul;
+
+    if (!value)
+        return -EINVAL;
+
+    value++;
+
+    if (strneq(opt, "format=", value - opt)) {
+        d->format = remote_output_format_from_str(value);
+        if (d->format == _REMOTE_OUTPUT_UNKNOWN)
+            return -EINVAL;
+    } else if (strneq(opt, "divider=", value - opt)) {
+        if (safe_atoul(value, &d->divider) < 0 || d->divider == 0)
+            return -EINVAL;
+    } else if (strneq(opt, "iface=", value - opt)) {
+        d->ifindex = if_nametoindex(value);
+        if (!d->ifindex)
+            return -ENODEV;
+    } else if (strneq(opt, "dscp=", value - opt)) {
+        if (safe_atoul(value, &ul) < 0 || ul > 63)
+            return -EINVAL;
+        d->sockopts.tos = ul << 2;
+    } else if (strneq(opt, "priority=", value - opt)) {
+        if (safe_atoul(value, &ul) < 0 || ul > INT_MAX)
+            return -EINVAL;
+        d->sockopts.priority = ul;
+    } else if (strneq(opt, "txtime=", value - opt)) {
+        if (strcaseeq(value, "tai"))
+            d->sockopts.txtime_clock = CLOCK_TAI;
+        else if (strcaseeq(value, "monotonic"))
+            d->sockopts.txtime_clock = CLOCK_MONOTONIC;
+        else if (parse_boolean(value) == 0)
+            d->sockopts.txtime_clock = -1;
+        else
+            return -EINVAL;
+    } else if (strneq(opt, "txtime-delay=", value - opt)) {
+        if (safe_atoul(value, &ul) < 0)
+            return -EINVAL;
+        d->txtime_delay_nsec = ul * NSEC_PER_USEC;
+    } else if (strneq(opt, "txtime-interval=", value - opt)) {
+        if (safe_atoul(value, &ul) < 0 || ul == 0)
+            return -EINVAL;
+        d->txtime_interval_nsec = ul * NSEC_PER_USEC;
+    } else if (strneq(opt, "txtime-lead=", value - opt)) {
+        if (safe_atoul(value, &ul) < 0)
+            return -EINVAL;
+        d->txtime_lead_nsec = ul * NSEC_PER_USEC;
+    } else if (strneq(opt, "raw=", value - opt)) {
+        if (parse_mac(value, d->raw_mac) < 0)
+            return -EINVAL;
+        d->raw = true;
+    } else if (strneq(opt, "group=", value - opt)) {
+        if (strlen(value) >= sizeof(d->group))
+            return -EINVAL;
+        strcpy(d->group, value);
+    } else if (strneq(opt, "ack=", value - opt)) {
+        int b = parse_boolean(value);
+
+        if (b < 0)
+            return -EINVAL;
+        d->ack.enabled = b;
+    } else if (strneq(opt, "max-divider=", value - opt)) {
+        if (safe_atoul(value, &d->ack.max_divider) < 0 || d->ack.max_divider == 0)
+            return -EINVAL;
+    } else if (strneq(opt, "sysid=", value - opt)) {
+        if (safe_atoul(value, &ids->sysid) < 0 || ids->sysid > UINT8_MAX)
+            return -EINVAL;
+    } else if (strneq(opt, "compid=", value - opt)) {
+        if (safe_atoul(value, &ids->compid) < 0 || ids->compid > UINT8_MAX)
+            return -EINVAL;
+    } else if (strneq(opt, "target-sysid=", value - opt)) {
+        if (safe_atoul(value, &ids->target_sysid) < 0 || ids->target_sysid > UINT8_MAX)
+            return -EINVAL;
+    } else if (strneq(opt, "target-compid=", value - opt)) {
+        if (safe_atoul(value, &ids->target_compid) < 0 || ids->target_compid > UINT8_MAX)
+            return -EINVAL;
     } else {
-        buf = strdup(remote_dest);
-        p = strchr(buf, ':');
-        if (!p) {
-            port = DEFAULT_PORT;
-        } else if (safe_atoul(p + 1, &port) < 0) {
-            log_error("could not parse address %s\n", remote_dest);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/* HOST, HOST:PORT, [IPV6]:PORT or IPV6 */
+static int split_host_port(char *s, char **host, const char **port)
+{
+    char *p;
+
+    *port = NULL;
+
+    if (s[0] == '[') {
+        p = strchr(s, ']');
+        if (!p || (p[1] != '\0' && p[1] != ':'))
             return -EINVAL;
-        }
+
         *p = '\0';
-        addr = buf;
+        *host = s + 1;
+        if (p[1] == ':')
+            *port = p + 2;
+
+        return 0;
     }
 
-    remote_ctx.sockaddr.sin_family = AF_INET;
-    remote_ctx.sockaddr.sin_addr.s_addr = inet_addr(addr);
-    remote_ctx.sockaddr.sin_port = htons(port);
+    *host = s;
 
-    remote_ctx.sfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
-    if (remote_ctx.sfd == -1) {
+    /* more than one colon is an IPv6 address without port */
+    p = strchr(s, ':');
+    if (p && !strchr(p + 1, ':')) {
+        *p = '\0';
+        *port = p + 1;
+    }
+
+    return 0;
+}
+
+static bool sockaddr_is_multicast(const struct sockaddr *sa)
+{
+    if (sa->sa_family == AF_INET)
+        return IN_MULTICAST(ntohl(((const struct sockaddr_in *)sa)->sin_addr.s_addr));
+
+    return IN6_IS_ADDR_MULTICAST(&((const struct sockaddr_in6 *)sa)->sin6_addr);
+}
+
+static int set_socket_options(int fd, int family, const struct SocketOptions *opts)
+{
+    if (family == AF_INET) {
+        if (setsockopt(fd, IPPROTO_IP, IP_TOS, &opts->tos, sizeof(opts->tos)) < 0)
+            return -errno;
+    } else {
+        if (setsockopt(fd, IPPROTO_IPV6, IPV6_TCLASS, &opts->tos, sizeof(opts->tos)) < 0)
+            return -errno;
+    }
+
+    /* queueing discipline band and, for Wi-Fi, access category when not derived from the TOS */
+    if (setsockopt(fd, SOL_SOCKET, SO_PRIORITY, &opts->priority, sizeof(opts->priority)) < 0)
+        return -errno;
+
+    if (opts->txtime_clock >= 0) {
+        const struct sock_txtime txtime = {
+            .clockid = opts->txtime_clock,
+            .flags = SOF_TXTIME_REPORT_ERRORS,
+        };
+
+        if (setsockopt(fd, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime)) < 0)
+            return -errno;
+    }
+
+    return 0;
+}
+
+static int shared_socket(int family, const struct SocketOptions *opts)
+{
+    int *fd = family == AF_INET ? &remote_ctx.sfd4 : &remote_ctx.sfd6;
+    struct SocketOptions *shared = family == AF_INET ? &remote_ctx.sockopts4
+                                                     : &remote_ctx.sockopts6;
+    int r;
+
+    if (*fd >= 0) {
+        if (memcmp(shared, opts, sizeof(*opts)) != 0) {
+            log_error("multicast destinations of the same address family must use the same dscp, "
+                      "priority and txtime\n");
+            return -EINVAL;
+        }
+        return *fd;
+    }
+
+    *fd = socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (*fd < 0) {
         log_error("could not create socket: %m\n");
         return -errno;
     }
 
-    if (format == REMOTE_OUTPUT_AP_UDP_SIMPLE)
-        remote_ctx.pkt.version = RCINPUT_UDP_VERSION;
+    r = set_socket_options(*fd, family, opts);
+    if (r < 0) {
+        log_error("could not set socket options: %s\n", strerror(-r));
+        close(*fd);
+        *fd = -1;
+        return r;
+    }
+
+    *shared = *opts;
+
+    return *fd;
+}
+
+static int connect_destination(struct Destination *d, const struct addrinfo *ai)
+{
+    int fd, r;
+
+    fd = socket(ai->ai_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -errno;
+
+    r = set_socket_options(fd, ai->ai_family, &d->sockopts);
+    if (r < 0) {
+        log_error("could not set socket options: %s\n", strerror(-r));
+        close(fd);
+        return r;
+    }
+
+    if (d->ifindex) {
+        char ifname[IF_NAMESIZE];
+
+        if (!if_indextoname(d->ifindex, ifname)
+            || setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, ifname, strlen(ifname)) < 0)
+            goto fail;
+    }
+
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0)
+        goto fail;
+
+    return fd;
+
+fail:
+    close(fd);
+    return -errno;
+}
+
+static void pktinfo_init(struct Destination *d, struct cmsghdr *cmsg)
+{
+    if (d->sockaddr.ss_family == AF_INET) {
+        struct in_pktinfo *pktinfo = (struct in_pktinfo *)CMSG_DATA(cmsg);
+
+        cmsg->cmsg_level = IPPROTO_IP;
+        cmsg->cmsg_type = IP_PKTINFO;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(*pktinfo));
+        pktinfo->ipi_ifindex = d->ifindex;
+    } else {
+        struct in6_pktinfo *pktinfo = (struct in6_pktinfo *)CMSG_DATA(cmsg);
+
+        cmsg->cmsg_level = IPPROTO_IPV6;
+        cmsg->cmsg_type = IPV6_PKTINFO;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(*pktinfo));
+        pktinfo->ipi6_ifindex = d->ifindex;
+    }
+}
+
+/* Ancillary data sent with each packet: outgoing interface for multicast, then launch time */
+static void control_init(struct Destination *d)
+{
+    struct msghdr hdr = {
+        .msg_control = d->control.buf,
+        .msg_controllen = sizeof(d->control.buf),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+
+    memset(&d->control, 0, sizeof(d->control));
+    d->controllen = 0;
+    d->txtime = NULL;
 
-    remote_ctx.format = format;
+    if (d->fd < 0 && d->ifindex) {
+        pktinfo_init(d, cmsg);
+        d->controllen += CMSG_SPACE(cmsg->cmsg_len - CMSG_LEN(0));
+        cmsg = CMSG_NXTHDR(&hdr, cmsg);
+    }
+
+    if (d->sockopts.txtime_clock >= 0) {
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_TXTIME;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+        d->txtime = CMSG_DATA(cmsg);
+        d->controllen += CMSG_SPACE(sizeof(uint64_t));
+    }
+}
+
+static int resolve_destination(struct Destination *d, const char *host, const char *port)
+{
+    const struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_DGRAM,
+        .ai_flags = AI_ADDRCONFIG | AI_NUMERICSERV,
+    };
+    struct addrinfo *res, *ai;
+    char addr[INET6_ADDRSTRLEN], serv[sizeof("65535")];
+    int r;
+
+    r = getaddrinfo(host, port, &hints, &res);
+    if (r != 0) {
+        log_error("could not resolve %s: %s\n", host,
+                  r == EAI_SYSTEM ? strerror(errno) : gai_strerror(r));
+        return -EHOSTUNREACH;
+    }
+
+    /* multicast goes through the shared socket, unicast to the first address that connects */
+    r = -EHOSTUNREACH;
+    for (ai = res; ai; ai = ai->ai_next) {
+        if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+            continue;
+
+        if (sockaddr_is_multicast(ai->ai_addr)) {
+            r = shared_socket(ai->ai_family, &d->sockopts);
+            d->fd = -1;
+        } else {
+            r = connect_destination(d, ai);
+            d->fd = r;
+        }
+
+        if (r >= 0) {
+            memcpy(&d->sockaddr, ai->ai_addr, ai->ai_addrlen);
+            d->sockaddr_len = ai->ai_addrlen;
+            break;
+        }
+    }
+
+    freeaddrinfo(res);
+
+    if (r < 0) {
+        log_error("could not connect to %s: %s\n", host, strerror(-r));
+        return r;
+    }
+
+    getnameinfo((struct sockaddr *)&d->sockaddr, d->sockaddr_len, addr, sizeof(addr), serv,
+                sizeof(serv), NI_NUMERICHOST | NI_NUMERICSERV);
+    snprintf(d->name, sizeof(d->name), d->sockaddr.ss_family == AF_INET6 ? "[%s]:%s" : "%s:%s",
+             addr, serv);
+
+    /* paths of a group may only differ by interface */
+    if (d->ifindex) {
+        char ifname[IF_NAMESIZE];
+
+        if (if_indextoname(d->ifindex, ifname))
+            snprintf(d->name + strlen(d->name), sizeof(d->name) - strlen(d->name), " via %s",
+                     ifname);
+    }
+
+    control_init(d);
 
     return 0;
 }
 
-void remote_shutdown(void)
+/* Join the group of a previous destination, that sends the packets for all of them */
+static int group_join(struct Destination *d)
 {
-    if (remote_ctx.sfd < 0)
-        return;
+    unsigned int i;
+
+    for (i = 0; i < remote_ctx.n_dests; i++) {
+        struct Destination *p = &remote_ctx.dests[i];
 
-    close(remote_ctx.sfd);
+        if (p->primary || !streq(p->group, d->group))
+            continue;
+
+        if (p->format != d->format) {
+            log_error("destinations of group %s must use the same format\n", d->group);
+            return -EINVAL;
+        }
+
+        d->primary = p;
+        break;
+    }
+
+    return 0;
+}
+
+static int raw_init(struct Destination *d)
+{
+    struct sockaddr_in src;
+    socklen_t len = sizeof(src);
+    int r;
+
+    if (d->fd < 0 || d->sockaddr.ss_family != AF_INET) {
+        log_error("raw needs a unicast IPv4 destination\n");
+        return -EINVAL;
+    }
+
+    /* address and port picked by the kernel for the socket, that receives the replies */
+    if (getsockname(d->fd, (struct sockaddr *)&src, &len) < 0)
+        return -errno;
+
+    d->ring = malloc(sizeof(*d->ring));
+    if (!d->ring)
+        return -ENOMEM;
+
+    r = packet_ring_init(d->ring, d->ifindex, d->raw_mac, &src,
+                         (const struct sockaddr_in *)&d->sockaddr, d->sockopts.tos,
+                         d->sockopts.priority);
+    if (r < 0) {
+        log_error("%s: could not set up packet ring: %s\n", d->name, strerror(-r));
+        free(d->ring);
+        d->ring = NULL;
+        return r;
+    }
+
+    return 0;
 }
+
+static int ack_init(struct Destination *d)
+{
+    struct AckState *ack = &d->ack;
+
+    /* echoes can't be told apart on a multicast socket */
+    if (d->fd < 0) {
+        log_error("ack needs a unicast destination\n");
+        return -EINVAL;
+    }
+
+    ack->window = calloc(ACK_WINDOW, sizeof(*ack->window));
+    if (!ack->window)
+        return -ENOMEM;
+
+    ack->seq_mask = d->format == REMOTE_OUTPUT_MAVLINK ? UINT8_MAX : UINT16_MAX;
+    ack->min_divider = d->divider;
+    ack->max_divider = max(ack->max_divider, d->divider);
+
+    d->ack_source = event_loop_add_source(d->fd, d, EPOLLIN, ack_handler);
+    if (!d->ack_source) {
+        free(ack->window);
+        ack->window = NULL;
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+/*
+ * HOST[:PORT][,OPTION=VALUE...]. Options: format, divider, iface, group, dscp, priority, txtime,
+ * txtime-delay, txtime-interval, txtime-lead, raw, ack, max-divider and, for mavlink, sysid,
+ * compid, target-sysid and target-compid
+ */
+static int parse_destination(struct Destination *d, char *s,
+                             const struct OutputDefaults *defaults)
+{
+    struct MavlinkIds ids = {
+        .sysid = MAVLINK_DEFAULT_SYSID,
+        .compid = MAVLINK_DEFAULT_COMPID,
+        .target_sysid = MAVLINK_DEFAULT_TARGET_SYSID,
+        .target_compid = MAVLINK_DEFAULT_TARGET_COMPID,
+    };
+    char *saveptr, *addr, *opt, *host;
+    const char *port;
+    unsigned long ul;
+    int r;
+
+    d->fd = -1;
+    d->format = defaults->format;
+    d->divider = 1;
+    d->sockopts.tos = DEFAULT_DSCP << 2;
+    d->sockopts.priority = DEFAULT_PRIORITY;
+    d->sockopts.txtime_clock = -1;
+    d->txtime_delay_nsec = TXTIME_DEFAULT_DELAY_USEC * NSEC_PER_USEC;
+    d->txtime_lead_nsec = TXTIME_DEFAULT_LEAD_USEC * NSEC_PER_USEC;
+    d->txtime_interval_nsec = defaults->update_interval_usec * NSEC_PER_USEC;
+
+    addr = strtok_r(s, ",", &saveptr);
+    if (!addr)
+        return -EINVAL;
+
+    r = split_host_port(addr, &host, &port);
+    if (r < 0)
+        return r;
+
+    if (!port)
+        port = DEFAULT_PORT;
+    else if (safe_atoul(port, &ul) < 0 || ul == 0 || ul > UINT16_MAX)
+        return -EINVAL;
+
+    while ((opt = strtok_r(NULL, ",", &saveptr))) {
+        r = parse_destination_option(d, opt, &ids);
+        if (r < 0)
+            return r;
+    }
+
+    /* a longer delay would only pick an earlier slot of the grid */
+    if (d->sockopts.txtime_clock >= 0 && d->txtime_delay_nsec >= d->txtime_interval_nsec) {
+        log_error("txtime-delay must be shorter than txtime-interval\n");
+        return -EINVAL;
+    }
+
+    if (d->sockopts.txtime_clock >= 0 && d->txtime_lead_nsec >= d->txtime_interval_nsec) {
+        log_error("txtime-lead must be shorter than txtime-interval\n");
+        return -EINVAL;
+    }
+
+    if (d->sockopts.txtime_clock >= 0 && d->txtime_lead_nsec > d->txtime_delay_nsec)
+        log_warning("txtime-lead longer than txtime-delay: packets go one slot later\n");
+
+    /* frames are built for a single link, and launch times go through the queueing discipline */
+    if (d->raw && (!d->ifindex || d->sockopts.txtime_clock >= 0)) {
+        log_error("raw needs iface and can't be used with txtime\n");
+        return -EINVAL;
+    }
+
+    if (d->ack.enabled && d->format == REMOTE_OUTPUT_AP_SITL) {
+        log_error("ack needs a format with sequence numbers\n");
+        return -EINVAL;
+    }
+
+    if (d->group[0]) {
+        r = group_join(d);
+        if (r < 0)
+            return r;
+    }
+
+    r = resolve_destination(d, host, port);
+    if (r < 0)
+        return r;
+
+    if (d->raw) {
+        r = raw_init(d);
+        if (r < 0) {
+            if (d->fd >= 0)
+                close(d->fd);
+            d->fd = -1;
+            return r;
+        }
+    }
+
+    if (d->ack.enabled) {
+        r = ack_init(d);
+        if (r < 0) {
+            if (d->ring) {
+                packet_ring_close(d->ring);
+                free(d->ring);
+                d->ring = NULL;
+            }
+            if (d->fd >= 0)
+                close(d->fd);
+            d->fd = -1;
+            return r;
+        }
+    }
+
+    switch (d->format) {
+    case REMOTE_OUTPUT_AP_UDP_SIMPLE:
+        d->pkt.version = RCINPUT_UDP_VERSION;
+        d->iov.iov_base = &d->pkt;
+        break;
+    case REMOTE_OUTPUT_AP_SITL:
+        d->iov.iov_base = &d->sitl_pkt;
+        break;
+    case REMOTE_OUTPUT_MAVLINK:
+        mavlink_pkt_init(d, &ids);
+        d->iov.iov_base = &d->mav_pkt;
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    if (d->primary)
+        d->iov.iov_base = d->primary->iov.iov_base;
+
+    log_info("Sending %s to %s%s%s\n", format_names[d->format], d->name,
+             d->fd < 0 ? " (multicast)" : "", d->divider > 1 ? ", reduced rate" : "");
+    if (d->primary)
+        log_info("%s: same packets as %s\n", d->name, d->primary->name);
+    if (d->ring)
+        log_info("%s: raw frames to %02x:%02x:%02x:%02x:%02x:%02x\n", d->name, d->raw_mac[0],
+                 d->raw_mac[1], d->raw_mac[2], d->raw_mac[3], d->raw_mac[4], d->raw_mac[5]);
+    if (d->txtime)
+        log_info("%s: launch times %" PRIu64 " us after each packet, on a %" PRIu64 " us grid\n",
+                 d->name, d->txtime_delay_nsec / NSEC_PER_USEC,
+                 d->txtime_interval_nsec / NSEC_PER_USEC);
+
+    return 0;
+}
+
+static bool udp_match(const char *spec)
+{
+    return true;
+}
+
+static int udp_init(char *spec, const struct OutputDefaults *defaults)
+{
+    struct Destination *d = &remote_ctx.dests[remote_ctx.n_dests];
+    int r;
+
+    if (remote_ctx.n_dests >= MAX_DESTINATIONS) {
+        log_error("too many destinations, maximum is %d\n", MAX_DESTINATIONS);
+        return -EINVAL;
+    }
+
+    if (!remote_ctx.n_dests)
+        mavlink_crc_init();
+
+    memset(d, 0, sizeof(*d));
+    r = parse_destination(d, spec, defaults);
+    if (r < 0)
+        return r;
+
+    remote_ctx.n_dests++;
+
+    d->hdr = (struct msghdr) {
+        .msg_iov = &d->iov,
+        .msg_iovlen = 1,
+        .msg_control = d->controllen ? d->control.buf : NULL,
+        .msg_controllen = d->controllen,
+    };
+
+    if (d->fd < 0) {
+        d->hdr.msg_name = &d->sockaddr;
+        d->hdr.msg_namelen = d->sockaddr_len;
+    }
+
+    /* multicast too: each destination is a send of its own, all submitted together */
+    if (!d->ring) {
+        int fd = d->fd >= 0 ? d->fd
+                            : d->sockaddr.ss_family == AF_INET ? remote_ctx.sfd4 : remote_ctx.sfd6;
+
+        d->send_source = event_loop_add_send_source(fd, d, send_completed);
+    }
+
+    return 0;
+}
+
+static void udp_stats(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < remote_ctx.n_dests; i++) {
+        struct Destination *d = &remote_ctx.dests[i];
+
+        log_info("%s: %lu packets sent, %lu failed\n", d->name, d->stats.sent,
+                 d->stats.failed);
+        if (d->stats.late)
+            log_info("%s: %lu packets dropped for their launch time\n", d->name, d->stats.late);
+
+        if (d->ack.window) {
+            char name[sizeof(d->name) + sizeof(" rtt")];
+
+            log_info("%s: %lu packets acknowledged, %lu lost, %lu reordered, %lu ignored\n",
+                     d->name, d->ack.stats.acked, d->ack.stats.lost, d->ack.stats.reordered,
+                     d->ack.stats.ignored);
+            snprintf(name, sizeof(name), "%s rtt", d->name);
+            histogram_log(&d->ack.stats.rtt, name);
+        }
+    }
+}
+
+static void udp_shutdown(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < remote_ctx.n_dests; i++) {
+        struct Destination *d = &remote_ctx.dests[i];
+
+        if (d->send_source)
+            event_loop_remove_send_source(d->send_source);
+
+        if (d->ring) {
+            packet_ring_close(d->ring);
+            free(d->ring);
+        }
+
+        if (d->ack_source)
+            event_loop_remove_source(d->ack_source);
+
+        free(d->ack.window);
+
+        if (d->fd >= 0)
+            close(d->fd);
+    }
+
+    remote_ctx.n_dests = 0;
+
+    if (remote_ctx.sfd4 >= 0)
+        close(remote_ctx.sfd4);
+    if (remote_ctx.sfd6 >= 0)
+        close(remote_ctx.sfd6);
+
+    remote_ctx.sfd4 = remote_ctx.sfd6 = -1;
+}
+
+const struct OutputBackend udp_output_backend = {
+    .name = "udp",
+    .network = true,
+    .match = udp_match,
+    .init = udp_init,
+    .encode = udp_encode,
+    .send = udp_send,
+    .stats = udp_stats,
+    .shutdown = udp_shutdown,
+};
@@ -3,13 +3,16 @@
 
 #pragma once
 
+#include "util.h"
+
 enum RemoteOutputFormat {
     REMOTE_OUTPUT_AP_UDP_SIMPLE,
     REMOTE_OUTPUT_AP_SITL,
+    REMOTE_OUTPUT_MAVLINK,
     _REMOTE_OUTPUT_UNKNOWN,
 };
 
-int remote_init(const char *remote_dest, enum RemoteOutputFormat format);
-void remote_shutdown(void);
+enum RemoteOutputFormat remote_output_format_from_str(const char *s);
 
-void remote_send_pkt(const int val[], int count);
+/* Network destinations: HOST[:PORT][,OPTION=VALUE...] */
+extern const struct OutputBackend udp_output_backend;
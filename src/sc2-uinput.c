@@ -0,0 +1,690 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+/* Copyright (c) 2020 Lucas De Marchi <lucas.de.marchi@gmail.com> */
+
+/*
+ * Synthetic SkyController 2: a uinput device with the same axis and buttons, driven by generated
+ * or scripted patterns. Used to exercise dema-rc without the hardware and as a load generator.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <linux/uinput.h>
+#include <math.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "util.h"
+
+#define AXIS_MIN -32767
+#define AXIS_MAX 32767
+#define AXIS_FLAT 0
+#define AXIS_FUZZ 0
+
+#define DEFAULT_RATE_HZ 100
+#define MAX_RATE_HZ 20000
+/* time for udev and dema-rc to notice the new device before events start */
+#define DEFAULT_SETTLE_MSEC 1000
+
+#define EVDEV_CODE(type_, code_) { .type = type_, .code = code_, .name = #code_ }
+
+struct EvdevCode {
+    unsigned int type;
+    unsigned int code;
+    const char *name;
+};
+
+/* clang-format off */
+/* same codes the SkyController 2 map in controller.c expects */
+static const struct EvdevCode sc2_axis[] = {
+    EVDEV_CODE(EV_ABS, ABS_X),
+    EVDEV_CODE(EV_ABS, ABS_Y),
+    EVDEV_CODE(EV_ABS, ABS_Z),
+    EVDEV_CODE(EV_ABS, ABS_RX),
+    EVDEV_CODE(EV_ABS, ABS_RY),
+};
+
+static const struct EvdevCode sc2_buttons[] = {
+    EVDEV_CODE(EV_KEY, BTN_TRIGGER),
+    EVDEV_CODE(EV_KEY, BTN_THUMB),
+    EVDEV_CODE(EV_KEY, BTN_THUMB2),
+    EVDEV_CODE(EV_KEY, BTN_TOP),
+    EVDEV_CODE(EV_KEY, BTN_TOP2),
+    EVDEV_CODE(EV_KEY, BTN_PINKIE),
+    EVDEV_CODE(EV_KEY, BTN_BASE),
+    EVDEV_CODE(EV_KEY, BTN_BASE3),
+    EVDEV_CODE(EV_KEY, BTN_BASE4),
+    EVDEV_CODE(EV_KEY, BTN_BASE5),
+    EVDEV_CODE(EV_KEY, BTN_BASE6),
+};
+/* clang-format on */
+
+enum Pattern {
+    PATTERN_SINE,
+    PATTERN_TRIANGLE,
+    PATTERN_STEP,
+    PATTERN_RANDOM,
+    PATTERN_SCRIPT,
+    _PATTERN_UNKNOWN = -1,
+};
+
+static const char *const pattern_names[] = {
+    [PATTERN_SINE] = "sine",
+    [PATTERN_TRIANGLE] = "triangle",
+    [PATTERN_STEP] = "step",
+    [PATTERN_RANDOM] = "random",
+    [PATTERN_SCRIPT] = "script",
+};
+
+struct ScriptLine {
+    usec_t ts;
+    unsigned int n;
+    struct input_event events[ARRAY_SIZE(sc2_axis) + ARRAY_SIZE(sc2_buttons)];
+};
+
+static struct {
+    enum Pattern pattern;
+    unsigned long rate_hz;
+    double freq_hz;
+    unsigned long duration_msec;
+    unsigned long settle_msec;
+    unsigned long button_interval_msec;
+    unsigned int seed;
+    bool loop;
+    const char *script_file;
+    const char *name;
+} args = {
+    .pattern = PATTERN_SINE,
+    .rate_hz = DEFAULT_RATE_HZ,
+    .freq_hz = 1.0,
+    .settle_msec = DEFAULT_SETTLE_MSEC,
+    .name = "dema-rc synthetic SkyController 2",
+};
+
+static struct {
+    unsigned long frames;
+    unsigned long events;
+    /* frames that started after the next one was due */
+    unsigned long overruns;
+    usec_t max_late_usec;
+} stats;
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int signo)
+{
+    stop = 1;
+}
+
+static enum Pattern pattern_from_str(const char *s)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(pattern_names); i++)
+        if (strcaseeq(s, pattern_names[i]))
+            return i;
+
+    return _PATTERN_UNKNOWN;
+}
+
+static const struct EvdevCode *code_from_str(const char *s)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(sc2_axis); i++)
+        if (strcaseeq(s, sc2_axis[i].name))
+            return &sc2_axis[i];
+
+    for (i = 0; i < ARRAY_SIZE(sc2_buttons); i++)
+        if (strcaseeq(s, sc2_buttons[i].name))
+            return &sc2_buttons[i];
+
+    return NULL;
+}
+
+static int uinput_create(void)
+{
+    struct uinput_setup setup = {
+        .id = {
+            .bustype = BUS_VIRTUAL,
+            .vendor = 0x19cf, /* Parrot */
+            .product = 0x0001,
+            .version = 1,
+        },
+    };
+    size_t i;
+    int fd, r;
+
+    fd = open("/dev/uinput", O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        r = -errno;
+        log_error("Could not open /dev/uinput: %m\n");
+        return r;
+    }
+
+    if (ioctl(fd, UI_SET_EVBIT, EV_SYN) < 0 || ioctl(fd, UI_SET_EVBIT, EV_ABS) < 0
+        || ioctl(fd, UI_SET_EVBIT, EV_KEY) < 0)
+        goto fail;
+
+    for (i = 0; i < ARRAY_SIZE(sc2_axis); i++) {
+        struct uinput_abs_setup abs = {
+            .code = sc2_axis[i].code,
+            .absinfo = {
+                .value = (AXIS_MIN + AXIS_MAX) / 2,
+                .minimum = AXIS_MIN,
+                .maximum = AXIS_MAX,
+                .fuzz = AXIS_FUZZ,
+                .flat = AXIS_FLAT,
+            },
+        };
+
+        if (ioctl(fd, UI_SET_ABSBIT, sc2_axis[i].code) < 0 || ioctl(fd, UI_ABS_SETUP, &abs) < 0)
+            goto fail;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(sc2_buttons); i++)
+        if (ioctl(fd, UI_SET_KEYBIT, sc2_buttons[i].code) < 0)
+            goto fail;
+
+    snprintf(setup.name, sizeof(setup.name), "%s", args.name);
+
+    if (ioctl(fd, UI_DEV_SETUP, &setup) < 0 || ioctl(fd, UI_DEV_CREATE) < 0)
+        goto fail;
+
+    return fd;
+
+fail:
+    r = -errno;
+    log_error("Could not set up uinput device: %m\n");
+    close(fd);
+    return r;
+}
+
+/* uinput devices get no by-id link: find the event node in sysfs, e.g. /dev/input/event7 */
+static int uinput_event_node(int fd, char *node, size_t len)
+{
+    char sysname[64], dir[128];
+    struct dirent *de;
+    DIR *d;
+    int r = -ENOENT;
+
+    if (ioctl(fd, UI_GET_SYSNAME(sizeof(sysname)), sysname) < 0)
+        return -errno;
+
+    snprintf(dir, sizeof(dir), "/sys/devices/virtual/input/%s", sysname);
+    d = opendir(dir);
+    if (!d)
+        return -errno;
+
+    while ((de = readdir(d))) {
+        if (strncmp(de->d_name, "event", strlen("event")) == 0) {
+            snprintf(node, len, "/dev/input/%s", de->d_name);
+            r = 0;
+            break;
+        }
+    }
+
+    closedir(d);
+
+    return r;
+}
+
+static void uinput_destroy(int fd)
+{
+    ioctl(fd, UI_DEV_DESTROY);
+    close(fd);
+}
+
+static int uinput_write(int fd, struct input_event *events, unsigned int n)
+{
+    struct input_event *syn = &events[n++];
+    size_t len = n * sizeof(*events);
+    ssize_t r;
+
+    *syn = (struct input_event) { .type = EV_SYN, .code = SYN_REPORT };
+
+    r = write(fd, events, len);
+    if (r < 0) {
+        r = -errno;
+        log_error("Could not write events: %m\n");
+        return r;
+    }
+    if ((size_t)r != len) {
+        log_error("Short write: %zd of %zu bytes\n", r, len);
+        return -EIO;
+    }
+
+    stats.frames++;
+    stats.events += n;
+
+    return 0;
+}
+
+static int axis_from_phase(double phase)
+{
+    double v;
+
+    switch (args.pattern) {
+    case PATTERN_SINE:
+        v = sin(2 * M_PI * phase);
+        break;
+    case PATTERN_TRIANGLE:
+        phase -= floor(phase);
+        v = phase < 0.5 ? 4 * phase - 1 : 3 - 4 * phase;
+        break;
+    case PATTERN_STEP:
+        phase -= floor(phase);
+        v = phase < 0.5 ? -1 : 1;
+        break;
+    default:
+        v = 0;
+        break;
+    }
+
+    return AXIS_MIN + (int)lround((v + 1) / 2 * (AXIS_MAX - AXIS_MIN));
+}
+
+/* Fill a frame with all axis and, from time to time, a button press or release */
+static unsigned int pattern_frame(struct input_event *events, unsigned long frame, usec_t t)
+{
+    static int walk[ARRAY_SIZE(sc2_axis)];
+    unsigned int n = 0;
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(sc2_axis); i++) {
+        int value;
+
+        if (args.pattern == PATTERN_RANDOM) {
+            /* random walk: mostly small moves like a real stick, so fuzz doesn't hide them */
+            int step = (AXIS_MAX - AXIS_MIN) / 64;
+
+            walk[i] += rand() % (2 * step + 1) - step;
+            walk[i] = constrain(walk[i], AXIS_MIN, AXIS_MAX);
+            value = walk[i];
+        } else {
+            /* each axis out of phase so they don't all move together */
+            double phase = args.freq_hz * t / USEC_PER_SEC + (double)i / ARRAY_SIZE(sc2_axis);
+
+            value = axis_from_phase(phase);
+        }
+
+        events[n++] = (struct input_event) {
+            .type = EV_ABS,
+            .code = sc2_axis[i].code,
+            .value = value,
+        };
+    }
+
+    if (args.button_interval_msec) {
+        unsigned long frames_per_press = max(args.button_interval_msec * args.rate_hz / 1000, 1UL);
+
+        if (frame % frames_per_press == 0) {
+            unsigned long press = frame / frames_per_press;
+
+            events[n++] = (struct input_event) {
+                .type = EV_KEY,
+                .code = sc2_buttons[(press / 2) % ARRAY_SIZE(sc2_buttons)].code,
+                .value = !(press % 2),
+            };
+        }
+    }
+
+    return n;
+}
+
+/*
+ * Script format, one frame per line: time in milliseconds from start followed by CODE=VALUE
+ * pairs, e.g. "100 ABS_X=0 BTN_TOP=1". Empty lines and lines starting with '#' are ignored
+ */
+static int script_load(const char *path, struct ScriptLine **linesp, size_t *nlinesp)
+{
+    _cleanup_free_ char *buf = NULL;
+    struct ScriptLine *lines = NULL;
+    size_t nlines = 0, bufsize = 0;
+    unsigned int lineno = 0;
+    FILE *fp;
+    int r = 0;
+
+    fp = fopen(path, "re");
+    if (!fp) {
+        r = -errno;
+        log_error("Could not open script %s: %m\n", path);
+        return r;
+    }
+
+    while (getline(&buf, &bufsize, fp) >= 0) {
+        struct ScriptLine *l, *tmp;
+        char *tok, *saveptr;
+        unsigned long msec;
+
+        lineno++;
+
+        tok = strtok_r(buf, " \t\n", &saveptr);
+        if (!tok || tok[0] == '#')
+            continue;
+
+        tmp = realloc(lines, (nlines + 1) * sizeof(*lines));
+        if (!tmp) {
+            r = -ENOMEM;
+            goto out;
+        }
+        lines = tmp;
+        l = &lines[nlines];
+        memset(l, 0, sizeof(*l));
+
+        if (safe_atoul(tok, &msec) < 0 || (nlines && msec * USEC_PER_MSEC < l[-1].ts)) {
+            log_error("%s:%u: invalid time '%s'\n", path, lineno, tok);
+            r = -EINVAL;
+            goto out;
+        }
+        l->ts = msec * USEC_PER_MSEC;
+
+        while ((tok = strtok_r(NULL, " \t\n", &saveptr))) {
+            const struct EvdevCode *code;
+            char *eq = strchr(tok, '=');
+            int value;
+
+            if (eq)
+                *eq = '\0';
+
+            code = code_from_str(tok);
+            if (!eq || !code || safe_atoi(eq + 1, &value) < 0
+                || l->n >= ARRAY_SIZE(l->events)) {
+                log_error("%s:%u: invalid event '%s'\n", path, lineno, tok);
+                r = -EINVAL;
+                goto out;
+            }
+
+            l->events[l->n++] = (struct input_event) {
+                .type = code->type,
+                .code = code->code,
+                .value = value,
+            };
+        }
+
+        nlines++;
+    }
+
+    if (nlines == 0) {
+        log_error("%s: no events\n", path);
+        r = -EINVAL;
+    }
+
+out:
+    fclose(fp);
+
+    if (r < 0) {
+        free(lines);
+        return r;
+    }
+
+    *linesp = lines;
+    *nlinesp = nlines;
+
+    return 0;
+}
+
+static void sleep_until(usec_t t)
+{
+    struct timespec ts = {
+        .tv_sec = t / USEC_PER_SEC,
+        .tv_nsec = (t % USEC_PER_SEC) * NSEC_PER_USEC,
+    };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && !stop)
+        ;
+}
+
+static void account_late(usec_t due, usec_t period)
+{
+    usec_t now = now_usec();
+
+    if (now <= due)
+        return;
+
+    stats.max_late_usec = max(stats.max_late_usec, now - due);
+    if (now - due >= period)
+        stats.overruns++;
+}
+
+static int run_script(int fd, const struct ScriptLine *lines, size_t nlines)
+{
+    struct input_event events[ARRAY_SIZE(lines->events) + 1];
+    usec_t start;
+    size_t i;
+    int r;
+
+    do {
+        start = now_usec();
+
+        for (i = 0; i < nlines && !stop; i++) {
+            usec_t due = start + lines[i].ts;
+
+            sleep_until(due);
+            account_late(due, USEC_PER_MSEC);
+
+            memcpy(events, lines[i].events, lines[i].n * sizeof(*events));
+            r = uinput_write(fd, events, lines[i].n);
+            if (r < 0)
+                return r;
+        }
+    } while (args.loop && !stop);
+
+    return 0;
+}
+
+static int run_pattern(int fd)
+{
+    struct input_event events[ARRAY_SIZE(sc2_axis) + ARRAY_SIZE(sc2_buttons) + 1];
+    usec_t period = USEC_PER_SEC / args.rate_hz;
+    usec_t start = now_usec(), end = USEC_INFINITY;
+    unsigned long frame;
+    int r;
+
+    if (args.duration_msec)
+        end = start + args.duration_msec * USEC_PER_MSEC;
+
+    for (frame = 0; !stop; frame++) {
+        /* absolute deadlines, so the rate doesn't drift with the time spent writing */
+        usec_t due = start + frame * USEC_PER_SEC / args.rate_hz;
+        unsigned int n;
+
+        if (due >= end)
+            break;
+
+        sleep_until(due);
+        account_late(due, period);
+
+        n = pattern_frame(events, frame, due - start);
+        r = uinput_write(fd, events, n);
+        if (r < 0)
+            return r;
+    }
+
+    return 0;
+}
+
+static void help(FILE *fp)
+{
+    fprintf(fp,
+            "%s [OPTIONS...]\n\n"
+            "Create a synthetic SkyController 2 input device and drive it with a pattern\n\n"
+            "optional arguments:\n"
+            " -h --help                 Print this message\n"
+            " -v --verbose              Print debug messages\n"
+            " -p --pattern PATTERN      One of: sine, triangle, step, random, script\n"
+            "                           (default: sine)\n"
+            " -r --rate HZ              Frames per second (default: %d, maximum: %d)\n"
+            " -f --frequency HZ         Frequency of the sine, triangle and step patterns\n"
+            "                           (default: 1)\n"
+            " -d --duration MSEC        Stop after this time (default: run until interrupted)\n"
+            " -b --buttons MSEC         Press or release a button at this interval\n"
+            " -s --script FILE          Frames to send, for the script pattern\n"
+            " -l --loop                 Restart the script when it ends\n"
+            " --seed N                  Seed for the random pattern\n"
+            " --settle MSEC             Wait before sending events (default: %d)\n"
+            " --name NAME               Name of the input device\n",
+            program_invocation_short_name, DEFAULT_RATE_HZ, MAX_RATE_HZ, DEFAULT_SETTLE_MSEC);
+}
+
+static int parse_args(int argc, char *argv[])
+{
+    enum {
+        ARG_SEED = 0x100,
+        ARG_SETTLE,
+        ARG_NAME,
+    };
+    static const struct option long_options[] = {
+        {"help", no_argument, NULL, 'h'},
+        {"verbose", no_argument, NULL, 'v'},
+        {"pattern", required_argument, NULL, 'p'},
+        {"rate", required_argument, NULL, 'r'},
+        {"frequency", required_argument, NULL, 'f'},
+        {"duration", required_argument, NULL, 'd'},
+        {"buttons", required_argument, NULL, 'b'},
+        {"script", required_argument, NULL, 's'},
+        {"loop", no_argument, NULL, 'l'},
+        {"seed", required_argument, NULL, ARG_SEED},
+        {"settle", required_argument, NULL, ARG_SETTLE},
+        {"name", required_argument, NULL, ARG_NAME},
+        {},
+    };
+    static const char *short_options = "hvp:r:f:d:b:s:l";
+    unsigned long ul;
+    char *end;
+    int c;
+
+    while ((c = getopt_long(argc, argv, short_options, long_options, NULL)) >= 0) {
+        switch (c) {
+        case 'h':
+            help(stdout);
+            return 0;
+        case 'v':
+            log_set_max_level(LOG_DEBUG);
+            break;
+        case 'p':
+            args.pattern = pattern_from_str(optarg);
+            if (args.pattern == _PATTERN_UNKNOWN)
+                goto invalid;
+            break;
+        case 'r':
+            if (safe_atoul(optarg, &ul) < 0 || ul == 0 || ul > MAX_RATE_HZ)
+                goto invalid;
+            args.rate_hz = ul;
+            break;
+        case 'f':
+            args.freq_hz = strtod(optarg, &end);
+            if (*end || args.freq_hz < 0)
+                goto invalid;
+            break;
+        case 'd':
+            if (safe_atoul(optarg, &args.duration_msec) < 0)
+                goto invalid;
+            break;
+        case 'b':
+            if (safe_atoul(optarg, &args.button_interval_msec) < 0)
+                goto invalid;
+            break;
+        case 's':
+            args.script_file = optarg;
+            args.pattern = PATTERN_SCRIPT;
+            break;
+        case 'l':
+            args.loop = true;
+            break;
+        case ARG_SEED:
+            if (safe_atoul(optarg, &ul) < 0)
+                goto invalid;
+            args.seed = ul;
+            break;
+        case ARG_SETTLE:
+            if (safe_atoul(optarg, &args.settle_msec) < 0)
+                goto invalid;
+            break;
+        case ARG_NAME:
+            args.name = optarg;
+            break;
+        default:
+            help(stderr);
+            return -EINVAL;
+        }
+
+        continue;
+
+invalid:
+        fprintf(stderr, "invalid argument '%s'\n", optarg);
+        return -EINVAL;
+    }
+
+    if (args.pattern == PATTERN_SCRIPT && !args.script_file) {
+        fprintf(stderr, "script pattern requires --script\n");
+        return -EINVAL;
+    }
+
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    _cleanup_free_ struct ScriptLine *lines = NULL;
+    size_t nlines = 0;
+    usec_t start, elapsed;
+    char node[PATH_MAX];
+    int fd, r;
+
+    log_init();
+
+    r = parse_args(argc, argv);
+    if (r <= 0)
+        goto out;
+
+    if (args.script_file) {
+        r = script_load(args.script_file, &lines, &nlines);
+        if (r < 0)
+            goto out;
+    }
+
+    srand(args.seed);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    fd = uinput_create();
+    if (fd < 0) {
+        r = fd;
+        goto out;
+    }
+
+    if (uinput_event_node(fd, node, sizeof(node)) < 0)
+        snprintf(node, sizeof(node), "an unknown event node");
+
+    log_info("Created '%s' as %s, pattern %s at %lu Hz\n", args.name, node,
+             pattern_names[args.pattern], args.rate_hz);
+
+    sleep_until(now_usec() + args.settle_msec * USEC_PER_MSEC);
+
+    start = now_usec();
+    if (!stop)
+        r = args.pattern == PATTERN_SCRIPT ? run_script(fd, lines, nlines) : run_pattern(fd);
+    elapsed = now_usec() - start;
+
+    log_info("Sent %lu frames, %lu events in %" PRIu64 " ms (%.1f frames/s)\n", stats.frames,
+             stats.events, elapsed / USEC_PER_MSEC,
+             elapsed ? stats.frames * (double)USEC_PER_SEC / elapsed : 0.0);
+    log_info("Overruns: %lu, maximum lateness: %" PRIu64 " us\n", stats.overruns,
+             stats.max_late_usec);
+
+    uinput_destroy(fd);
+
+out:
+    log_shutdown();
+    return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,428 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+/* Copyright (c) 2020 Lucas De Marchi <lucas.de.marchi@gmail.com> */
+
+/*
+ * RC output to serial radio modules, as CRSF or SBUS frames. Frames are not sent when values
+ * are updated, but paced by a timer at a fixed rate: radios expect evenly spaced frames and the
+ * link latency depends on it. A frame is skipped rather than queued behind the previous one if
+ * the line is still busy.
+ */
+
+#include "serial.h"
+
+#include <asm/termbits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "event_loop.h"
+#include "log.h"
+#include "macro.h"
+#include "output.h"
+#include "util.h"
+
+#define MAX_SERIAL_OUTPUTS 2
+
+/* stop sending if values are not updated, so the receiver goes to failsafe */
+#define STALE_USEC (250 * USEC_PER_MSEC)
+
+#define PWM_CENTER 1500
+
+/* CRSF and SBUS share the channel encoding: 11 bits, 992 at center, 1.6 per µs */
+#define PACKED_NUM_CHANNELS 16
+#define PACKED_CHANNELS_SIZE 22
+#define PACKED_MIN 172
+#define PACKED_MAX 1811
+#define PACKED_CENTER 992
+
+/* -- CRSF -- */
+
+/* what a handset sends to its transmitter module, and the baud rate of the module bay */
+#define CRSF_ADDRESS_CRSF_TRANSMITTER 0xee
+#define CRSF_FRAMETYPE_RC_CHANNELS_PACKED 0x16
+#define CRSF_CRC_POLY 0xd5
+#define CRSF_DEFAULT_BAUD 400000
+#define CRSF_DEFAULT_INTERVAL_USEC 4000
+
+struct _packed crsf_rc_frame {
+    uint8_t address;
+    /* type, payload and crc */
+    uint8_t len;
+    uint8_t type;
+    uint8_t channels[PACKED_CHANNELS_SIZE];
+    uint8_t crc;
+};
+
+/* -- SBUS -- */
+
+#define SBUS_HEADER 0x0f
+#define SBUS_FOOTER 0x00
+#define SBUS_DEFAULT_BAUD 100000
+#define SBUS_DEFAULT_INTERVAL_USEC 7000
+
+struct _packed sbus_frame {
+    uint8_t header;
+    uint8_t channels[PACKED_CHANNELS_SIZE];
+    /* digital channels 17 and 18, frame lost and failsafe */
+    uint8_t flags;
+    uint8_t footer;
+};
+
+/* ----------- */
+
+enum SerialFormat {
+    SERIAL_FORMAT_CRSF,
+    SERIAL_FORMAT_SBUS,
+    _SERIAL_FORMAT_UNKNOWN = -1,
+};
+
+static const char *const format_names[] = {
+    [SERIAL_FORMAT_CRSF] = "crsf",
+    [SERIAL_FORMAT_SBUS] = "sbus",
+};
+
+struct SerialOutput {
+    char *path;
+    int fd;
+    enum SerialFormat format;
+    unsigned long baud;
+    /* destination of CRSF frames */
+    uint8_t address;
+    usec_t interval_usec;
+    struct EventSource *timer;
+
+    uint16_t ch[PACKED_NUM_CHANNELS];
+    usec_t last_update_usec;
+
+    union {
+        struct crsf_rc_frame crsf;
+        struct sbus_frame sbus;
+    };
+    size_t frame_size;
+
+    struct {
+        unsigned long frames;
+        /* line still busy with the previous frame */
+        unsigned long skipped;
+    } stats;
+};
+
+static struct {
+    struct SerialOutput outputs[MAX_SERIAL_OUTPUTS];
+    unsigned int n_outputs;
+    uint8_t crc8_table[256];
+} serial_ctx;
+
+static void crc8_init(void)
+{
+    unsigned int i, bit;
+
+    for (i = 0; i < 256; i++) {
+        uint8_t crc = i;
+
+        for (bit = 0; bit < 8; bit++)
+            crc = crc & 0x80 ? (crc << 1) ^ CRSF_CRC_POLY : crc << 1;
+
+        serial_ctx.crc8_table[i] = crc;
+    }
+}
+
+static uint8_t crc8(const uint8_t *p, size_t len)
+{
+    uint8_t crc = 0;
+
+    while (len--)
+        crc = serial_ctx.crc8_table[crc ^ *p++];
+
+    return crc;
+}
+
+/* 16 channels of 11 bits, least significant bit first */
+static void pack_channels(const uint16_t ch[], uint8_t *out)
+{
+    uint32_t bits = 0;
+    unsigned int i, nbits = 0;
+
+    for (i = 0; i < PACKED_NUM_CHANNELS; i++) {
+        bits |= (uint32_t)ch[i] << nbits;
+        nbits += 11;
+
+        while (nbits >= 8) {
+            *out++ = bits & 0xff;
+            bits >>= 8;
+            nbits -= 8;
+        }
+    }
+}
+
+static void crsf_fill_frame(struct SerialOutput *s)
+{
+    struct crsf_rc_frame *f = &s->crsf;
+
+    f->address = s->address;
+    f->len = sizeof(*f) - offsetof(struct crsf_rc_frame, type);
+    f->type = CRSF_FRAMETYPE_RC_CHANNELS_PACKED;
+    pack_channels(s->ch, f->channels);
+    f->crc = crc8(&f->type, sizeof(f->channels) + 1);
+}
+
+static void sbus_fill_frame(struct SerialOutput *s)
+{
+    struct sbus_frame *f = &s->sbus;
+
+    f->header = SBUS_HEADER;
+    pack_channels(s->ch, f->channels);
+    f->flags = 0;
+    f->footer = SBUS_FOOTER;
+}
+
+static void serial_timer_handler(int fd, void *data, int ev_mask)
+{
+    struct SerialOutput *s = data;
+    int outq = 0;
+    ssize_t r;
+
+    if (!s->last_update_usec || now_usec() - s->last_update_usec > STALE_USEC)
+        return;
+
+    /* never queue a frame right behind the previous one */
+    if (ioctl(s->fd, TIOCOUTQ, &outq) == 0 && outq > 0) {
+        s->stats.skipped++;
+        return;
+    }
+
+    if (s->format == SERIAL_FORMAT_CRSF)
+        crsf_fill_frame(s);
+    else
+        sbus_fill_frame(s);
+
+    r = write(s->fd, &s->crsf, s->frame_size);
+    if (r < 0) {
+        if (errno == EAGAIN)
+            s->stats.skipped++;
+        else
+            log_error("%s: could not write frame: %m\n", s->path);
+        return;
+    }
+
+    s->stats.frames++;
+}
+
+static void serial_encode(const int val[], int count, usec_t timestamp_usec)
+{
+    unsigned int i;
+    int j;
+
+    for (i = 0; i < serial_ctx.n_outputs; i++) {
+        struct SerialOutput *s = &serial_ctx.outputs[i];
+
+        for (j = 0; j < PACKED_NUM_CHANNELS; j++) {
+            int v = j < count ? val[j] : PWM_CENTER;
+
+            v = PACKED_CENTER + (v - PWM_CENTER) * 8 / 5;
+            s->ch[j] = constrain(v, PACKED_MIN, PACKED_MAX);
+        }
+
+        s->last_update_usec = now_usec();
+    }
+}
+
+static int serial_configure(struct SerialOutput *s)
+{
+    struct termios2 tio;
+
+    if (ioctl(s->fd, TCGETS2, &tio) < 0)
+        return -errno;
+
+    /* raw 8 bits, any baud rate */
+    tio.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON | IXOFF);
+    tio.c_oflag &= ~OPOST;
+    tio.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    tio.c_cflag &= ~(CSIZE | PARENB | PARODD | CSTOPB | CRTSCTS | CBAUD | (CBAUD << IBSHIFT));
+    tio.c_cflag |= CS8 | CLOCAL | CREAD | BOTHER | (BOTHER << IBSHIFT);
+    tio.c_ispeed = tio.c_ospeed = s->baud;
+
+    /* SBUS is 8E2 */
+    if (s->format == SERIAL_FORMAT_SBUS)
+        tio.c_cflag |= PARENB | CSTOPB;
+
+    if (ioctl(s->fd, TCSETS2, &tio) < 0)
+        return -errno;
+
+    return 0;
+}
+
+static int parse_option(struct SerialOutput *s, const char *opt, unsigned long *rate)
+{
+    const char *value = strchr(opt, '=');
+    size_t i;
+
+    if (!value)
+        return -EINVAL;
+
+    value++;
+
+    if (strneq(opt, "format=", value - opt)) {
+        s->format = _SERIAL_FORMAT_UNKNOWN;
+        for (i = 0; i < ARRAY_SIZE(format_names); i++)
+            if (strcaseeq(value, format_names[i]))
+                s->format = i;
+        if (s->format == _SERIAL_FORMAT_UNKNOWN)
+            return -EINVAL;
+    } else if (strneq(opt, "baud=", value - opt)) {
+        if (safe_atoul(value, &s->baud) < 0 || s->baud == 0)
+            return -EINVAL;
+    } else if (strneq(opt, "rate=", value - opt)) {
+        if (safe_atoul(value, rate) < 0 || *rate == 0 || *rate > USEC_PER_SEC)
+            return -EINVAL;
+    } else if (strneq(opt, "address=", value - opt)) {
+        unsigned long address;
+
+        if (safe_atoul(value, &address) < 0 || address > UINT8_MAX)
+            return -EINVAL;
+        s->address = address;
+    } else {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/* PATH[,format=crsf|sbus][,baud=N][,rate=HZ][,address=N] */
+static int serial_init(char *spec, const struct OutputDefaults *defaults)
+{
+    struct SerialOutput *s;
+    unsigned long rate = 0;
+    char *saveptr, *path, *opt;
+    usec_t frame_usec;
+    int r;
+
+    if (serial_ctx.n_outputs >= MAX_SERIAL_OUTPUTS) {
+        log_error("too many serial outputs, maximum is %d\n", MAX_SERIAL_OUTPUTS);
+        return -EINVAL;
+    }
+
+    s = &serial_ctx.outputs[serial_ctx.n_outputs];
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+    s->format = SERIAL_FORMAT_CRSF;
+    s->address = CRSF_ADDRESS_CRSF_TRANSMITTER;
+
+    path = strtok_r(spec, ",", &saveptr);
+    while ((opt = strtok_r(NULL, ",", &saveptr))) {
+        r = parse_option(s, opt, &rate);
+        if (r < 0) {
+            log_error("%s: invalid option %s\n", path, opt);
+            return r;
+        }
+    }
+
+    if (s->format == SERIAL_FORMAT_CRSF) {
+        s->frame_size = sizeof(s->crsf);
+        s->baud = s->baud ?: CRSF_DEFAULT_BAUD;
+        s->interval_usec = CRSF_DEFAULT_INTERVAL_USEC;
+    } else {
+        s->frame_size = sizeof(s->sbus);
+        s->baud = s->baud ?: SBUS_DEFAULT_BAUD;
+        s->interval_usec = SBUS_DEFAULT_INTERVAL_USEC;
+    }
+
+    if (rate)
+        s->interval_usec = USEC_PER_SEC / rate;
+
+    /* start, stop and for SBUS parity bits */
+    frame_usec = s->frame_size * (s->format == SERIAL_FORMAT_SBUS ? 12 : 10) * USEC_PER_SEC
+                 / s->baud;
+    if (frame_usec >= s->interval_usec) {
+        log_error("%s: a frame takes %" PRIu64 " us at %lu baud, more than the interval of %" PRIu64
+                  " us\n", path, frame_usec, s->baud, s->interval_usec);
+        return -EINVAL;
+    }
+
+    if (!serial_ctx.n_outputs)
+        crc8_init();
+
+    s->path = strdup(path);
+    if (!s->path)
+        return -ENOMEM;
+
+    s->fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (s->fd < 0) {
+        r = -errno;
+        log_error("could not open %s: %m\n", path);
+        goto fail;
+    }
+
+    r = serial_configure(s);
+    if (r < 0) {
+        log_error("could not configure %s at %lu baud: %s\n", path, s->baud, strerror(-r));
+        goto fail;
+    }
+
+    s->timer = event_loop_add_timeout_usec(s->interval_usec, s, serial_timer_handler);
+    if (!s->timer) {
+        r = -ENOMEM;
+        goto fail;
+    }
+
+    serial_ctx.n_outputs++;
+
+    log_info("Sending %s to %s at %lu baud, a frame every %" PRIu64 " us\n",
+             format_names[s->format], path, s->baud, s->interval_usec);
+
+    return 0;
+
+fail:
+    if (s->fd >= 0)
+        close(s->fd);
+    free(s->path);
+    s->path = NULL;
+    return r;
+}
+
+static bool serial_match(const char *spec)
+{
+    return spec[0] == '/';
+}
+
+static void serial_stats(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < serial_ctx.n_outputs; i++) {
+        struct SerialOutput *s = &serial_ctx.outputs[i];
+
+        log_info("%s: %lu frames sent, %lu skipped with the line busy\n", s->path,
+                 s->stats.frames, s->stats.skipped);
+    }
+}
+
+static void serial_shutdown(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < serial_ctx.n_outputs; i++) {
+        struct SerialOutput *s = &serial_ctx.outputs[i];
+
+        event_loop_remove_timeout(s->timer);
+        close(s->fd);
+        free(s->path);
+    }
+
+    serial_ctx.n_outputs = 0;
+}
+
+/* frames are sent from each output's timer, not when values are updated */
+const struct OutputBackend serial_output_backend = {
+    .name = "serial",
+    .match = serial_match,
+    .init = serial_init,
+    .encode = serial_encode,
+    .stats = serial_stats,
+    .shutdown = serial_shutdown,
+};
@@ -0,0 +1,7 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+/* Copyright (c) 2020 Lucas De Marchi <lucas.de.marchi@gmail.com> */
+
+#pragma once
+
+/* Serial radio modules: PATH[,OPTION=VALUE...] */
+extern const struct OutputBackend serial_output_backend;
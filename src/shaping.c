@@ -0,0 +1,289 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+/* Copyright (c) 2020 Lucas De Marchi <lucas.de.marchi@gmail.com> */
+
+/*
+ * Per-channel input shaping: each output goes through expo and rate curves, a first order
+ * low-pass filter and a slew rate limit. Curves are precomputed into lookup tables when the
+ * configuration is loaded, so the cost per packet is bounded by a lookup and a few multiplications
+ * per channel.
+ *
+ * Settings are grouped in profiles that can be switched at runtime with a button:
+ *
+ * [General]
+ * ProfileChannel = RC6
+ *
+ * [Profile normal]
+ * RC1.Expo = 30
+ * RC1.Rate = 80
+ * RC3.LowPassHz = 10
+ * RC3.SlewRate = 2000
+ */
+
+#include "shaping.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <c-ini.h>
+
+#include "controller.h"
+#include "log.h"
+
+#define MAX_PROFILES 8
+
+#define PWM_CENTER 1500
+#define PWM_HALF_RANGE 500
+
+/* filter state is kept with 8 fractional bits */
+#define STATE_SHIFT 8
+#define ALPHA_SHIFT 16
+
+struct ChannelShaping {
+    /* deflection from center -> shaped deflection, NULL for identity */
+    int16_t *curve;
+    /* low-pass time constant, 0 if disabled */
+    usec_t tau_usec;
+    /* maximum change per second, 0 if disabled */
+    unsigned long slew_rate;
+};
+
+struct Profile {
+    char *name;
+    struct ChannelShaping ch[MAX_CHANNELS];
+};
+
+static struct {
+    struct Profile profiles[MAX_PROFILES];
+    unsigned int n_profiles;
+    unsigned int active;
+
+    /* channel whose changes switch to the next profile, -1 if none */
+    int profile_channel;
+    int profile_channel_val;
+
+    bool started;
+    usec_t last_usec;
+    int32_t state[MAX_CHANNELS];
+} shaping_ctx = {
+    .profile_channel = -1,
+};
+
+/* Build the curve for @expo and @rate, both in percent */
+static int16_t *curve_new(unsigned long expo, unsigned long rate)
+{
+    int16_t *curve;
+    float e = expo / 100.f, r = rate / 100.f;
+    int i;
+
+    curve = malloc((PWM_HALF_RANGE + 1) * sizeof(*curve));
+    if (!curve)
+        return NULL;
+
+    for (i = 0; i <= PWM_HALF_RANGE; i++) {
+        float x = (float)i / PWM_HALF_RANGE;
+        float y = r * (e * x * x * x + (1 - e) * x);
+
+        curve[i] = lrintf(y * PWM_HALF_RANGE);
+    }
+
+    return curve;
+}
+
+static int parse_profile_key(struct Profile *p, const char *key, const char *value,
+                             unsigned long *expo, unsigned long *rate)
+{
+    unsigned long ch, ul;
+    char *dot;
+
+    if (!strncaseeq(key, "RC", 2))
+        return -EINVAL;
+
+    ch = strtoul(key + 2, &dot, 10);
+    if (*dot != '.' || ch < 1 || ch > MAX_CHANNELS)
+        return -EINVAL;
+
+    if (safe_atoul(value, &ul) < 0)
+        return -EINVAL;
+
+    ch--;
+    dot++;
+
+    if (strcaseeq(dot, "Expo") && ul <= 100) {
+        expo[ch] = ul;
+    } else if (strcaseeq(dot, "Rate") && ul <= 100) {
+        rate[ch] = ul;
+    } else if (strcaseeq(dot, "LowPassHz") && ul > 0) {
+        p->ch[ch].tau_usec = USEC_PER_SEC / (2 * M_PI * ul);
+    } else if (strcaseeq(dot, "SlewRate") && ul > 0) {
+        p->ch[ch].slew_rate = ul;
+    } else {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int profile_init(struct Profile *p, CIniGroup *group, const char *label)
+{
+    unsigned long expo[MAX_CHANNELS] = { }, rate[MAX_CHANNELS];
+    CIniEntry *entry;
+    unsigned int i;
+
+    for (i = 0; i < MAX_CHANNELS; i++)
+        rate[i] = 100;
+
+    p->name = strdup(label + strlen("Profile "));
+    if (!p->name)
+        return -ENOMEM;
+
+    for (entry = c_ini_group_iterate(group); entry; entry = c_ini_entry_next(entry)) {
+        const char *key = c_ini_entry_get_key(entry, NULL);
+        const char *value = c_ini_entry_get_value(entry, NULL);
+
+        if (parse_profile_key(p, key, value, expo, rate) < 0)
+            log_warning("Invalid value %s.%s=%s\n", label, key, value);
+    }
+
+    for (i = 0; i < MAX_CHANNELS; i++) {
+        if (expo[i] == 0 && rate[i] == 100)
+            continue;
+
+        p->ch[i].curve = curve_new(expo[i], rate[i]);
+        if (!p->ch[i].curve)
+            return -ENOMEM;
+    }
+
+    return 0;
+}
+
+int shaping_init(CIniDomain *config, unsigned int n_channels)
+{
+    CIniGroup *group;
+    CIniEntry *entry;
+    int r;
+
+    if (!config)
+        return 0;
+
+    for (group = c_ini_domain_iterate(config); group; group = c_ini_group_next(group)) {
+        const char *label = c_ini_group_get_label(group, NULL);
+
+        if (!label || !strneq(label, "Profile ", strlen("Profile ")))
+            continue;
+
+        if (shaping_ctx.n_profiles >= MAX_PROFILES) {
+            log_warning("Too many profiles, ignoring [%s]\n", label);
+            continue;
+        }
+
+        r = profile_init(&shaping_ctx.profiles[shaping_ctx.n_profiles++], group, label);
+        if (r < 0)
+            return r;
+    }
+
+    group = c_ini_domain_find(config, "General", -1);
+    entry = group ? c_ini_group_find(group, "ProfileChannel", -1) : NULL;
+    if (entry) {
+        const char *value = c_ini_entry_get_value(entry, NULL);
+        unsigned long ch;
+
+        if (!strncaseeq(value, "RC", 2) || safe_atoul(value + 2, &ch) < 0 || ch < 1
+            || ch > n_channels)
+            log_warning("Invalid value General.ProfileChannel=%s\n", value);
+        else
+            shaping_ctx.profile_channel = ch - 1;
+    }
+
+    if (shaping_ctx.n_profiles)
+        log_info("shaping: %u profiles, using '%s'\n", shaping_ctx.n_profiles,
+                 shaping_ctx.profiles[0].name);
+
+    return 0;
+}
+
+void shaping_shutdown(void)
+{
+    unsigned int i, j;
+
+    for (i = 0; i < shaping_ctx.n_profiles; i++) {
+        for (j = 0; j < MAX_CHANNELS; j++)
+            free(shaping_ctx.profiles[i].ch[j].curve);
+        free(shaping_ctx.profiles[i].name);
+    }
+
+    shaping_ctx.n_profiles = 0;
+}
+
+static void shaping_update_profile(const int in[])
+{
+    int val = in[shaping_ctx.profile_channel];
+
+    /* each press toggles the channel: switch to the next profile */
+    if (val == shaping_ctx.profile_channel_val)
+        return;
+
+    if (shaping_ctx.started) {
+        shaping_ctx.active = (shaping_ctx.active + 1) % shaping_ctx.n_profiles;
+        log_info("shaping: switched to profile '%s'\n",
+                 shaping_ctx.profiles[shaping_ctx.active].name);
+    }
+
+    shaping_ctx.profile_channel_val = val;
+}
+
+void shaping_apply(const int in[], int out[], unsigned int n_channels, usec_t now)
+{
+    const struct Profile *p;
+    usec_t dt;
+    unsigned int i;
+
+    if (!shaping_ctx.n_profiles) {
+        memcpy(out, in, n_channels * sizeof(*out));
+        return;
+    }
+
+    if (shaping_ctx.profile_channel >= 0)
+        shaping_update_profile(in);
+
+    p = &shaping_ctx.profiles[shaping_ctx.active];
+    dt = shaping_ctx.started ? now - shaping_ctx.last_usec : 0;
+
+    for (i = 0; i < n_channels; i++) {
+        const struct ChannelShaping *cs = &p->ch[i];
+        int32_t target, *state = &shaping_ctx.state[i];
+        int d = in[i] - PWM_CENTER;
+
+        if (cs->curve) {
+            d = constrain(d, -PWM_HALF_RANGE, PWM_HALF_RANGE);
+            d = d >= 0 ? cs->curve[d] : -cs->curve[-d];
+        }
+
+        target = (PWM_CENTER + d) << STATE_SHIFT;
+
+        if (!shaping_ctx.started || (!cs->tau_usec && !cs->slew_rate)) {
+            *state = target;
+        } else {
+            if (cs->tau_usec) {
+                int64_t alpha = ((int64_t)dt << ALPHA_SHIFT) / (cs->tau_usec + dt);
+
+                target = *state + (((int64_t)(target - *state) * alpha) >> ALPHA_SHIFT);
+            }
+
+            if (cs->slew_rate) {
+                int64_t step = ((int64_t)cs->slew_rate * dt << STATE_SHIFT) / USEC_PER_SEC;
+
+                target = constrain((int64_t)target, *state - step, *state + step);
+            }
+
+            *state = target;
+        }
+
+        out[i] = (*state + (1 << (STATE_SHIFT - 1))) >> STATE_SHIFT;
+    }
+
+    shaping_ctx.started = true;
+    shaping_ctx.last_usec = now;
+}
@@ -0,0 +1,13 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+/* Copyright (c) 2020 Lucas De Marchi <lucas.de.marchi@gmail.com> */
+
+#pragma once
+
+#include "util.h"
+
+typedef struct CIniDomain CIniDomain;
+
+int shaping_init(CIniDomain *config, unsigned int n_channels);
+void shaping_shutdown(void);
+
+void shaping_apply(const int in[], int out[], unsigned int n_channels, usec_t now);
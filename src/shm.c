@@ -0,0 +1,205 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+/* Copyright (c) 2020 Lucas De Marchi <lucas.de.marchi@gmail.com> */
+
+#include "shm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "controller.h"
+#include "dema-rc-shm.h"
+#include "log.h"
+#include "output.h"
+#include "util.h"
+
+#define SHM_PREFIX "shm:"
+#define SHM_DIR "/dev/shm/"
+
+static struct {
+    struct DemaRcShm *shm;
+    char *path;
+    struct DemaRcShmFrame frame;
+} shm_ctx;
+
+static bool shm_match(const char *spec)
+{
+    return strneq(spec, SHM_PREFIX, strlen(SHM_PREFIX));
+}
+
+/* Readers retry while the lock is odd */
+static void slot_write(struct DemaRcShmSlot *slot, const struct DemaRcShmFrame *frame)
+{
+    uint32_t lock = slot->lock;
+
+    __atomic_store_n(&slot->lock, lock + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&slot->frame, frame, sizeof(*frame));
+    __atomic_store_n(&slot->lock, lock + 2, __ATOMIC_RELEASE);
+}
+
+/* A producer that died in the middle of slot_write() leaves the lock odd */
+static void slot_unlock(struct DemaRcShmSlot *slot)
+{
+    uint32_t lock = slot->lock;
+
+    if (lock & 1)
+        __atomic_store_n(&slot->lock, lock + 1, __ATOMIC_RELEASE);
+}
+
+static bool producer_alive(pid_t pid)
+{
+    return pid > 0 && pid != getpid() && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+static int shm_init(char *spec, const struct OutputDefaults *defaults)
+{
+    const char *name = spec + strlen(SHM_PREFIX);
+    struct DemaRcShm *shm;
+    struct stat st;
+    unsigned int i;
+    int fd, r;
+
+    if (shm_ctx.shm) {
+        log_error("only one shm output is supported\n");
+        return -EEXIST;
+    }
+
+    if (!name[0])
+        return -EINVAL;
+
+    if (name[0] == '/')
+        shm_ctx.path = strdup(name);
+    else if (asprintf(&shm_ctx.path, SHM_DIR "%s", name) < 0)
+        shm_ctx.path = NULL;
+    if (!shm_ctx.path)
+        return -ENOMEM;
+
+    fd = open(shm_ctx.path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        r = -errno;
+        log_error("could not open %s: %m\n", shm_ctx.path);
+        goto fail;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        r = -errno;
+        log_error("could not stat %s: %m\n", shm_ctx.path);
+        close(fd);
+        goto fail;
+    }
+
+    /* only grown, never shrunk: readers may have it mapped */
+    if ((size_t)st.st_size < sizeof(*shm) && ftruncate(fd, sizeof(*shm)) < 0) {
+        r = -errno;
+        log_error("could not resize %s: %m\n", shm_ctx.path);
+        close(fd);
+        goto fail;
+    }
+
+    shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shm == MAP_FAILED) {
+        r = -errno;
+        log_error("could not map %s: %m\n", shm_ctx.path);
+        close(fd);
+        goto fail;
+    }
+
+    close(fd);
+
+    /* a previous run left it: keep numbering, so readers just see the next frames */
+    if (dema_rc_shm_valid(shm)) {
+        /* the seqlock only works with a single writer */
+        if (producer_alive(shm->pid)) {
+            log_error("%s is being published by pid %u\n", shm_ctx.path, shm->pid);
+            munmap(shm, sizeof(*shm));
+            r = -EBUSY;
+            goto fail;
+        }
+
+        slot_unlock(&shm->latest);
+        for (i = 0; i < DEMA_RC_SHM_RING_SIZE; i++)
+            slot_unlock(&shm->ring[i]);
+
+        shm_ctx.frame.seq = shm->head;
+    } else {
+        __atomic_store_n(&shm->magic, 0, __ATOMIC_RELEASE);
+        memset((uint8_t *)shm + sizeof(shm->magic), 0, sizeof(*shm) - sizeof(shm->magic));
+        shm->version = DEMA_RC_SHM_VERSION;
+        shm->ring_size = DEMA_RC_SHM_RING_SIZE;
+        shm->max_channels = DEMA_RC_SHM_MAX_CHANNELS;
+        __atomic_store_n(&shm->magic, DEMA_RC_SHM_MAGIC, __ATOMIC_RELEASE);
+    }
+
+    shm->pid = getpid();
+    shm_ctx.shm = shm;
+
+    log_info("Publishing channels in %s\n", shm_ctx.path);
+
+    return 0;
+
+fail:
+    free(shm_ctx.path);
+    shm_ctx.path = NULL;
+    return r;
+}
+
+static void shm_encode(const int val[], int count, usec_t timestamp_usec)
+{
+    int i;
+
+    count = min(count, DEMA_RC_SHM_MAX_CHANNELS);
+    shm_ctx.frame.timestamp_usec = timestamp_usec;
+    shm_ctx.frame.count = count;
+
+    for (i = 0; i < count; i++)
+        shm_ctx.frame.channels[i] = val[i];
+}
+
+static void shm_send(usec_t now)
+{
+    struct DemaRcShm *shm = shm_ctx.shm;
+    uint64_t seq = shm_ctx.frame.seq;
+
+    slot_write(&shm->ring[seq % DEMA_RC_SHM_RING_SIZE], &shm_ctx.frame);
+    slot_write(&shm->latest, &shm_ctx.frame);
+
+    /* readers only look at frames before head */
+    __atomic_store_n(&shm->head, seq + 1, __ATOMIC_RELEASE);
+    shm_ctx.frame.seq++;
+}
+
+static void shm_stats(void)
+{
+    if (shm_ctx.shm)
+        log_info("%s: %" PRIu64 " frames published\n", shm_ctx.path, shm_ctx.shm->head);
+}
+
+static void shm_shutdown(void)
+{
+    /* the file is left for readers to find the last frame */
+    if (shm_ctx.shm) {
+        shm_ctx.shm->pid = 0;
+        munmap(shm_ctx.shm, sizeof(*shm_ctx.shm));
+    }
+
+    free(shm_ctx.path);
+    memset(&shm_ctx, 0, sizeof(shm_ctx));
+}
+
+const struct OutputBackend shm_output_backend = {
+    .name = "shm",
+    .match = shm_match,
+    .init = shm_init,
+    .encode = shm_encode,
+    .send = shm_send,
+    .stats = shm_stats,
+    .shutdown = shm_shutdown,
+};
@@ -0,0 +1,7 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+/* Copyright (c) 2020 Lucas De Marchi <lucas.de.marchi@gmail.com> */
+
+#pragma once
+
+/* Frames in shared memory for readers on the same host: shm:NAME or shm:/PATH, see dema-rc-shm.h */
+extern const struct OutputBackend shm_output_backend;
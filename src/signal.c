@@ -12,6 +12,7 @@
 #include "log.h"
 
 static int sfd = -1;
+static struct EventSource *source;
 
 static void signal_handler(int fd, void *data, int ev_mask)
 {
@@ -42,11 +43,18 @@ int signal_init(void)
     }
 
     fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
-    if (fd < 0 || event_loop_add_source(fd, NULL, EPOLLIN, signal_handler) < 0) {
+    if (fd < 0) {
         log_error("Failed to setup signalfd: %m\n");
         return -1;
     }
 
+    source = event_loop_add_source(fd, NULL, EPOLLIN, signal_handler);
+    if (!source) {
+        log_error("Failed to setup signalfd\n");
+        close(fd);
+        return -1;
+    }
+
     sfd = fd;
 
     return 0;
@@ -57,6 +65,8 @@ void signal_shutdown(void)
     if (sfd < 0)
         return;
 
-    event_loop_remove_source(sfd);
+    event_loop_remove_source(source);
+    source = NULL;
     close(sfd);
+    sfd = -1;
 }
@@ -0,0 +1,172 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+/* Copyright (c) 2020 Lucas De Marchi <lucas.de.marchi@gmail.com> */
+
+#include "uring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "util.h"
+
+/*
+ * Features the event loop relies on. FEAT_RSRC_TAGS came with 5.13, the kernel that also added
+ * multishot poll, that can't be checked otherwise
+ */
+#define URING_REQUIRED_FEATURES                                                                \
+    (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_FAST_POLL                     \
+     | IORING_FEAT_RSRC_TAGS)
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+                          unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int uring_init(struct Uring *u, unsigned int entries)
+{
+    struct io_uring_params p = { };
+    uint8_t *ring;
+    int r;
+
+    memset(u, 0, sizeof(*u));
+
+    u->fd = io_uring_setup(entries, &p);
+    if (u->fd < 0)
+        return -errno;
+
+    if ((p.features & URING_REQUIRED_FEATURES) != URING_REQUIRED_FEATURES) {
+        r = -EOPNOTSUPP;
+        goto fail;
+    }
+
+    /* with FEAT_SINGLE_MMAP both rings are in the same mapping */
+    u->ring_size = max(p.sq_off.array + p.sq_entries * sizeof(unsigned int),
+                       p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+    u->ring = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                   IORING_OFF_SQ_RING);
+    if (u->ring == MAP_FAILED) {
+        r = -errno;
+        goto fail;
+    }
+
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                   IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        r = -errno;
+        munmap(u->ring, u->ring_size);
+        goto fail;
+    }
+
+    ring = u->ring;
+    u->sq_head = (unsigned int *)(ring + p.sq_off.head);
+    u->sq_tail = (unsigned int *)(ring + p.sq_off.tail);
+    u->sq_array = (unsigned int *)(ring + p.sq_off.array);
+    u->sq_mask = *(unsigned int *)(ring + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->sqe_tail = *u->sq_tail;
+
+    u->cq_head = (unsigned int *)(ring + p.cq_off.head);
+    u->cq_tail = (unsigned int *)(ring + p.cq_off.tail);
+    u->cq_mask = *(unsigned int *)(ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+    return 0;
+
+fail:
+    close(u->fd);
+    u->fd = -1;
+    return r;
+}
+
+void uring_exit(struct Uring *u)
+{
+    if (u->fd < 0)
+        return;
+
+    munmap(u->sqes, u->sqes_size);
+    munmap(u->ring, u->ring_size);
+    close(u->fd);
+    u->fd = -1;
+}
+
+/* Make the queued entries visible to the kernel, return how many there are */
+static unsigned int uring_flush(struct Uring *u)
+{
+    unsigned int tail = *u->sq_tail;
+
+    /* the array maps 1:1 to sqes: only filled up to the new tail */
+    for (; tail != u->sqe_tail; tail++)
+        u->sq_array[tail & u->sq_mask] = tail & u->sq_mask;
+
+    __atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+
+    return u->sqe_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+}
+
+int uring_submit_and_wait(struct Uring *u, unsigned int wait_nr)
+{
+    unsigned int to_submit = uring_flush(u);
+    int r;
+
+    if (!to_submit && !wait_nr)
+        return 0;
+
+    r = io_uring_enter(u->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    if (r < 0)
+        return -errno;
+
+    return r;
+}
+
+unsigned int uring_sq_space(struct Uring *u)
+{
+    return u->sq_entries - (u->sqe_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE));
+}
+
+struct io_uring_sqe *uring_get_sqe(struct Uring *u)
+{
+    struct io_uring_sqe *sqe;
+
+    if (!uring_sq_space(u)) {
+        int r = uring_submit_and_wait(u, 0);
+
+        if (r < 0 && r != -EBUSY && r != -EAGAIN) {
+            log_error("io_uring: could not submit: %s\n", strerror(-r));
+            return NULL;
+        }
+
+        if (!uring_sq_space(u))
+            return NULL;
+    }
+
+    sqe = &u->sqes[u->sqe_tail & u->sq_mask];
+    u->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+
+    return sqe;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct Uring *u)
+{
+    unsigned int head = *u->cq_head;
+
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    return &u->cqes[head & u->cq_mask];
+}
+
+void uring_cqe_seen(struct Uring *u)
+{
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,42 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+/* Copyright (c) 2020 Lucas De Marchi <lucas.de.marchi@gmail.com> */
+
+#pragma once
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+/* Minimal io_uring: the rings mapped in memory and the submission and completion helpers */
+struct Uring {
+    int fd;
+
+    unsigned int *sq_head, *sq_tail, *sq_array;
+    unsigned int sq_mask, sq_entries;
+    struct io_uring_sqe *sqes;
+    /* local tail, published on submission */
+    unsigned int sqe_tail;
+
+    unsigned int *cq_head, *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *ring;
+    size_t ring_size;
+    size_t sqes_size;
+};
+
+int uring_init(struct Uring *u, unsigned int entries);
+void uring_exit(struct Uring *u);
+
+/* Entries that can be queued before the queue needs to be submitted */
+unsigned int uring_sq_space(struct Uring *u);
+
+/* Next free submission entry, zeroed. The queue is submitted first if full */
+struct io_uring_sqe *uring_get_sqe(struct Uring *u);
+
+/* Submit what was queued and wait for @wait_nr completions */
+int uring_submit_and_wait(struct Uring *u, unsigned int wait_nr);
+
+/* Oldest completion not yet seen, or NULL */
+struct io_uring_cqe *uring_peek_cqe(struct Uring *u);
+void uring_cqe_seen(struct Uring *u);
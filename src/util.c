@@ -28,6 +28,28 @@ int safe_atoul(const char *s, unsigned long *ret)
     return 0;
 }
 
+int safe_atoi(const char *s, int *ret)
+{
+    char *x = NULL;
+    long l;
+
+    assert(s);
+    assert(ret);
+
+    errno = 0;
+    l = strtol(s, &x, 0);
+
+    if (!x || x == s || *x || errno)
+        return errno ? -errno : -EINVAL;
+
+    if ((long)(int)l != l)
+        return -ERANGE;
+
+    *ret = (int)l;
+
+    return 0;
+}
+
 static usec_t ts_usec(const struct timespec *ts)
 {
     if (ts->tv_sec == (time_t)-1 && ts->tv_nsec == (long)-1)
@@ -9,6 +9,7 @@
 #include "string.h"
 
 #define DIV_ROUND_UP(n, d) (((n) + (d)-1) / (d))
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
 
 #define BITS_PER_BYTE 8
 #define BITS_PER_LONG (BITS_PER_BYTE * sizeof(unsigned long))
@@ -29,6 +30,7 @@ static inline int test_bit(int n, unsigned long *bitmask)
 }
 
 int safe_atoul(const char *s, unsigned long *ret);
+int safe_atoi(const char *s, int *ret);
 
 #define max(x, y)              \
     ({                         \